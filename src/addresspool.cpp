@@ -0,0 +1,83 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "addresspool.h"
+
+void AddressPool::setup(uint32_t first, uint32_t last, uint32_t step, uint32_t start)
+{
+    this->first = first;
+    this->step = step;
+    this->count = last >= first ? (last - first) / step + 1 : 0;
+    this->next = start > first ? (start - first + step - 1) / step : 0;
+    if (next >= count)
+        next = 0;
+    this->fresh = count;
+
+    used.assign(count, false);
+    queued.assign(count, false);
+    released.clear();
+}
+
+bool AddressPool::reserve(uint32_t offset)
+{
+    if (!owns(offset) || used[index(offset)])
+        return false;
+    take(index(offset));
+    return true;
+}
+
+uint32_t AddressPool::reserve()
+{
+    while (fresh > 0)
+    {
+        uint32_t i = next;
+        next = next + 1 < count ? next + 1 : 0;
+        fresh--;
+        if (!used[i])
+            return take(i);
+    }
+
+    while (!released.empty())
+    {
+        uint32_t i = released.front();
+        released.pop_front();
+        queued[i] = false;
+        if (!used[i])
+            return take(i);
+    }
+
+    return NONE;
+}
+
+void AddressPool::release(uint32_t offset)
+{
+    uint32_t i = index(offset);
+    used[i] = false;
+    if (!queued[i])
+    {
+        queued[i] = true;
+        released.push_back(i);
+    }
+}
+
+uint32_t AddressPool::take(uint32_t index)
+{
+    used[index] = true;
+    return first + index * step;
+}
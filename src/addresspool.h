@@ -0,0 +1,64 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ADDRESSPOOL_H
+#define ADDRESSPOOL_H
+
+#include <vector>
+#include <deque>
+#include <stdint.h>
+
+/* Host addresses of the tunnel network handed out to clients, as offsets into
+ * the network: every `step`-th one from `first` to `last`. Addresses that were
+ * never handed out go first, in order from `start` on, then released ones in
+ * the order they were released, so reserving and releasing take constant time. */
+class AddressPool
+{
+public:
+    enum { NONE = 0xffffffff };
+
+    AddressPool() : first(0), step(1), count(0), next(0), fresh(0) { }
+    void setup(uint32_t first, uint32_t last, uint32_t step, uint32_t start);
+
+    bool owns(uint32_t offset) const
+    {
+        return offset >= first && (offset - first) % step == 0 && (offset - first) / step < count;
+    }
+    /* Position of an offset this pool owns among them, for tables indexed by it. */
+    uint32_t index(uint32_t offset) const { return (offset - first) / step; }
+    uint32_t size() const { return count; }
+
+    bool reserve(uint32_t offset); // false if taken or not in the pool
+    uint32_t reserve();            // any free offset, NONE if there is none
+    void release(uint32_t offset);
+
+protected:
+    uint32_t take(uint32_t index);
+
+    uint32_t first;
+    uint32_t step;
+    uint32_t count;
+    uint32_t next;                  // index of the next address never taken
+    uint32_t fresh;                 // number of them left
+    std::vector<bool> used;
+    std::vector<bool> queued;       // in released
+    std::deque<uint32_t> released;  // indexes, may have been taken again since
+};
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ADDRESSTABLE_H
+#define ADDRESSTABLE_H
+
+#include <vector>
+#include <string.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+inline uint32_t addressHash(uint32_t ip)
+{
+    /* murmur3 finalizer: every bit of the address reaches the low bits */
+    ip ^= ip >> 16;
+    ip *= 0x85ebca6b;
+    ip ^= ip >> 13;
+    ip *= 0xc2b2ae35;
+    ip ^= ip >> 16;
+    return ip;
+}
+
+inline uint32_t addressHash(const struct in6_addr &ip)
+{
+    uint32_t words[4];
+    memcpy(words, &ip, sizeof(words));
+    return addressHash(words[0] ^ addressHash(words[1] ^ addressHash(words[2] ^ addressHash(words[3]))));
+}
+
+inline bool addressEqual(uint32_t a, uint32_t b) { return a == b; }
+inline bool addressEqual(const struct in6_addr &a, const struct in6_addr &b) { return memcmp(&a, &b, sizeof(a)) == 0; }
+
+/* Open-addressing hash table from IPv4 or IPv6 addresses to 32-bit values,
+ * with linear probing. Removal shifts the following entries back instead of
+ * leaving tombstones, and the table is kept at most half full, so a lookup
+ * touches one or two neighbouring slots. */
+template <class Key>
+class AddressTable
+{
+public:
+    enum { NONE = 0xffffffff }; // no value; not to be stored
+
+    AddressTable() : slots(16), mask(15), count(0)
+    {
+        for (size_t i = 0; i < slots.size(); i++)
+            slots[i].value = NONE;
+    }
+
+    uint32_t find(const Key &key) const
+    {
+        for (uint32_t i = addressHash(key) & mask; slots[i].value != (uint32_t)NONE; i = (i + 1) & mask)
+            if (addressEqual(slots[i].key, key))
+                return slots[i].value;
+        return NONE;
+    }
+
+    void insert(const Key &key, uint32_t value)
+    {
+        if (2 * (count + 1) > slots.size())
+            grow();
+
+        uint32_t i = addressHash(key) & mask;
+        for (; slots[i].value != (uint32_t)NONE; i = (i + 1) & mask)
+            if (addressEqual(slots[i].key, key))
+            {
+                slots[i].value = value;
+                return;
+            }
+
+        slots[i].key = key;
+        slots[i].value = value;
+        count++;
+    }
+
+    void erase(const Key &key)
+    {
+        uint32_t i = addressHash(key) & mask;
+        for (; slots[i].value != (uint32_t)NONE; i = (i + 1) & mask)
+            if (addressEqual(slots[i].key, key))
+                break;
+        if (slots[i].value == (uint32_t)NONE)
+            return;
+
+        /* move back every following entry that the gap would cut off from its home slot */
+        for (uint32_t j = i;;)
+        {
+            slots[i].value = NONE;
+            for (;;)
+            {
+                j = (j + 1) & mask;
+                if (slots[j].value == (uint32_t)NONE)
+                {
+                    count--;
+                    return;
+                }
+                uint32_t home = addressHash(slots[j].key) & mask;
+                if (((j - home) & mask) >= ((j - i) & mask))
+                    break;
+            }
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+
+    uint32_t size() const { return count; }
+
+private:
+    struct Slot
+    {
+        Key key;
+        uint32_t value;
+    };
+
+    void grow()
+    {
+        std::vector<Slot> old;
+        old.swap(slots);
+        slots.resize(old.size() * 2);
+        mask = slots.size() - 1;
+        count = 0;
+        for (size_t i = 0; i < slots.size(); i++)
+            slots[i].value = NONE;
+        for (size_t i = 0; i < old.size(); i++)
+            if (old[i].value != (uint32_t)NONE)
+                insert(old[i].key, old[i].value);
+    }
+
+    std::vector<Slot> slots;
+    uint32_t mask;
+    uint32_t count;
+};
+
+#endif
@@ -65,3 +65,26 @@ bool Auth::verifyChallengeResponseHMAC(const Challenge &challenge, const char *r
 {
     return Hmac::verify(passphrase, &challenge[0], challenge.size(), response, responseLen);
 }
+
+int Auth::writeResponse(const Challenge &challenge, bool hmac, char *buffer) const
+{
+    if (hmac)
+    {
+        Challenge response = getResponseHMAC(challenge);
+        memcpy(buffer, &response[0], response.size());
+        return response.size();
+    }
+
+    Response response = getResponse(challenge);
+    memcpy(buffer, &response, sizeof(response));
+    return sizeof(response);
+}
+
+bool Auth::checkResponse(const Challenge &challenge, bool hmac, const char *response, int length) const
+{
+    if (hmac)
+        return length == (int)Hmac::SHA256_SIZE && verifyChallengeResponseHMAC(challenge, response, length);
+
+    Response rightResponse = getResponse(challenge);
+    return length == (int)sizeof(Response) && memcmp(&rightResponse, response, length) == 0;
+}
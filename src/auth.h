@@ -43,6 +43,11 @@ public:
     Challenge getResponseHMAC(const Challenge &challenge) const;
     bool verifyChallengeResponseHMAC(const Challenge &challenge, const char *response, size_t responseLen) const;
 
+    /* The HMAC-SHA256 or legacy SHA1 response to `challenge`, written to
+     * `buffer`; returns its length. */
+    int writeResponse(const Challenge &challenge, bool hmac, char *buffer) const;
+    bool checkResponse(const Challenge &challenge, bool hmac, const char *response, int length) const;
+
 protected:
     std::string passphrase;
     std::string challenge;
@@ -0,0 +1,92 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "bpf.h"
+
+#ifdef LINUX
+
+#include <sys/socket.h>
+
+void BpfProgram::load(uint16_t size, uint32_t offset)
+{
+    statement(BPF_LD | size | BPF_ABS, offset);
+}
+
+void BpfProgram::statement(uint16_t op, uint32_t k)
+{
+    struct sock_filter instruction = BPF_STMT(op, k);
+    code.push_back(instruction);
+}
+
+/* The jumps to the reject statement are filled in by attach(). */
+void BpfProgram::rejectUnless(uint32_t value)
+{
+    struct sock_filter jump = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, value, 0, 0);
+    code.push_back(jump);
+}
+
+void BpfProgram::rejectIfAny(uint32_t bits)
+{
+    struct sock_filter jump = BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, bits, 0, 0);
+    code.push_back(jump);
+}
+
+bool BpfProgram::attach(int fd)
+{
+    std::vector<struct sock_filter> program = code;
+    struct sock_filter accept = BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+    struct sock_filter reject = BPF_STMT(BPF_RET | BPF_K, 0);
+    program.push_back(accept);
+    program.push_back(reject);
+
+    int rejectAt = program.size() - 1;
+    for (int i = 0; i < rejectAt; i++)
+    {
+        if (BPF_CLASS(program[i].code) != BPF_JMP)
+            continue;
+        if (BPF_OP(program[i].code) == BPF_JSET)
+            program[i].jt = rejectAt - i - 1;
+        else
+            program[i].jf = rejectAt - i - 1;
+    }
+
+    struct sock_fprog filter;
+    filter.len = program.size();
+    filter.filter = &program[0];
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) == 0;
+}
+
+bool BpfProgram::attach(int fd, int level, int option)
+{
+    struct sock_fprog program;
+    program.len = code.size();
+    program.filter = &code[0];
+    return setsockopt(fd, level, option, &program, sizeof(program)) == 0;
+}
+
+bool BpfProgram::rejectAll(int fd)
+{
+    struct sock_filter reject = BPF_STMT(BPF_RET | BPF_K, 0);
+    struct sock_fprog filter;
+    filter.len = 1;
+    filter.filter = &reject;
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) == 0;
+}
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BPF_H
+#define BPF_H
+
+#ifdef LINUX
+
+#include <vector>
+#include <stdint.h>
+#include <linux/filter.h>
+
+/* Classic BPF socket filter put together as a list of tests on the packet:
+ * the first test that fails rejects it, a packet passing all of them is
+ * accepted. Loads past the end of the packet reject it as well. */
+class BpfProgram
+{
+public:
+    /* Load the byte, half word or word (BPF_B, BPF_H, BPF_W) at `offset`. */
+    void load(uint16_t size, uint32_t offset);
+    void statement(uint16_t code, uint32_t k);
+
+    void rejectUnless(uint32_t value);     // the loaded value equals `value`
+    void rejectIfAny(uint32_t bits);       // none of `bits` is set in it
+
+    /* Replace the filter of socket `fd`; false with errno set on error. */
+    bool attach(int fd);
+    /* Set the program as is, without the final accept and reject statements,
+     * as socket option `option` (e.g. PACKET_FANOUT_DATA). */
+    bool attach(int fd, int level, int option);
+    static bool rejectAll(int fd);
+
+protected:
+    std::vector<struct sock_filter> code;
+};
+
+#endif
+
+#endif
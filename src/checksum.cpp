@@ -0,0 +1,232 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "checksum.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+/* The kernels sum 16-bit words in memory order, into a 64-bit value that is
+ * not folded yet, and copy the data to `to` on the way unless it is NULL. The
+ * one's complement sum does not depend on byte order, so the result only has
+ * to be swapped into host order once folded. */
+typedef uint64_t (*SumKernel)(const char *data, int length, char *to);
+
+static uint64_t addCarry(uint64_t sum, uint64_t value)
+{
+    sum += value;
+    return sum + (sum < value);
+}
+
+static uint16_t fold64(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+static uint64_t sumWords(const char *data, int length, char *to)
+{
+    uint64_t sum = 0;
+    for (; length >= 8; data += 8, length -= 8)
+    {
+        uint64_t value;
+        memcpy(&value, data, 8);
+        if (to)
+        {
+            memcpy(to, &value, 8);
+            to += 8;
+        }
+        sum = addCarry(sum, value);
+    }
+
+    /* the rest keeps its place in a word, an odd last byte pairs with a zero */
+    uint64_t value = 0;
+    memcpy(&value, data, length);
+    if (to)
+        memcpy(to, data, length);
+    return addCarry(sum, value);
+}
+
+#ifdef CHECKSUM_X86
+/* 16-bit words are widened into 32-bit lanes, which cannot overflow within
+ * 4096 vectors; the lanes are added up after each such run. */
+#define CHECKSUM_RUN 4096
+
+__attribute__((target("sse2")))
+static uint64_t sumSse2(const char *data, int length, char *to)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t sum = 0;
+
+    while (length >= 16)
+    {
+        int vectors = length / 16 < CHECKSUM_RUN ? length / 16 : CHECKSUM_RUN;
+        __m128i lanes = zero;
+        for (int i = 0; i < vectors; i++, data += 16)
+        {
+            __m128i value = _mm_loadu_si128((const __m128i *)data);
+            if (to)
+            {
+                _mm_storeu_si128((__m128i *)to, value);
+                to += 16;
+            }
+            lanes = _mm_add_epi32(lanes, _mm_unpacklo_epi16(value, zero));
+            lanes = _mm_add_epi32(lanes, _mm_unpackhi_epi16(value, zero));
+        }
+        length -= vectors * 16;
+
+        uint32_t lane[4];
+        _mm_storeu_si128((__m128i *)lane, lanes);
+        sum += (uint64_t)lane[0] + lane[1] + lane[2] + lane[3];
+    }
+
+    return addCarry(sum, sumWords(data, length, to));
+}
+
+__attribute__((target("avx2")))
+static uint64_t sumAvx2(const char *data, int length, char *to)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t sum = 0;
+
+    while (length >= 32)
+    {
+        int vectors = length / 32 < CHECKSUM_RUN ? length / 32 : CHECKSUM_RUN;
+        __m256i lanes = zero;
+        for (int i = 0; i < vectors; i++, data += 32)
+        {
+            __m256i value = _mm256_loadu_si256((const __m256i *)data);
+            if (to)
+            {
+                _mm256_storeu_si256((__m256i *)to, value);
+                to += 32;
+            }
+            lanes = _mm256_add_epi32(lanes, _mm256_unpacklo_epi16(value, zero));
+            lanes = _mm256_add_epi32(lanes, _mm256_unpackhi_epi16(value, zero));
+        }
+        length -= vectors * 32;
+
+        uint32_t lane[8];
+        _mm256_storeu_si256((__m256i *)lane, lanes);
+        for (int i = 0; i < 8; i++)
+            sum += lane[i];
+    }
+
+    return addCarry(sum, sumWords(data, length, to));
+}
+#endif
+
+static SumKernel kernel = sumWords;
+static const char *kernelNameValue = "words";
+
+static bool selectKernel()
+{
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernel = sumAvx2;
+        kernelNameValue = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        kernel = sumSse2;
+        kernelNameValue = "sse2";
+    }
+#endif
+    return true;
+}
+
+static bool kernelSelected = selectKernel();
+
+uint32_t Checksum::add(uint32_t sum, const char *data, int length)
+{
+    return sum + ntohs(fold64(kernel(data, length, NULL)));
+}
+
+uint32_t Checksum::add(uint32_t sum, const char *data, int length, int offset)
+{
+    uint32_t part = ntohs(fold64(kernel(data, length, NULL)));
+    if (offset & 1)
+        part = ((part & 0xff) << 8) | (part >> 8); // every byte lands in the other half of its word
+    return sum + part;
+}
+
+uint32_t Checksum::copy(char *to, const char *from, int length, uint32_t sum)
+{
+    return sum + ntohs(fold64(kernel(from, length, to)));
+}
+
+uint32_t Checksum::addPseudoHeader(uint32_t sum, const char *addresses, int protocol, int length)
+{
+    return add(sum, addresses, 8) + protocol + length;
+}
+
+uint16_t Checksum::fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+uint16_t Checksum::update(uint16_t checksum, uint16_t oldWord, uint16_t newWord)
+{
+    uint32_t sum = (uint16_t)~checksum + (uint16_t)~oldWord + (uint32_t)newWord;
+    return fold(sum);
+}
+
+const char *Checksum::kernelName()
+{
+    (void)kernelSelected;
+    return kernelNameValue;
+}
+
+bool Checksum::useKernel(const char *name)
+{
+    if (strcmp(name, "words") == 0)
+    {
+        kernel = sumWords;
+        kernelNameValue = "words";
+        return true;
+    }
+#ifdef CHECKSUM_X86
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2"))
+    {
+        kernel = sumSse2;
+        kernelNameValue = "sse2";
+        return true;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+    {
+        kernel = sumAvx2;
+        kernelNameValue = "avx2";
+        return true;
+    }
+#endif
+    return false;
+}
@@ -0,0 +1,50 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+
+/* Internet checksum (RFC 1071) in two steps: add() accumulates 16-bit words
+ * in host order, fold() turns the sum into the value stored in a header. The
+ * bulk of the summing is done by the widest kernel the CPU supports (AVX2 or
+ * SSE2 on x86, 64-bit words elsewhere), chosen at startup. */
+class Checksum
+{
+public:
+    static uint32_t add(uint32_t sum, const char *data, int length);
+    /* Same for data that starts `offset` bytes into the checksummed range. */
+    static uint32_t add(uint32_t sum, const char *data, int length, int offset);
+    /* Copy `length` bytes and add them to `sum` in the same pass. */
+    static uint32_t copy(char *to, const char *from, int length, uint32_t sum = 0);
+    /* Sum of the IPv4 pseudo header, from the addresses at `addresses` (source and destination, 8 bytes). */
+    static uint32_t addPseudoHeader(uint32_t sum, const char *addresses, int protocol, int length);
+    static uint16_t fold(uint32_t sum); // complemented, ready to be stored
+
+    /* Stored checksum after one 16-bit word it covers changed (RFC 1624, eqn. 3). */
+    static uint16_t update(uint16_t checksum, uint16_t oldWord, uint16_t newWord);
+
+    static const char *kernelName();
+    /* Switch to the kernel called `name` ("avx2", "sse2" or "words"), for tests
+     * and benchmarks. False if the CPU or the build lacks it. */
+    static bool useKernel(const char *name);
+};
+
+#endif
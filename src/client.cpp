@@ -28,6 +28,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <syslog.h>
+#include <inttypes.h>
 
 using std::vector;
 using std::string;
@@ -38,8 +39,11 @@ Client::Client(int tunnelMtu, const string *deviceName, uint32_t serverIp,
                int maxPolls, const string &passphrase, uid_t uid, gid_t gid,
                bool changeEchoId, bool changeEchoSeq, uint32_t desiredIp,
                int recvBufSize, int sndBufSize, int rateKbps,
-               bool useIPv6, const struct in6_addr *serverIp6)
-    : Worker(tunnelMtu, deviceName, false, uid, gid, recvBufSize, sndBufSize, rateKbps, !useIPv6, useIPv6), auth(passphrase)
+               bool useIPv6, const struct in6_addr *serverIp6, bool useUring,
+               const string *ringDevice)
+    : Worker(tunnelMtu, deviceName, false, uid, gid, recvBufSize, sndBufSize, rateKbps, !useIPv6, useIPv6, useUring,
+             ringDevice), auth(passphrase),
+      downstream(HANS_CC_INITIAL_RATE, 0, HANS_CC_LOSS_THRESHOLD)
 {
     this->serverIp = serverIp;
     this->isIPv6 = useIPv6;
@@ -57,46 +61,70 @@ Client::Client(int tunnelMtu, const string *deviceName, uint32_t serverIp,
     this->changeEchoSeq = changeEchoSeq;
     this->nextEchoSequence = Utility::rand();
 
+    /* the kernel drops all ICMP but the server's replies */
+    if (echo)
+        echo->acceptOnly(true, Server::magic.data, false, serverIp);
+    if (echo6)
+        echo6->acceptOnly(true, Server::magic.data, false, &this->serverIp6);
+
     state = STATE_CLOSED;
+
+    this->askSequencing = SEQUENCE_ENABLED;
+    this->askFec = FEC_ENABLED;
+
+    this->probes = false;
+    this->pollWindow = 0;
+    this->pollsOut = 0;
+    this->probeTimer = NO_TIMER;
+    this->probeStamp = 0;
+    this->probesSent = 0;
+    this->probeTimeouts = 0;
+    this->dataSinceProbe = false;
 }
 
 Client::~Client()
 {
-
+    endPeer(server);
 }
 
 void Client::sendConnectionRequest()
 {
-    Server::ClientConnectData *connectData = (Server::ClientConnectData *)echoSendPayloadBuffer();
-    connectData->version = 2;
-    connectData->maxPolls = maxPolls;
-    connectData->desiredIp = htonl(desiredIp);
+    int features = (askSequencing ? Server::FEATURE_SEQUENCE : 0) | (askFec ? Server::FEATURE_FEC : 0) |
+        (useHmac ? Server::FEATURE_HMAC : 0);
+    int length = Server::writeConnectionRequest(echoSendPayloadBuffer(), maxPolls, desiredIp, features);
+
+    /* the server numbers from the connection on, and agrees anew */
+    endPeer(server);
 
     syslog(LOG_DEBUG, "sending connection request (HMAC)");
 
-    sendEchoToServer(TunnelHeader::TYPE_CONNECTION_REQUEST, sizeof(Server::ClientConnectData));
+    sendEchoToServer(TunnelHeader::TYPE_CONNECTION_REQUEST, length);
 
     state = STATE_CONNECTION_REQUEST_SENT;
     setTimeout(5000);
 }
 
+/* Servers that know FEATURE_HMAC agree to it with a longer challenge; older
+ * ones send CHALLENGE_SIZE bytes and get the legacy response. */
+int Client::challengeResponse(const Auth &auth, bool askedHmac, const char *challenge, int length, char *response)
+{
+    bool hmac = askedHmac && length == HMAC_CHALLENGE_SIZE;
+    if (length != CHALLENGE_SIZE && !hmac)
+        return 0;
+    return auth.writeResponse(Auth::Challenge(challenge, challenge + length), hmac, response);
+}
+
 void Client::sendChallengeResponse(int dataLength)
 {
-    if (dataLength != CHALLENGE_SIZE)
+    int length = challengeResponse(auth, useHmac, echoReceivePayloadBuffer(), dataLength, echoSendPayloadBuffer());
+    if (length == 0)
         throw Exception("invalid challenge received");
 
     state = STATE_CHALLENGE_RESPONSE_SENT;
 
-    syslog(LOG_DEBUG, "sending challenge response");
-
-    vector<char> challenge;
-    challenge.resize(dataLength);
-    memcpy(&challenge[0], echoReceivePayloadBuffer(), dataLength);
-
-    Auth::Response response = auth.getResponse(challenge);
+    syslog(LOG_DEBUG, "sending challenge response (%s)", dataLength == HMAC_CHALLENGE_SIZE ? "HMAC" : "SHA1");
 
-    memcpy(echoSendPayloadBuffer(), (char *)&response, sizeof(Auth::Response));
-    sendEchoToServer(TunnelHeader::TYPE_CHALLENGE_RESPONSE, sizeof(Auth::Response));
+    sendEchoToServer(TunnelHeader::TYPE_CHALLENGE_RESPONSE, length);
 
     setTimeout(5000);
 }
@@ -118,6 +146,14 @@ bool Client::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
     if (header.magic != Server::magic)
         return false;
 
+    if (header.type != TunnelHeader::TYPE_PROBE)
+    {
+        counts.received++;
+        counts.receivedBytes += dataLength + headerSize();
+        if (pollsOut > 0)
+            pollsOut--;
+    }
+
     switch (header.type)
     {
         case TunnelHeader::TYPE_RESET_CONNECTION:
@@ -142,7 +178,7 @@ bool Client::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
         case TunnelHeader::TYPE_CONNECTION_ACCEPT:
             if (state == STATE_CHALLENGE_RESPONSE_SENT)
             {
-                if (dataLength != sizeof(uint32_t) && dataLength != 5)
+                if (dataLength < (int)sizeof(uint32_t) || dataLength > 7)
                 {
                     throw Exception("invalid ip received");
                     return true;
@@ -156,6 +192,19 @@ bool Client::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
                     numChannels = (unsigned char)buf[4];
                 if (numChannels < 1)
                     numChannels = 1;
+                int prefixLength = dataLength >= 6 ? (unsigned char)buf[5] : 24;
+                if (prefixLength < 1 || prefixLength > 30)
+                    throw Exception("invalid network received");
+                int features = dataLength >= 7 ? (unsigned char)buf[6] : 0;
+
+                if (askSequencing && (features & Server::FEATURE_SEQUENCE))
+                    server.sequencing = newSequencing(SEND_BUF_SIZE);
+                else if (askSequencing)
+                    syslog(LOG_WARNING, "the server does not support sequencing (-N)");
+                if (askFec && (features & Server::FEATURE_FEC))
+                    server.fec = newFec();
+                else if (askFec)
+                    syslog(LOG_WARNING, "the server does not support forward error correction (-F)");
                 if (ip != clientIp)
                 {
                     if (privilegesDropped)
@@ -163,10 +212,12 @@ bool Client::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
 
                     clientIp = ip;
                     desiredIp = ip;
-                    tun.setIp(ip, (ip & 0xffffff00) + 1);
+                    tun.setIp(ip, (ip & Utility::netmask(prefixLength)) + 1, prefixLength);
                 }
                 state = STATE_ESTABLISHED;
 
+                probes = congestionControl;
+
                 dropPrivileges();
                 startPolling();
 
@@ -182,7 +233,36 @@ bool Client::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
         case TunnelHeader::TYPE_DATA:
             if (state == STATE_ESTABLISHED)
             {
-                handleDataFromServer(dataLength);
+                handleDataFromServer(TunnelHeader::TYPE_DATA, dataLength);
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_DATA_SEQ:
+            if (state == STATE_ESTABLISHED && server.sequencing)
+            {
+                handleDataFromServer(TunnelHeader::TYPE_DATA_SEQ, dataLength);
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_DATA_FEC:
+        case TunnelHeader::TYPE_FEC_PARITY:
+            if (state == STATE_ESTABLISHED && server.fec)
+            {
+                handleDataFromServer((TunnelHeader::Type)header.type, dataLength);
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_NACK:
+            if (state == STATE_ESTABLISHED && server.sequencing)
+            {
+                handleNackFromServer(dataLength);
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_PROBE:
+            if (state == STATE_ESTABLISHED && probes)
+            {
+                handleProbeReply(dataLength);
                 return true;
             }
             break;
@@ -195,15 +275,35 @@ bool Client::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
     return true;
 }
 
-void Client::sendEchoToServer(Worker::TunnelHeader::Type type, int dataLength)
+void Client::sendEchoToServer(Worker::TunnelHeader::Type type, int dataLength, const char *payload)
 {
+    /* data goes out copied behind its header, and a full block is closed by its parity */
+    if (server.fec && (type == TunnelHeader::TYPE_DATA || type == TunnelHeader::TYPE_DATA_SEQ))
+    {
+        dataLength = server.fec->encode(echoSendPayloadBuffer(), payload, dataLength, type);
+        sendEchoToServer(TunnelHeader::TYPE_DATA_FEC, dataLength);
+        sendParity(server, false);
+        return;
+    }
+
     if (maxPolls == 0 && state == STATE_ESTABLISHED)
         setTimeout(KEEP_ALIVE_INTERVAL);
 
+    bool sent;
     if (isIPv6)
-        sendEcho6(magic, type, dataLength, serverIp6, false, nextEchoId, nextEchoSequence);
+        sent = sendEcho6(magic, type, dataLength, serverIp6, false, nextEchoId, nextEchoSequence, payload);
     else
-        sendEcho(magic, type, dataLength, serverIp, false, nextEchoId, nextEchoSequence);
+        sent = sendEcho(magic, type, dataLength, serverIp, false, nextEchoId, nextEchoSequence, payload);
+
+    /* the server keeps every request but a probe as a poll, the oldest
+       going when there are more than its ring holds */
+    if (sent && type != TunnelHeader::TYPE_PROBE)
+    {
+        counts.sent++;
+        counts.sentBytes += dataLength + headerSize();
+        if (pollsOut < maxPolls * numChannels)
+            pollsOut++;
+    }
 
     if (changeEchoId)
         nextEchoId = nextEchoId + 38543; // some random prime
@@ -220,24 +320,173 @@ void Client::startPolling()
     else
     {
         int n = maxPolls * (numChannels > 0 ? numChannels : 1);
+        pollsOut = 0;
+        pollWindow = n;
         for (int i = 0; i < n; i++)
             sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
         setTimeout(POLL_INTERVAL);
     }
+
+    /* the server counts from the connection on */
+    lastCounts.at = Time::ZERO;
+    probeStamp = 0;
+    probeTimeouts = 0;
+    if (probes)
+        sendProbe();
+}
+
+/* Keep the window of polls outstanding: one per reply, more or fewer as the window changes. */
+void Client::sendPolls()
+{
+    if (!probes)
+    {
+        sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+        return;
+    }
+
+    for (int n = pollWindow - pollsOut; n > 0; n--)
+        sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+}
+
+void Client::sendProbe()
+{
+    if (++probesSent == 0)
+        probesSent = 1;
+    probeStamp = probesSent;
+    uint32_t stamp = htonl(probeStamp);
+    memcpy(echoSendPayloadBuffer(), &stamp, sizeof(stamp));
+    probeCounts = counts;
+    probeCounts.at = now;
+    dataSinceProbe = false;
+    sendEchoToServer(TunnelHeader::TYPE_PROBE, sizeof(stamp));
+
+    if (probeTimer != NO_TIMER)
+        cancelTimer(probeTimer);
+    probeTimer = addTimer(HANS_CC_PROBE_TIMEOUT, PROBE_TIMER);
+}
+
+/*
+ * A probe reply ends a round for both directions: the server's counters tell
+ * how much of what we sent arrived, ours how much of what it sent did. Lost
+ * requests and replies also take the polls they stood for.
+ */
+void Client::handleProbeReply(int dataLength)
+{
+    Server::ProbeReply reply;
+    if (dataLength != sizeof(reply))
+        return;
+    memcpy(&reply, echoReceivePayloadBuffer(), sizeof(reply));
+    if (probeStamp == 0 || ntohl(reply.stamp) != probeStamp)
+        return; // late
+    probeStamp = 0;
+    probeTimeouts = -1;
+
+    Time rtt = now - probeCounts.at;
+    congestion.onRtt(now, rtt);
+    downstream.onRtt(now, rtt);
+
+    Counts current = counts;
+    current.at = now;
+    current.sent = probeCounts.sent;
+    current.sentBytes = probeCounts.sentBytes;
+    current.delivered = ntohl(reply.packetsReceived);
+    current.deliveredBytes = ntohl(reply.bytesReceived);
+    current.serverSent = ntohl(reply.packetsSent);
+
+    if (lastCounts.at != Time::ZERO)
+    {
+        Time interval = now - lastCounts.at;
+
+        int delivered = current.delivered - lastCounts.delivered;
+        int lostSent = (int)(current.sent - lastCounts.sent) - delivered;
+        if (lostSent < 0)
+            lostSent = 0;
+        congestionRound(interval, current.deliveredBytes - lastCounts.deliveredBytes, delivered, lostSent,
+                        current.sentBytes - lastCounts.sentBytes);
+
+        int received = current.received - lastCounts.received;
+        uint32_t receivedBytes = current.receivedBytes - lastCounts.receivedBytes;
+        int lostReceived = (int)(current.serverSent - lastCounts.serverSent) - received;
+        if (lostReceived < 0)
+            lostReceived = 0;
+        downstream.onRound(interval, receivedBytes, received, lostReceived, ntohl(reply.pending) == 0);
+
+        pollsOut -= lostSent + lostReceived;
+        if (pollsOut < 0)
+            pollsOut = 0;
+
+        /* replies, and the polls they make us send, wait for the next loop
+           iterations: the rounds are the least RTT the window allows for */
+        int window = downstream.window(received > 0 ? receivedBytes / received : tunnelMtu, HANS_CC_MIN_ROUND);
+        int maxWindow = maxPolls * numChannels;
+        if (window > 0 && maxWindow > 0)
+            pollWindow = window < HANS_CC_MIN_POLLS ? HANS_CC_MIN_POLLS : window > maxWindow ? maxWindow : window;
+    }
+    lastCounts = current;
+
+    if (maxPolls != 0)
+        sendPolls();
+
+    Time round = congestion.minRtt();
+    if (round < Time(HANS_CC_MIN_ROUND))
+        round = HANS_CC_MIN_ROUND;
+    if (probeTimer != NO_TIMER)
+        cancelTimer(probeTimer);
+    probeTimer = addTimer(round, PROBE_TIMER);
+}
+
+/* Probing stops while no data flows, until some does, and for good if the
+ * server ignores the first probes: servers before -C take them for polls. */
+void Client::dataFlowing()
+{
+    dataSinceProbe = true;
+    if (probes && probeTimer == NO_TIMER)
+        sendProbe();
 }
 
-void Client::handleDataFromServer(int dataLength)
+void Client::handleTimer(uint32_t data)
 {
-    if (dataLength == 0)
+    if (data & TIMER_KINDS)
     {
-        syslog(LOG_WARNING, "received empty data packet");
+        handlePeerTimer(server, data);
         return;
     }
+    if (data != PROBE_TIMER)
+        return;
+    probeTimer = NO_TIMER;
+    if (state != STATE_ESTABLISHED || !probes)
+        return;
+    if (probeStamp != 0 && probeTimeouts >= 0 && ++probeTimeouts == 3)
+    {
+        syslog(LOG_WARNING, "the server does not answer probes, no congestion control");
+        probes = false;
+        return;
+    }
+    if (dataSinceProbe)
+        sendProbe();
+}
 
-    sendToTun(dataLength);
+void Client::sendToPeer(Peer &, TunnelHeader::Type type, int dataLength, const char *payload)
+{
+    sendEchoToServer(type, dataLength, payload);
+}
+
+void Client::handleDataFromServer(TunnelHeader::Type type, int dataLength)
+{
+    receiveFromPeer(server, type, dataLength);
 
     if (maxPolls != 0)
-        sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+        sendPolls();
+    dataFlowing();
+}
+
+/* The NACK took a poll like any reply. */
+void Client::handleNackFromServer(int dataLength)
+{
+    handleNack(server, dataLength);
+
+    if (maxPolls != 0)
+        sendPolls();
 }
 
 void Client::handleTunData(int dataLength, uint32_t, uint32_t)
@@ -245,7 +494,14 @@ void Client::handleTunData(int dataLength, uint32_t, uint32_t)
     if (state != STATE_ESTABLISHED)
         return;
 
-    sendEchoToServer(TunnelHeader::TYPE_DATA, dataLength);
+    if (server.sequencing)
+    {
+        const char *payload = server.sequencing->send.add(tunPayloadBuffer(), dataLength);
+        sendEchoToServer(TunnelHeader::TYPE_DATA_SEQ, dataLength, payload);
+    }
+    else
+        sendEchoToServer(TunnelHeader::TYPE_DATA, dataLength, tunPayloadBuffer());
+    dataFlowing();
 }
 
 void Client::handleTimeout()
@@ -274,3 +530,22 @@ void Client::run()
 
     Worker::run();
 }
+
+void Client::setSequencing()
+{
+    askSequencing = true;
+}
+
+void Client::setFec()
+{
+    askFec = true;
+}
+
+void Client::dumpStats() const
+{
+    Worker::dumpStats();
+    if (probes)
+        syslog(LOG_INFO, "stats: cc_rate_kbps=%d cc_poll_window=%d cc_min_rtt_us=%" PRId64 " cc_lost_sent=%" PRIu64 " cc_lost_received=%" PRIu64,
+               congestion.rateKbps(), pollWindow, congestion.minRtt().microseconds(),
+               congestion.lostPackets(), downstream.lostPackets());
+}
@@ -34,12 +34,21 @@ public:
            int maxPolls, const std::string &passphrase, uid_t uid, gid_t gid,
            bool changeEchoId, bool changeEchoSeq, uint32_t desiredIp,
            int recvBufSize = 256 * 1024, int sndBufSize = 256 * 1024, int rateKbps = 0,
-           bool useIPv6 = false, const struct in6_addr *serverIp6 = NULL);
+           bool useIPv6 = false, const struct in6_addr *serverIp6 = NULL, bool useUring = false,
+           const std::string *ringDevice = NULL);
     virtual ~Client();
 
     virtual void run();
+    virtual void dumpStats() const;
+    virtual void setSequencing();
+    virtual void setFec();
 
     static const Worker::TunnelHeader::Magic magic;
+
+    /* Write the response to the challenge of `length` bytes to `response`,
+     * with an HMAC if `askedHmac` and the server agreed; returns its length,
+     * 0 if the challenge is invalid. */
+    static int challengeResponse(const Auth &auth, bool askedHmac, const char *challenge, int length, char *response);
 protected:
     enum State
     {
@@ -53,12 +62,20 @@ protected:
     virtual bool handleEchoData6(const Worker::TunnelHeader &header, int dataLength, const struct in6_addr &realIp, bool reply, uint16_t id, uint16_t seq);
     virtual void handleTunData(int dataLength, uint32_t sourceIp, uint32_t destIp);
     virtual void handleTimeout();
+    virtual void handleTimer(uint32_t data);
 
-    void handleDataFromServer(int length);
+    virtual void sendToPeer(Peer &peer, TunnelHeader::Type type, int dataLength, const char *payload);
+    void handleDataFromServer(TunnelHeader::Type type, int dataLength);
+    void handleNackFromServer(int dataLength);
 
     void startPolling();
+    void sendPolls();
+
+    void sendProbe();
+    void handleProbeReply(int dataLength);
+    void dataFlowing();
 
-    void sendEchoToServer(Worker::TunnelHeader::Type type, int dataLength);
+    void sendEchoToServer(Worker::TunnelHeader::Type type, int dataLength, const char *payload = NULL);
     void sendChallengeResponse(int dataLength);
     void sendConnectionRequest();
 
@@ -81,6 +98,42 @@ protected:
     uint16_t nextEchoSequence;
 
     State state;
+
+    bool askSequencing;      // -N
+    bool askFec;             // -F
+    Peer server;             // what the server agreed to of them
+
+    /* Congestion control: a probe goes out about once per RTT while data
+     * flows, and its reply closes a round of both directions. */
+    struct Counts
+    {
+        Counts() : sent(0), sentBytes(0), delivered(0), deliveredBytes(0), serverSent(0), received(0),
+                   receivedBytes(0) { }
+
+        Time at;
+        uint32_t sent;           // packets to the server
+        uint32_t sentBytes;
+        uint32_t delivered;      // of them, as the server counted
+        uint32_t deliveredBytes;
+        uint32_t serverSent;     // packets from the server, as it counted
+        uint32_t received;       // of them
+        uint32_t receivedBytes;
+    };
+
+    enum { PROBE_TIMER = 0 }; // besides the server's, of TIMER_KINDS
+
+    bool probes;           // the server answers them, with -C
+    Congestion downstream; // of what the server sends, held to a window of polls
+    int pollWindow;        // polls to keep outstanding
+    int pollsOut;          // requests the server may hold as polls
+    uint32_t probeTimer;
+    uint32_t probeStamp;   // of the probe in flight, 0 if none
+    uint32_t probesSent;
+    int probeTimeouts;     // before the first reply, -1 after it
+    Counts probeCounts;    // when it was sent
+    bool dataSinceProbe;
+    Counts counts;         // probes aside
+    Counts lastCounts;     // at the last probe reply, `at` ZERO if none
 };
 
 #endif
@@ -23,18 +23,151 @@
 #define POLL_INTERVAL 2000
 
 #define CHALLENGE_SIZE 20
+/* Challenge size for clients that asked for FEATURE_HMAC, which tells them the server agreed. */
+#define HMAC_CHALLENGE_SIZE 32
 
+/* Sequenced data with NACK retransmission: whether clients ask for it without -N, and the last packets kept for resending per direction. */
 #define SEQUENCE_ENABLED 0
-#define SEND_BUF_SIZE 64
+#define SEND_BUF_SIZE 256
+
+/* NACKs: milliseconds before a range is NACKed again, and times it is NACKed before it is given up. */
+#ifndef HANS_NACK_INTERVAL
+#define HANS_NACK_INTERVAL 50
+#endif
+#ifndef HANS_NACK_TRIES
+#define HANS_NACK_TRIES 3
+#endif
+
+/* Forward error correction: whether clients ask for it without -F. */
+#define FEC_ENABLED 0
+
+/* FEC blocks: data packets per parity packet, at least and at most (16 at most). */
+#ifndef HANS_FEC_MIN_BLOCK
+#define HANS_FEC_MIN_BLOCK 2
+#endif
+#ifndef HANS_FEC_MAX_BLOCK
+#define HANS_FEC_MAX_BLOCK 16
+#endif
+/* FEC: blocks are sized for this many losses per 1000 blocks at the loss the peer measured. */
+#ifndef HANS_FEC_BLOCK_LOSS
+#define HANS_FEC_BLOCK_LOSS 125
+#endif
+/* FEC: milliseconds after its first packet that a block not yet full is closed by a parity of what it has. */
+#ifndef HANS_FEC_FLUSH
+#define HANS_FEC_FLUSH 10
+#endif
 
 /* Multiplexing: number of logical channels (POLL/reply streams). 1 = original; 4 or 8 = more in-flight, higher throughput. */
 #ifndef NUM_CHANNELS
 #define NUM_CHANNELS 8
 #endif
 
-/* ICMP recv batch: 1 = original behavior, fair with multiple flows; larger = more throughput but unfair (0 KB/s on some iperf3 streams) */
+/* ICMP recv batch: datagrams pulled per recvmmsg. A batch is dispatched round-robin per client, so larger values do not starve other clients. 1 = original behavior. */
 #ifndef HANS_RECV_BATCH_MAX
-#define HANS_RECV_BATCH_MAX 1
+#define HANS_RECV_BATCH_MAX 64
+#endif
+
+/* ICMP send batch: datagrams queued per sendmmsg, flushed once per event-loop iteration or when full. 1 = one send per packet. */
+#ifndef HANS_SEND_BATCH_MAX
+#define HANS_SEND_BATCH_MAX 64
+#endif
+
+/* Event-loop budgets: the most packets one loop iteration takes from the tunnel and from each ICMP socket before the other sources, timers and signals get their turn. */
+#ifndef HANS_TUN_BUDGET
+#define HANS_TUN_BUDGET 64
+#endif
+#ifndef HANS_ECHO_BUDGET
+#define HANS_ECHO_BUDGET 64
+#endif
+
+/* Tunnel reads: packets drained from the device in a row per readiness event, within HANS_TUN_BUDGET. 1 = alternate single reads with the ICMP sockets. */
+#ifndef HANS_TUN_BATCH_MAX
+#define HANS_TUN_BATCH_MAX 32
+#endif
+
+/* io_uring engine (-U): tunnel reads kept posted, tunnel writes and ICMP sends in flight, provided ICMP receive buffers (a power of two). */
+#ifndef HANS_URING_TUN_READS
+#define HANS_URING_TUN_READS 16
+#endif
+#ifndef HANS_URING_TUN_WRITES
+#define HANS_URING_TUN_WRITES 64
+#endif
+#ifndef HANS_URING_SENDS
+#define HANS_URING_SENDS 128
+#endif
+#ifndef HANS_URING_RECV_BUFFERS
+#define HANS_URING_RECV_BUFFERS 256
+#endif
+
+/* Pacing (-R): packets over the rate wait for their departure time in a queue of at most this many, further ones are dropped. */
+#ifndef HANS_PACE_BACKLOG
+#define HANS_PACE_BACKLOG 256
+#endif
+
+/* Kernel pacing (-K): packets are handed to the kernel at most this many milliseconds ahead of their departure time, later ones are dropped. */
+#ifndef HANS_TXTIME_HORIZON
+#define HANS_TXTIME_HORIZON 250
+#endif
+
+/* Congestion control (-C): pacing rate in Kbps until the first measurement, fewest polls the client keeps outstanding, loss in percent that makes a round cap the bandwidth estimate. */
+#ifndef HANS_CC_INITIAL_RATE
+#define HANS_CC_INITIAL_RATE 2000
+#endif
+#ifndef HANS_CC_MIN_POLLS
+#define HANS_CC_MIN_POLLS 4
+#endif
+#ifndef HANS_CC_LOSS_THRESHOLD
+#define HANS_CC_LOSS_THRESHOLD 2
+#endif
+
+/* Congestion control probes: milliseconds between them at least (otherwise one per minimum RTT), and before a lost one is replaced. */
+#ifndef HANS_CC_MIN_ROUND
+#define HANS_CC_MIN_ROUND 10
+#endif
+#ifndef HANS_CC_PROBE_TIMEOUT
+#define HANS_CC_PROBE_TIMEOUT 500
+#endif
+
+/* Event-loop clock: read once per wakeup and per receive batch. 1 = the coarse monotonic clock (Linux), cheaper but only as fine as the scheduler tick, which coarsens pacing. */
+#ifndef HANS_COARSE_CLOCK
+#define HANS_COARSE_CLOCK 0
+#endif
+
+/* Server shards (-T): tunnel packets one shard can queue for another when they arrive on the wrong TUN queue. */
+#ifndef HANS_SHARD_QUEUE
+#define HANS_SHARD_QUEUE 256
+#endif
+
+/* Tunnel offloads (Linux): read TCP super-packets and packets with unfinished checksums from the device and segment them in userspace. 0 = one packet per read (original). */
+#ifndef HANS_TUN_OFFLOAD
+#define HANS_TUN_OFFLOAD 1
+#endif
+
+/* Tunnel receive offload: TCP flows whose segments of one receive batch are coalesced into a super-packet at a time (needs HANS_TUN_OFFLOAD). 0 = every packet written on its own. */
+#ifndef HANS_GRO_FLOWS
+#define HANS_GRO_FLOWS 8
+#endif
+
+/* AF_PACKET rings (-P): receive ring blocks, their size in bytes and the milliseconds a partly filled block waits before it is handed over; transmit ring frames; peers whose link-layer address is kept (a power of two). */
+#ifndef HANS_PACKET_RX_BLOCKS
+#define HANS_PACKET_RX_BLOCKS 64
+#endif
+#ifndef HANS_PACKET_RX_BLOCK_SIZE
+#define HANS_PACKET_RX_BLOCK_SIZE (64 * 1024)
+#endif
+#ifndef HANS_PACKET_RX_TIMEOUT
+#define HANS_PACKET_RX_TIMEOUT 1
+#endif
+#ifndef HANS_PACKET_TX_FRAMES
+#define HANS_PACKET_TX_FRAMES 256
+#endif
+#ifndef HANS_PACKET_NEIGHBORS
+#define HANS_PACKET_NEIGHBORS 4096
+#endif
+
+/* Server: packets of all clients of a shard that can wait for polls, in a preallocated pool of tunnel MTU sized buffers. Further packets are dropped as if the client queue was full. */
+#ifndef HANS_PACKET_POOL
+#define HANS_PACKET_POOL 2048
 #endif
 
 /* Per-flow queues for fairness: number of flow queues per client (round-robin send). 1 = single FIFO (original). */
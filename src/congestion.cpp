@@ -1,41 +1,136 @@
 /*
  *  Hans - IP over ICMP
  *
- *  Optional congestion control. Stub: tracks sent/loss/RTT; rate is fixed when disabled.
+ *  Congestion control (-C): BBR-style bandwidth and RTT model.
  */
 
 #include "congestion.h"
 
-Congestion::Congestion()
-    : enabled(false)
-    , bytesSent(0)
-    , packetsLost(0)
-    , rttMs(0)
-    , currentRateKbps(0)
+static const int STARTUP_GAIN = 289;  // percent, 2/ln(2)
+static const int DRAIN_GAIN = 35;     // 1/2.89
+static const int WINDOW_GAIN = 200;
+static const int CYCLE_GAINS[] = { 125, 75, 100, 100, 100, 100, 100, 100 };
+static const int64_t MIN_RATE = 8000; // bytes per second, keeps probes going
+static const int RTPROP_LIFETIME = 10000; // ms
+
+Congestion::Congestion(int initialRateKbps, int maxRateKbps, int lossPercent)
+    : mode(STARTUP)
+    , bwNext(0)
+    , fullBw(0)
+    , fullBwRounds(0)
+    , cycleIndex(0)
+    , initialRate((int64_t)initialRateKbps * 1000 / 8)
+    , maxRate(maxRateKbps > 0 ? (int64_t)maxRateKbps * 1000 / 8 : 0)
+    , lossPercent(lossPercent)
+    , lost(0)
+{
+    for (int i = 0; i < BW_ROUNDS; i++)
+        bwSamples[i] = 0;
+}
+
+int64_t Congestion::bandwidth() const
 {
+    int64_t max = 0;
+    for (int i = 0; i < BW_ROUNDS; i++)
+        if (bwSamples[i] > max)
+            max = bwSamples[i];
+    return max;
 }
 
-void Congestion::reportSent(int bytes)
+int Congestion::gainPercent() const
 {
-    bytesSent += bytes;
+    switch (mode)
+    {
+        case STARTUP:
+            return STARTUP_GAIN;
+        case DRAIN:
+            return DRAIN_GAIN;
+        default:
+            return CYCLE_GAINS[cycleIndex];
+    }
 }
 
-void Congestion::reportLoss()
+void Congestion::onRound(Time interval, uint64_t bytes, int packets, int lostPackets, bool appLimited)
 {
-    packetsLost++;
+    if (interval.nanoseconds() <= 0)
+        return;
+    int64_t rate = (int64_t)(bytes * (uint64_t)1000000000 / (uint64_t)interval.nanoseconds());
+    int64_t bw = bandwidth();
+    lost += lostPackets;
+
+    /* an application-limited round says little about the path, unless it
+       still delivered more than the estimate */
+    if (!appLimited || rate > bw)
+    {
+        bwSamples[bwNext] = rate;
+        bwNext = (bwNext + 1) % BW_ROUNDS;
+    }
+
+    if (lostPackets > 0 && (int64_t)lostPackets * 100 > (int64_t)(packets + lostPackets) * lossPercent)
+    {
+        int64_t cap = rate > bw * 7 / 10 ? rate : bw * 7 / 10;
+        for (int i = 0; i < BW_ROUNDS; i++)
+            if (bwSamples[i] > cap)
+                bwSamples[i] = cap;
+        if (mode == STARTUP)
+            mode = DRAIN;
+        return;
+    }
+
+    switch (mode)
+    {
+        case STARTUP:
+            if (appLimited)
+                break;
+            if (bandwidth() >= fullBw * 5 / 4)
+            {
+                fullBw = bandwidth();
+                fullBwRounds = 0;
+            }
+            else if (++fullBwRounds >= 3)
+                mode = DRAIN;
+            break;
+        case DRAIN:
+            mode = PROBE_BW;
+            cycleIndex = 0;
+            break;
+        case PROBE_BW:
+            cycleIndex = (cycleIndex + 1) % CYCLE_LENGTH;
+            break;
+    }
 }
 
-void Congestion::reportRttMs(int ms)
+void Congestion::onRtt(Time now, Time rtt)
 {
-    rttMs = ms;
+    if (rtProp == Time::ZERO || rtt < rtProp || Time(RTPROP_LIFETIME) < now - rtPropStamp)
+    {
+        rtProp = rtt;
+        rtPropStamp = now;
+    }
 }
 
-int Congestion::getCurrentRateKbps() const
+int Congestion::rateKbps() const
 {
-    return currentRateKbps;
+    int64_t bw = bandwidth();
+    int64_t rate = bw * gainPercent() / 100;
+    if (mode == STARTUP && rate < initialRate)
+        rate = initialRate;
+    if (rate < MIN_RATE)
+        rate = MIN_RATE;
+    if (maxRate && rate > maxRate)
+        rate = maxRate;
+    return (int)(rate * 8 / 1000);
 }
 
-void Congestion::refill(Time now)
+int Congestion::window(int packetBytes, Time minRtt) const
 {
-    (void)now;
+    int64_t bw = bandwidth();
+    if (bw == 0 || rtProp == Time::ZERO || packetBytes <= 0)
+        return 0;
+
+    int gain = mode == STARTUP ? STARTUP_GAIN : WINDOW_GAIN;
+    Time rtt = rtProp < minRtt ? minRtt : rtProp;
+    int64_t bdp = bw * rtt.nanoseconds() / 1000000000;
+    int64_t packets = (bdp * gain / 100 + packetBytes - 1) / packetBytes;
+    return packets < 1 ? 1 : packets > 65535 ? 65535 : (int)packets;
 }
@@ -1,8 +1,8 @@
 /*
  *  Hans - IP over ICMP
  *
- *  Optional congestion control / rate control module.
- *  Off by default; when enabled, provides rate feedback based on loss and optional RTT.
+ *  Congestion control (-C): a model of one direction of the path, after BBR,
+ *  that gives the rate to pace at and the packets to keep in flight.
  */
 
 #ifndef CONGESTION_H
@@ -11,24 +11,54 @@
 #include "time.h"
 #include <stdint.h>
 
+/*
+ * The bottleneck bandwidth is the largest delivery rate of the last BW_ROUNDS
+ * rounds, the propagation delay the smallest RTT of the last ten seconds. A
+ * round is whatever the caller measures over, about one RTT. Starting up, the
+ * rate grows by a factor of 2.89 a round until the bandwidth stops growing;
+ * the initial rate is the least it paces at meanwhile. After that it cycles
+ * through gains of 1.25, 0.75 and six times 1, probing
+ * for more bandwidth and draining what the probe queued. Rounds losing more
+ * than lossPercent of their packets cap the bandwidth at what they delivered,
+ * but at no less than 70% of the estimate.
+ */
 class Congestion
 {
 public:
-    Congestion();
-    void setEnabled(bool on) { enabled = on; }
-    void reportSent(int bytes);
-    void reportLoss();
-    void reportRttMs(int ms);
-    int getCurrentRateKbps() const;
-    void refill(Time now);
+    /* Rates in Kbps; maxRateKbps 0 = no limit. */
+    Congestion(int initialRateKbps = 1000, int maxRateKbps = 0, int lossPercent = 2);
+
+    /* A round `interval` long delivered `bytes` in `packets` and lost `lost` packets.
+     * With `appLimited` the sender had less to send than it was allowed to. */
+    void onRound(Time interval, uint64_t bytes, int packets, int lost, bool appLimited);
+    void onRtt(Time now, Time rtt);
+
+    int rateKbps() const;
+    /* Packets of `packetBytes` to keep in flight, 0 before anything was measured.
+     * RTTs shorter than `minRtt` count as that. */
+    int window(int packetBytes, Time minRtt = Time::ZERO) const;
+    Time minRtt() const { return rtProp; }
+    uint64_t lostPackets() const { return lost; }
 
 private:
-    bool enabled;
-    uint64_t bytesSent;
-    uint64_t packetsLost;
-    int rttMs;
-    int currentRateKbps;
-    Time lastRefill;
+    enum Mode { STARTUP, DRAIN, PROBE_BW };
+    enum { BW_ROUNDS = 10, CYCLE_LENGTH = 8 };
+
+    int64_t bandwidth() const; // bytes per second, 0 if unknown
+    int gainPercent() const;
+
+    Mode mode;
+    int64_t bwSamples[BW_ROUNDS];
+    int bwNext;
+    int64_t fullBw;           // startup: the bandwidth when it last grew by 25%
+    int fullBwRounds;         // rounds since
+    int cycleIndex;
+    Time rtProp;              // ZERO if unknown
+    Time rtPropStamp;
+    int64_t initialRate;      // bytes per second
+    int64_t maxRate;
+    int lossPercent;
+    uint64_t lost;
 };
 
 #endif
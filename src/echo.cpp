@@ -19,6 +19,9 @@
 
 #include "echo.h"
 #include "exception.h"
+#include "checksum.h"
+#include "packetring.h"
+#include "bpf.h"
 
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -34,9 +37,17 @@
 #include <string.h>
 #include <sys/types.h>
 
+#ifdef LINUX
+#include <linux/if_packet.h>
+#endif
+
 typedef ip IpHeader;
 
-Echo::Echo(int maxPayloadSize, int recvBufSize, int sndBufSize)
+Echo::Echo(int maxPayloadSize, int recvBufSize, int sndBufSize, int receiveBatchSize, int sendBatchSize)
+    : sendSlots(sendBatchSize, maxPayloadSize + headerSize()),
+      sendQueued(0),
+      receiveSlots(receiveBatchSize, maxPayloadSize + headerSize()),
+      ring(NULL)
 {
     fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
     if (fd == -1)
@@ -62,97 +73,320 @@ Echo::Echo(int maxPayloadSize, int recvBufSize, int sndBufSize)
 #endif
 
     bufferSize = maxPayloadSize + headerSize();
-    sendBuffer.resize(bufferSize);
-    receiveBuffer.resize(bufferSize);
 }
 
 Echo::~Echo()
 {
+#ifdef LINUX
+    delete ring;
+#endif
     close(fd);
 }
 
+int Echo::getFd()
+{
+#ifdef LINUX
+    if (ring)
+        return ring->getFd();
+#endif
+    return fd;
+}
+
+/* The packet socket of a ring sees every IPv4 frame on its device, so its
+ * filter first narrows that down to unfragmented ICMP to this host, which is
+ * all the raw socket would have delivered to hans in one piece. Then, if
+ * acceptOnly() was called, only the echo packets hans takes pass, and with
+ * shards only those of the shard's clients. */
+void Echo::attachFilter()
+{
+#ifdef LINUX
+    BpfProgram program;
+    if (ring)
+    {
+        program.load(BPF_W, SKF_AD_OFF + SKF_AD_PKTTYPE);
+        program.rejectUnless(PACKET_HOST);
+    }
+    program.load(BPF_B, SKF_NET_OFF);
+    program.rejectUnless(0x45);                                // no IP options
+    if (ring)
+    {
+        program.load(BPF_H, SKF_NET_OFF + 6);
+        program.rejectIfAny(0x3fff);                           // fragment
+        program.load(BPF_B, SKF_NET_OFF + 9);
+        program.rejectUnless(IPPROTO_ICMP);
+    }
+    if (filter.enabled)
+    {
+        if (filter.peer)
+        {
+            program.load(BPF_W, SKF_NET_OFF + 12);             // ip_src
+            program.rejectUnless(filter.peer);
+        }
+        program.load(BPF_H, SKF_NET_OFF + (int)sizeof(IpHeader)); // type, code
+        program.rejectUnless(filter.replies ? 0 : 8 << 8);
+        if (!filter.plainRequests)
+        {
+            program.load(BPF_W, SKF_NET_OFF + headerSize());   // tunnel header magic
+            program.rejectUnless(filter.magic);
+        }
+    }
+    if (filter.shards > 1)
+    {
+        program.load(BPF_W, SKF_NET_OFF + 12);
+        program.statement(BPF_ALU | BPF_MOD | BPF_K, filter.shards);
+        program.rejectUnless(filter.shard);
+    }
+
+    if (!program.attach(getFd()))
+        throw Exception("attaching filter to icmp socket", true);
+#endif
+}
+
+/* A ring joins the shards' fanout group, so that the kernel hands each
+ * datagram to its shard's ring alone; the shard test stays in the filter in
+ * case the group cannot be joined. */
+void Echo::setShard(int shard, int shards)
+{
+    filter.shard = shard;
+    filter.shards = shards;
+    attachFilter();
+#ifdef LINUX
+    if (ring && shards > 1 && ring->joinFanout(getpid(), shard, shards) && shard == shards - 1)
+        syslog(LOG_INFO, "packet rings joined in a fanout group of %d", shards);
+#endif
+}
+
+void Echo::acceptOnly(bool replies, const char *magic, bool plainRequests, uint32_t peer)
+{
+    filter.enabled = true;
+    filter.replies = replies;
+    filter.magic = (uint8_t)magic[0] << 24 | (uint8_t)magic[1] << 16 | (uint8_t)magic[2] << 8 | (uint8_t)magic[3];
+    filter.plainRequests = plainRequests && !replies;
+    filter.peer = peer;
+    attachFilter();
+}
+
+bool Echo::openPacketRing(const std::string &device)
+{
+#ifdef LINUX
+    try
+    {
+        ring = new PacketRing(device, bufferSize);
+        attachFilter();
+    }
+    catch (const Exception &e)
+    {
+        delete ring;
+        ring = NULL;
+        syslog(LOG_WARNING, "packet ring unavailable, using the icmp socket: %s", e.errorMessage().c_str());
+        return false;
+    }
+
+    /* everything comes in through the ring now */
+    if (!BpfProgram::rejectAll(fd))
+        syslog(LOG_WARNING, "could not stop receiving on the icmp socket: %s", strerror(errno));
+    syslog(LOG_INFO, "icmp through packet rings on %s", device.c_str());
+    return true;
+#else
+    (void)device;
+    syslog(LOG_WARNING, "packet rings are only supported on Linux");
+    return false;
+#endif
+}
+
 int Echo::headerSize()
 {
     return sizeof(IpHeader) + sizeof(EchoHeader);
 }
 
-bool Echo::send(int payloadLength, uint32_t realIp, bool reply, uint16_t id, uint16_t seq)
+bool Echo::send(int payloadLength, uint32_t realIp, bool reply, uint16_t id, uint16_t seq,
+                const char *tail, int tailLength)
 {
     struct sockaddr_in target;
     target.sin_family = AF_INET;
     target.sin_addr.s_addr = htonl(realIp);
 
-    if (payloadLength + sizeof(IpHeader) + sizeof(EchoHeader) > bufferSize)
+    if (payloadLength + tailLength + sizeof(IpHeader) + sizeof(EchoHeader) > bufferSize)
         throw Exception("packet too big");
 
-    EchoHeader *header = (EchoHeader *)(sendBuffer.data() + sizeof(IpHeader));
+    if (sendQueueFull())
+        return false;
+
+    char *buffer = sendSlots.buffer(sendQueued);
+    EchoHeader *header = (EchoHeader *)(buffer + sizeof(IpHeader));
     header->type = reply ? 0: 8;
     header->code = 0;
     header->id = htons(id);
     header->seq = htons(seq);
     header->chksum = 0;
-    header->chksum = icmpChecksum(sendBuffer.data() + sizeof(IpHeader), payloadLength + sizeof(EchoHeader));
+    header->chksum = icmpChecksum(buffer + sizeof(IpHeader), payloadLength + sizeof(EchoHeader),
+                                  tail, tailLength);
+
+    sendSlots.setPacket(sendQueued++, sizeof(IpHeader), payloadLength + sizeof(EchoHeader),
+                        (struct sockaddr *)&target, sizeof(struct sockaddr_in), tail, tailLength);
+    return true;
+}
+
+bool Echo::sendReply(const char *request, int payloadLength, uint32_t realIp)
+{
+    struct sockaddr_in target;
+    target.sin_family = AF_INET;
+    target.sin_addr.s_addr = htonl(realIp);
+
+    if (payloadLength + sizeof(IpHeader) + sizeof(EchoHeader) > bufferSize)
+        throw Exception("packet too big");
 
-    int result = sendto(fd, sendBuffer.data() + sizeof(IpHeader), payloadLength + sizeof(EchoHeader), 0, (struct sockaddr *)&target, sizeof(struct sockaddr_in));
-    if (result == -1)
+    if (sendQueueFull())
         return false;
+
+    char *buffer = sendSlots.buffer(sendQueued);
+    EchoHeader *header = (EchoHeader *)(buffer + sizeof(IpHeader));
+    memcpy(header, request - sizeof(EchoHeader), sizeof(EchoHeader));
+    header->type = 0;
+    header->chksum = htons(Checksum::update(ntohs(header->chksum), 8 << 8, 0 << 8));
+    memcpy(buffer + headerSize(), request, payloadLength);
+
+    sendSlots.setPacket(sendQueued++, sizeof(IpHeader), payloadLength + sizeof(EchoHeader),
+                        (struct sockaddr *)&target, sizeof(struct sockaddr_in));
     return true;
 }
 
-int Echo::receive(uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq)
+/* Frames in the transmit ring go out as soon as they are framed. */
+bool Echo::enableTxTime()
 {
-    struct sockaddr_in source;
-    int source_addr_len = sizeof(struct sockaddr_in);
+    if (ring)
+    {
+        errno = EOPNOTSUPP;
+        return false;
+    }
+    return MsgBatch::enableTxTime(fd);
+}
+
+void Echo::flush(MsgBatch::SendResult &result, int first)
+{
+#ifdef LINUX
+    if (ring)
+    {
+        for (int i = first; i < sendQueued; i++)
+        {
+            const struct sockaddr_in *target = (const struct sockaddr_in *)sendSlots.address(i);
+            if (ring->send(ntohl(target->sin_addr.s_addr), IPPROTO_ICMP,
+                           sendSlots.buffer(i) + sendSlots.offset(i), sendSlots.length(i),
+                           sendSlots.tail(i), sendSlots.tailLength(i)))
+                continue;
+
+            /* unknown peer, too large or no frame free: the raw socket takes
+               it, after what is already framed */
+            transmitRing(result);
+            sendSlots.send(fd, i, 1, result);
+        }
+        transmitRing(result);
+        sendQueued = 0;
+        return;
+    }
+#endif
+    if (first < sendQueued)
+        sendSlots.send(fd, first, sendQueued - first, result);
+    sendQueued = 0;
+}
+
+void Echo::transmitRing(MsgBatch::SendResult &result)
+{
+#ifdef LINUX
+    int frames = ring->pending();
+    int bytes = ring->pendingBytes();
+    if (!ring->transmit())
+        result.failed += frames;
+    else if (ring->pending() == 0) // not left for the next flush
+    {
+        result.packets += frames;
+        result.bytes += bytes;
+    }
+#else
+    (void)result;
+#endif
+}
 
-    int dataLength = recvfrom(fd, receiveBuffer.data(), bufferSize, 0, (struct sockaddr *)&source, (socklen_t *)&source_addr_len);
-    if (dataLength == -1)
+int Echo::receiveBatch(int maxPackets)
+{
+#ifdef LINUX
+    if (ring)
+        return ring->receive(maxPackets);
+#endif
+    int count = receiveSlots.receive(fd, maxPackets);
+    if (count == -1)
     {
 #ifdef WIN32
-        return -1;
+        return 0;
 #else
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-            return -1;
-        syslog(LOG_ERR, "error receiving icmp packet: %s", strerror(errno));
-        return -1;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            syslog(LOG_ERR, "error receiving icmp packet: %s", strerror(errno));
+        return 0;
 #endif
     }
+    return count;
+}
 
-    if (dataLength < sizeof(IpHeader) + sizeof(EchoHeader))
+int Echo::receivedPacket(int index, uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq)
+{
+#ifdef LINUX
+    if (ring)
+    {
+        struct sockaddr_in source;
+        source.sin_family = AF_INET;
+        memcpy(&source.sin_addr, ring->packet(index) + 12, 4);
+        return decode(ring->packet(index), ring->length(index), (const struct sockaddr *)&source,
+                      realIp, reply, id, seq);
+    }
+#endif
+    return decode(receiveSlots.buffer(index), receiveSlots.length(index), receiveSlots.address(index),
+                  realIp, reply, id, seq);
+}
+
+int Echo::decode(const char *data, int length, const struct sockaddr *source,
+                 uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq)
+{
+    if (length < sizeof(IpHeader) + sizeof(EchoHeader))
         return -1;
 
-    EchoHeader *header = (EchoHeader *)(receiveBuffer.data() + sizeof(IpHeader));
+    const EchoHeader *header = (const EchoHeader *)(data + sizeof(IpHeader));
     if ((header->type != 0 && header->type != 8) || header->code != 0)
         return -1;
 
-    realIp = ntohl(source.sin_addr.s_addr);
+    realIp = ntohl(((const struct sockaddr_in *)source)->sin_addr.s_addr);
     reply = header->type == 0;
     id = ntohs(header->id);
     seq = ntohs(header->seq);
 
-    return dataLength - sizeof(IpHeader) - sizeof(EchoHeader);
+    return length - sizeof(IpHeader) - sizeof(EchoHeader);
 }
 
-uint16_t Echo::icmpChecksum(const char *data, int length)
+uint16_t Echo::icmpChecksum(const char *data, int length, const char *tail, int tailLength)
 {
-    uint16_t *data16 = (uint16_t *)data;
-    uint32_t sum = 0;
-
-    for (sum = 0; length > 1; length -= 2)
-        sum += *data16++;
-    if (length == 1)
-        sum += *(unsigned char *)data16;
-
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
-    return ~sum;
+    uint32_t sum = Checksum::add(0, data, length);
+    if (tail)
+        sum = Checksum::add(sum, tail, tailLength, length);
+    return htons(Checksum::fold(sum));
 }
 
 char *Echo::sendPayloadBuffer()
 {
-    return sendBuffer.data() + headerSize();
+    return sendSlots.buffer(sendQueued) + headerSize();
 }
 
-char *Echo::receivePayloadBuffer()
+void Echo::releaseReceived()
 {
-    return receiveBuffer.data() + headerSize();
+#ifdef LINUX
+    if (ring)
+        ring->release();
+#endif
+}
+
+char *Echo::receivePayloadBuffer(int index)
+{
+#ifdef LINUX
+    if (ring)
+        return ring->packet(index) + headerSize();
+#endif
+    return receiveSlots.buffer(index) + headerSize();
 }
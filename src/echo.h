@@ -20,23 +20,66 @@
 #ifndef ECHO_H
 #define ECHO_H
 
+#include "msgbatch.h"
+#include "time.h"
+
 #include <string>
 #include <vector>
 #include <stdint.h>
 
+class PacketRing;
+
 class Echo
 {
 public:
-    Echo(int maxPayloadSize, int recvBufSize = 256 * 1024, int sndBufSize = 256 * 1024);
+    Echo(int maxPayloadSize, int recvBufSize = 256 * 1024, int sndBufSize = 256 * 1024,
+         int receiveBatchSize = 1, int sendBatchSize = 1);
     ~Echo();
 
-    int getFd() { return fd; }
+    int getFd();
+
+    /* Receive and send through AF_PACKET rings on `device` instead of the raw
+     * socket (Linux). False if they cannot be set up; the raw socket stays in use. */
+    bool openPacketRing(const std::string &device);
+    bool usesPacketRing() const { return ring != NULL; }
+
+    /* Only receive datagrams whose source address, taken modulo `shards`, is `shard` (Linux). */
+    void setShard(int shard, int shards);
+    /* Only receive echo requests, or echo replies, whose payload starts with `magic`, from
+     * `peer` unless it is 0; with `plainRequests` any echo request as well (Linux). */
+    void acceptOnly(bool replies, const char *magic, bool plainRequests, uint32_t peer = 0);
 
-    bool send(int payloadLength, uint32_t realIp, bool reply, uint16_t id, uint16_t seq);
-    int receive(uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq);
+    /* Queue the packet in sendPayloadBuffer() for the next flush(); false if the queue is full.
+     * The payload goes on with `tailLength` bytes at `tail`, which have to stay in place until then. */
+    bool send(int payloadLength, uint32_t realIp, bool reply, uint16_t id, uint16_t seq,
+              const char *tail = NULL, int tailLength = 0);
+    /* Queue the reply to the echo request whose payload was received at `request`. Only the
+     * type changes, so the checksum is updated from the request's instead of recomputed. */
+    bool sendReply(const char *request, int payloadLength, uint32_t realIp);
+    /* Send queued packets from `first` on, adding the outcome to `result`, and empty the queue. */
+    void flush(MsgBatch::SendResult &result, int first = 0);
+    /* Stamp the last queued packet to leave at `at` (see enableTxTime()). */
+    void setDeparture(Time at) { sendSlots.setTxTime(sendQueued - 1, at.nanoseconds()); }
+    /* Let the kernel hold packets until their departure time, e.g. in the fq qdisc
+     * (Linux). False with errno set if the socket does not take it. */
+    bool enableTxTime();
+    bool sendQueueFull() const { return sendQueued == sendSlots.size(); }
+    /* Slots 0..sendQueueLength()-1 of sendQueue() hold the queued datagrams. */
+    const MsgBatch &sendQueue() const { return sendSlots; }
+    int sendQueueLength() const { return sendQueued; }
+
+    /* Pull up to maxPackets datagrams into the receive slots; returns the number read. */
+    int receiveBatch(int maxPackets);
+    /* Decode receive slot `index`; returns its payload length or -1 if it is not an echo packet. */
+    int receivedPacket(int index, uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq);
+    /* The packets of the last receiveBatch() have been dealt with. */
+    void releaseReceived();
+    /* Same for a datagram received elsewhere; its payload starts headerSize() bytes into `data`. */
+    static int decode(const char *data, int length, const struct sockaddr *source,
+                      uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq);
 
     char *sendPayloadBuffer();
-    char *receivePayloadBuffer();
+    char *receivePayloadBuffer(int index);
 
     static int headerSize();
 protected:
@@ -49,12 +92,30 @@ protected:
         uint16_t seq;
     }; // size = 8
 
-    uint16_t icmpChecksum(const char *data, int length);
+    uint16_t icmpChecksum(const char *data, int length, const char *tail, int tailLength);
+    struct Filter
+    {
+        Filter() : enabled(false), shard(0), shards(1) { }
+
+        bool enabled; // acceptOnly() was called
+        bool replies;
+        uint32_t magic;
+        bool plainRequests;
+        uint32_t peer;
+        int shard;
+        int shards;
+    };
+
+    void attachFilter();
+    void transmitRing(MsgBatch::SendResult &result);
 
     int fd;
     int bufferSize;
-    std::vector<char> sendBuffer;
-    std::vector<char> receiveBuffer;
+    MsgBatch sendSlots;
+    int sendQueued;
+    MsgBatch receiveSlots;
+    PacketRing *ring;
+    Filter filter;
 };
 
 #endif
@@ -18,7 +18,9 @@
  */
 
 #include "echo6.h"
+#include "checksum.h"
 #include "exception.h"
+#include "bpf.h"
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -47,7 +49,10 @@
 #define IPV6_CHECKSUM 7
 #endif
 
-Echo6::Echo6(int maxPayloadSize, int recvBufSize, int sndBufSize)
+Echo6::Echo6(int maxPayloadSize, int recvBufSize, int sndBufSize, int receiveBatchSize, int sendBatchSize)
+    : sendSlots(sendBatchSize, maxPayloadSize + headerSize()),
+      sendQueued(0),
+      receiveSlots(receiveBatchSize, maxPayloadSize + headerSize())
 {
     fd = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
     if (fd == -1)
@@ -79,8 +84,6 @@ Echo6::Echo6(int maxPayloadSize, int recvBufSize, int sndBufSize)
 #endif
 
     bufferSize = maxPayloadSize + headerSize();
-    sendBuffer.resize(bufferSize);
-    receiveBuffer.resize(bufferSize);
 }
 
 Echo6::~Echo6()
@@ -89,38 +92,90 @@ Echo6::~Echo6()
         close(fd);
 }
 
+/* The filter sees the ICMPv6 message from offset 0 on, the IPv6 header at
+ * SKF_NET_OFF. */
+void Echo6::attachFilter()
+{
+#ifdef LINUX
+    BpfProgram program;
+    if (filter.enabled)
+    {
+        if (filter.peerSet)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                program.load(BPF_W, SKF_NET_OFF + 8 + 4 * i);   // ip6_src
+                program.rejectUnless(ntohl(((const uint32_t *)&filter.peer)[i]));
+            }
+        }
+        program.load(BPF_H, 0);                                 // type, code
+        program.rejectUnless((filter.replies ? ICMP6_ECHO_REPLY : ICMP6_ECHO_REQUEST) << 8);
+        if (!filter.plainRequests)
+        {
+            program.load(BPF_W, headerSize());                  // tunnel header magic
+            program.rejectUnless(filter.magic);
+        }
+    }
+    if (filter.shards > 1)
+    {
+        program.load(BPF_W, SKF_NET_OFF + 20);                  // low 32 bits of ip6_src
+        program.statement(BPF_ALU | BPF_MOD | BPF_K, filter.shards);
+        program.rejectUnless(filter.shard);
+    }
+
+    if (!program.attach(fd))
+        throw Exception("attaching filter to icmp6 socket", true);
+#endif
+}
+
+void Echo6::setShard(int shard, int shards)
+{
+    filter.shard = shard;
+    filter.shards = shards;
+    attachFilter();
+}
+
+void Echo6::acceptOnly(bool replies, const char *magic, bool plainRequests, const struct in6_addr *peer)
+{
+    filter.enabled = true;
+    filter.replies = replies;
+    filter.magic = (uint8_t)magic[0] << 24 | (uint8_t)magic[1] << 16 | (uint8_t)magic[2] << 8 | (uint8_t)magic[3];
+    filter.plainRequests = plainRequests && !replies;
+    filter.peerSet = peer != NULL;
+    if (peer)
+        filter.peer = *peer;
+    attachFilter();
+}
+
 int Echo6::headerSize()
 {
     return sizeof(Icmp6Header);
 }
 
-/* One's complement sum for ICMPv6 checksum (RFC 2463): pseudo-header + ICMPv6 message */
+/* One's complement sum for ICMPv6 checksum (RFC 2463): pseudo-header + the sum of the ICMPv6 message */
 uint16_t Echo6::icmp6Checksum(const struct in6_addr &src, const struct in6_addr &dst,
-                              const void *msg, size_t msgLen)
+                              int length, uint32_t messageSum)
 {
-    size_t i;
-    const unsigned char *p;
-    uint32_t sum = 0;
-
     /* Pseudo-header: src (16) + dst (16) + upper_layer_len (4) + zero (3) + next_header (1) */
-    p = (const unsigned char *)&src;
-    for (i = 0; i < 16; i += 2)
-        sum += (uint32_t)((p[i] << 8) | p[i + 1]);
-    p = (const unsigned char *)&dst;
-    for (i = 0; i < 16; i += 2)
-        sum += (uint32_t)((p[i] << 8) | p[i + 1]);
-    sum += (uint32_t)(msgLen >> 16) + (uint32_t)(msgLen & 0xFFFF);
-    sum += (uint32_t)IPPROTO_ICMPV6;
-
-    p = (const unsigned char *)msg;
-    for (i = 0; i + 1 < msgLen; i += 2)
-        sum += (uint32_t)((p[i] << 8) | p[i + 1]);
-    if (i < msgLen)
-        sum += (uint32_t)(p[i] << 8);
-
-    while (sum >> 16)
-        sum = (sum & 0xFFFF) + (sum >> 16);
-    return (uint16_t)(~sum);
+    uint32_t sum = Checksum::add(messageSum, (const char *)&src, 16);
+    sum = Checksum::add(sum, (const char *)&dst, 16);
+    sum += (length >> 16) + (length & 0xffff) + IPPROTO_ICMPV6;
+    return Checksum::fold(sum);
+}
+
+/* Fill in the checksum unless the kernel does; false if no source address can be found. */
+bool Echo6::setChecksum(Icmp6Header *header, const struct in6_addr &dest, int length, uint32_t messageSum)
+{
+    header->chksum = 0;
+    if (kernelChecksum_)
+        return true;
+
+    struct in6_addr src;
+    if (!getSourceForDest(dest, src))
+        return false;
+    header->chksum = htons(icmp6Checksum(src, dest, length,
+                                         Checksum::add(messageSum, (const char *)header, sizeof(Icmp6Header))));
+    return true;
 }
 
 bool Echo6::getSourceForDest(const struct in6_addr &dest, struct in6_addr &srcOut)
@@ -158,78 +213,123 @@ bool Echo6::getSourceForDest(const struct in6_addr &dest, struct in6_addr &srcOu
     return true;
 }
 
-bool Echo6::send(int payloadLength, const struct in6_addr &realIp, bool reply, uint16_t id, uint16_t seq)
+bool Echo6::send(int payloadLength, const struct in6_addr &realIp, bool reply, uint16_t id, uint16_t seq,
+                 const char *tail, int tailLength)
 {
     struct sockaddr_in6 target;
     memset(&target, 0, sizeof(target));
     target.sin6_family = AF_INET6;
     target.sin6_addr = realIp;
 
-    if (payloadLength + sizeof(Icmp6Header) > bufferSize)
+    if (payloadLength + tailLength + sizeof(Icmp6Header) > bufferSize)
         throw Exception("packet too big");
 
-    Icmp6Header *header = (Icmp6Header *)sendBuffer.data();
+    if (sendQueueFull())
+        return false;
+
+    char *buffer = sendSlots.buffer(sendQueued);
+    Icmp6Header *header = (Icmp6Header *)buffer;
     header->type = reply ? ICMP6_ECHO_REPLY : ICMP6_ECHO_REQUEST;
     header->code = 0;
     header->id = htons(id);
     header->seq = htons(seq);
-    header->chksum = 0;
 
+    uint32_t sum = 0;
     if (!kernelChecksum_)
     {
-        struct in6_addr src;
-        if (!getSourceForDest(realIp, src))
-            return false;
-        header->chksum = htons(icmp6Checksum(src, realIp, sendBuffer.data(), payloadLength + sizeof(Icmp6Header)));
+        sum = Checksum::add(0, buffer + sizeof(Icmp6Header), payloadLength);
+        if (tail)
+            sum = Checksum::add(sum, tail, tailLength, payloadLength);
     }
+    if (!setChecksum(header, realIp, payloadLength + tailLength + sizeof(Icmp6Header), sum))
+        return false;
 
-    int result = sendto(fd, sendBuffer.data(), payloadLength + sizeof(Icmp6Header), 0,
-                        (struct sockaddr *)&target, sizeof(target));
-    if (result == -1)
+    sendSlots.setPacket(sendQueued++, 0, payloadLength + sizeof(Icmp6Header),
+                        (struct sockaddr *)&target, sizeof(target), tail, tailLength);
+    return true;
+}
+
+bool Echo6::sendReply(const char *request, int payloadLength, const struct in6_addr &realIp)
+{
+    struct sockaddr_in6 target;
+    memset(&target, 0, sizeof(target));
+    target.sin6_family = AF_INET6;
+    target.sin6_addr = realIp;
+
+    if (payloadLength + sizeof(Icmp6Header) > bufferSize)
+        throw Exception("packet too big");
+
+    if (sendQueueFull())
+        return false;
+
+    /* the reply may leave from another address than the request arrived at, so
+       the pseudo header is summed again; the payload is summed while it is copied */
+    char *buffer = sendSlots.buffer(sendQueued);
+    Icmp6Header *header = (Icmp6Header *)buffer;
+    memcpy(header, request - sizeof(Icmp6Header), sizeof(Icmp6Header));
+    header->type = ICMP6_ECHO_REPLY;
+    uint32_t sum = Checksum::copy(buffer + sizeof(Icmp6Header), request, payloadLength);
+    if (!setChecksum(header, realIp, payloadLength + sizeof(Icmp6Header), sum))
         return false;
+
+    sendSlots.setPacket(sendQueued++, 0, payloadLength + sizeof(Icmp6Header),
+                        (struct sockaddr *)&target, sizeof(target));
     return true;
 }
 
-int Echo6::receive(struct in6_addr &realIp, bool &reply, uint16_t &id, uint16_t &seq)
+void Echo6::flush(MsgBatch::SendResult &result, int first)
 {
-    struct sockaddr_in6 source;
-    socklen_t source_len = sizeof(source);
+    if (first < sendQueued)
+        sendSlots.send(fd, first, sendQueued - first, result);
+    sendQueued = 0;
+}
 
-    int dataLength = recvfrom(fd, receiveBuffer.data(), bufferSize, 0,
-                             (struct sockaddr *)&source, &source_len);
-    if (dataLength == -1)
+int Echo6::receiveBatch(int maxPackets)
+{
+    int count = receiveSlots.receive(fd, maxPackets);
+    if (count == -1)
     {
 #ifdef WIN32
-        return -1;
+        return 0;
 #else
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-            return -1;
-        syslog(LOG_ERR, "error receiving icmp6 packet: %s", strerror(errno));
-        return -1;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            syslog(LOG_ERR, "error receiving icmp6 packet: %s", strerror(errno));
+        return 0;
 #endif
     }
+    return count;
+}
 
-    if (dataLength < (int)sizeof(Icmp6Header))
+int Echo6::receivedPacket(int index, struct in6_addr &realIp, bool &reply, uint16_t &id, uint16_t &seq)
+{
+    return decode(receiveSlots.buffer(index), receiveSlots.length(index), receiveSlots.address(index),
+                  realIp, reply, id, seq);
+}
+
+int Echo6::decode(const char *data, int length, const struct sockaddr *source,
+                  struct in6_addr &realIp, bool &reply, uint16_t &id, uint16_t &seq)
+{
+    if (length < (int)sizeof(Icmp6Header))
         return -1;
 
-    Icmp6Header *header = (Icmp6Header *)receiveBuffer.data();
+    const Icmp6Header *header = (const Icmp6Header *)data;
     if ((header->type != ICMP6_ECHO_REQUEST && header->type != ICMP6_ECHO_REPLY) || header->code != 0)
         return -1;
 
-    realIp = source.sin6_addr;
+    realIp = ((const struct sockaddr_in6 *)source)->sin6_addr;
     reply = header->type == ICMP6_ECHO_REPLY;
     id = ntohs(header->id);
     seq = ntohs(header->seq);
 
-    return dataLength - sizeof(Icmp6Header);
+    return length - sizeof(Icmp6Header);
 }
 
 char *Echo6::sendPayloadBuffer()
 {
-    return sendBuffer.data() + headerSize();
+    return sendSlots.buffer(sendQueued) + headerSize();
 }
 
-char *Echo6::receivePayloadBuffer()
+char *Echo6::receivePayloadBuffer(int index)
 {
-    return receiveBuffer.data() + headerSize();
+    return receiveSlots.buffer(index) + headerSize();
 }
@@ -20,6 +20,9 @@
 #ifndef ECHO6_H
 #define ECHO6_H
 
+#include "msgbatch.h"
+#include "time.h"
+
 #include <vector>
 #include <stdint.h>
 #include <netinet/in.h>
@@ -27,16 +30,36 @@
 class Echo6
 {
 public:
-    Echo6(int maxPayloadSize, int recvBufSize = 256 * 1024, int sndBufSize = 256 * 1024);
+    Echo6(int maxPayloadSize, int recvBufSize = 256 * 1024, int sndBufSize = 256 * 1024,
+          int receiveBatchSize = 1, int sendBatchSize = 1);
     ~Echo6();
 
     int getFd() { return fd; }
 
-    bool send(int payloadLength, const struct in6_addr &realIp, bool reply, uint16_t id, uint16_t seq);
-    int receive(struct in6_addr &realIp, bool &reply, uint16_t &id, uint16_t &seq);
+    /* Only receive datagrams whose source address, taken modulo `shards`, is `shard` (Linux). */
+    void setShard(int shard, int shards);
+    /* Only receive echo requests, or echo replies, whose payload starts with `magic`, from
+     * `peer` unless it is NULL; with `plainRequests` any echo request as well (Linux). */
+    void acceptOnly(bool replies, const char *magic, bool plainRequests, const struct in6_addr *peer = NULL);
+
+    bool send(int payloadLength, const struct in6_addr &realIp, bool reply, uint16_t id, uint16_t seq,
+              const char *tail = NULL, int tailLength = 0);
+    /* Queue the reply to the echo request whose payload was received at `request`. */
+    bool sendReply(const char *request, int payloadLength, const struct in6_addr &realIp);
+    void flush(MsgBatch::SendResult &result, int first = 0);
+    void setDeparture(Time at) { sendSlots.setTxTime(sendQueued - 1, at.nanoseconds()); }
+    bool enableTxTime() { return MsgBatch::enableTxTime(fd); }
+    bool sendQueueFull() const { return sendQueued == sendSlots.size(); }
+    const MsgBatch &sendQueue() const { return sendSlots; }
+    int sendQueueLength() const { return sendQueued; }
+
+    int receiveBatch(int maxPackets);
+    int receivedPacket(int index, struct in6_addr &realIp, bool &reply, uint16_t &id, uint16_t &seq);
+    static int decode(const char *data, int length, const struct sockaddr *source,
+                      struct in6_addr &realIp, bool &reply, uint16_t &id, uint16_t &seq);
 
     char *sendPayloadBuffer();
-    char *receivePayloadBuffer();
+    char *receivePayloadBuffer(int index);
 
     static int headerSize();
 protected:
@@ -56,13 +79,32 @@ protected:
     bool cachedSrcValid_;
 
     static uint16_t icmp6Checksum(const struct in6_addr &src, const struct in6_addr &dst,
-                                  const void *msg, size_t msgLen);
+                                  int length, uint32_t messageSum);
+    bool setChecksum(Icmp6Header *header, const struct in6_addr &dest, int length, uint32_t messageSum);
     bool getSourceForDest(const struct in6_addr &dest, struct in6_addr &srcOut);
 
+    struct Filter
+    {
+        Filter() : enabled(false), peerSet(false), shard(0), shards(1) { }
+
+        bool enabled; // acceptOnly() was called
+        bool replies;
+        uint32_t magic;
+        bool plainRequests;
+        bool peerSet;
+        struct in6_addr peer;
+        int shard;
+        int shards;
+    };
+
+    void attachFilter();
+    Filter filter;
+
     int fd;
     int bufferSize;
-    std::vector<char> sendBuffer;
-    std::vector<char> receiveBuffer;
+    MsgBatch sendSlots;
+    int sendQueued;
+    MsgBatch receiveSlots;
 };
 
 #endif
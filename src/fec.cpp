@@ -0,0 +1,288 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "fec.h"
+#include "config.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+Fec::Fec(int maxLength)
+    : maxLength(maxLength)
+    , sendBlock(0)
+    , sendIndex(0)
+    , sendK(0)
+    , sendLength(0)
+    , sendType(0)
+    , sendSize(0)
+    , sendParity(maxLength, 0)
+    , peerLoss(0)
+    , buffers(SLOTS * maxLength, 0)
+    , rebuilt(NULL)
+    , lossAverage(0)
+    , unreported(0)
+{
+    for (int i = 0; i < SLOTS; i++)
+    {
+        blocks[i].used = false;
+        blocks[i].size = 0;
+    }
+}
+
+/* k data packets per parity packet, k * loss kept to HANS_FEC_BLOCK_LOSS. */
+int Fec::blockSize(int lossPermille)
+{
+    int k = lossPermille > 0 ? HANS_FEC_BLOCK_LOSS / lossPermille : HANS_FEC_MAX_BLOCK;
+    if (k < HANS_FEC_MIN_BLOCK)
+        k = HANS_FEC_MIN_BLOCK;
+    if (k > HANS_FEC_MAX_BLOCK)
+        k = HANS_FEC_MAX_BLOCK;
+    return k;
+}
+
+void Fec::addXor(char *to, const char *from, int length)
+{
+    for (int i = 0; i < length; i++)
+        to[i] ^= from[i];
+}
+
+int Fec::encode(char *buffer, const char *packet, int length, int type)
+{
+    if (sendIndex == 0)
+        sendK = blockSize(peerLoss);
+
+    uint16_t id = htons(sendBlock);
+    memcpy(buffer, &id, sizeof(id));
+    buffer[2] = (char)(sendIndex << 4 | (sendK - 1));
+    buffer[3] = (char)type;
+    memcpy(buffer + DATA_HEADER_SIZE, packet, length);
+
+    addXor(&sendParity[0], packet, length);
+    sendLength ^= length;
+    sendType ^= type;
+    if (length > sendSize)
+        sendSize = length;
+    sendIndex++;
+
+    return DATA_HEADER_SIZE + length;
+}
+
+int Fec::parity(char *buffer, Stats &stats)
+{
+    if (sendIndex < sendK)
+        return 0;
+    return flush(buffer, stats);
+}
+
+int Fec::flush(char *buffer, Stats &stats)
+{
+    if (sendIndex == 0)
+        return 0;
+
+    writeParityHeader(buffer, sendIndex);
+    memcpy(buffer + PARITY_HEADER_SIZE, &sendParity[0], sendSize);
+    int parityLength = PARITY_HEADER_SIZE + sendSize;
+
+    memset(&sendParity[0], 0, sendSize);
+    sendSize = 0;
+    sendLength = 0;
+    sendType = 0;
+    sendIndex = 0;
+    sendBlock++;
+
+    stats.incFecParitySent();
+    return parityLength;
+}
+
+int Fec::report(char *buffer)
+{
+    if (unreported < REPORT_BLOCKS)
+        return 0;
+    writeParityHeader(buffer, 0);
+    return PARITY_HEADER_SIZE;
+}
+
+void Fec::writeParityHeader(char *buffer, int k)
+{
+    int loss = lossAverage / 16;
+    uint16_t id = htons(sendBlock);
+    uint16_t length = htons(sendLength);
+    memcpy(buffer, &id, sizeof(id));
+    buffer[2] = (char)k;
+    buffer[3] = (char)(loss < 255 ? loss : 255);
+    memcpy(buffer + 4, &length, sizeof(length));
+    buffer[6] = (char)sendType;
+    unreported = 0;
+}
+
+/* The slot of block `id`, taken over from an older block; NULL if the slot
+ * holds a newer one already. */
+Fec::Block *Fec::block(uint16_t id, Stats &stats)
+{
+    Block &slot = blocks[id % SLOTS];
+    if (slot.used && slot.id == id)
+        return &slot;
+    if (slot.used && (int16_t)(id - slot.id) < 0)
+        return NULL;
+
+    if (slot.used)
+        finish(slot, stats);
+    memset(payload(slot), 0, slot.size);
+    slot.used = true;
+    slot.id = id;
+    slot.k = 0;
+    slot.received = 0;
+    slot.arrived = 0;
+    slot.done = false;
+    slot.length = 0;
+    slot.type = 0;
+    slot.size = 0;
+    return &slot;
+}
+
+void Fec::add(Block &block, const char *data, int length, uint16_t xorLength, uint8_t xorType)
+{
+    addXor(payload(block), data, length);
+    if (length > block.size)
+        block.size = length;
+    block.length ^= xorLength;
+    block.type ^= xorType;
+    block.arrived++;
+}
+
+/* Rebuild the one data packet missing, once the parity is in. */
+void Fec::check(Block &block, Stats &stats)
+{
+    if (block.done)
+        return;
+
+    uint32_t all = (1u << block.k) - 1;
+    uint32_t missing = all & ~block.received;
+    if (missing == 0)
+    {
+        block.done = true;
+        return;
+    }
+    if (!(block.received & 1u << PARITY_BIT) || (missing & (missing - 1)) != 0)
+        return;
+
+    block.done = true;
+    block.received |= missing;
+    if (block.length == 0 || block.length > maxLength)
+        return;
+    rebuilt = &block;
+    stats.incFecRecovered();
+}
+
+/* A block leaves its slot: what did not arrive of it goes into the loss measured.
+ * Without its parity, the block may have been flushed before it was full, so
+ * only the packets up to the last that arrived count as sent. */
+void Fec::finish(Block &block, Stats &stats)
+{
+    int k = block.k;
+    if (!(block.received & 1u << PARITY_BIT))
+        for (k = 0; block.received >> k; k++)
+            ;
+
+    uint32_t missing = ((1u << k) - 1) & ~block.received;
+    int lost = 0;
+    for (; missing; missing &= missing - 1)
+        lost++;
+    if (lost > 0)
+        stats.addFecLost(lost);
+
+    int sent = k + 1;
+    lossAverage += (sent - block.arrived) * 1000 / sent - lossAverage / 16;
+    unreported++;
+}
+
+const char *Fec::decode(const char *payload, int &length, int &type, Stats &stats)
+{
+    rebuilt = NULL;
+    if (length <= DATA_HEADER_SIZE || length - DATA_HEADER_SIZE > maxLength)
+        return NULL;
+
+    uint16_t id;
+    memcpy(&id, payload, sizeof(id));
+    int index = (uint8_t)payload[2] >> 4;
+    int k = (payload[2] & 15) + 1;
+    type = (uint8_t)payload[3];
+    length -= DATA_HEADER_SIZE;
+    const char *packet = payload + DATA_HEADER_SIZE;
+    if (index >= k)
+        return NULL;
+
+    Block *block = this->block(ntohs(id), stats);
+    if (!block)
+        return packet; // too late to help rebuild, but no duplicate as far as we know
+    if (block->k == 0)
+        block->k = k;
+    if (index >= block->k)
+        return packet; // beyond the parity of a block flushed early
+    if (block->received & 1u << index)
+        return NULL;
+
+    block->received |= 1u << index;
+    add(*block, packet, length, length, type);
+    check(*block, stats);
+    return packet;
+}
+
+void Fec::decodeParity(const char *payload, int length, Stats &stats)
+{
+    rebuilt = NULL;
+    if (length < PARITY_HEADER_SIZE || length - PARITY_HEADER_SIZE > maxLength)
+        return;
+
+    uint16_t id, xorLength;
+    memcpy(&id, payload, sizeof(id));
+    int k = (uint8_t)payload[2];
+    memcpy(&xorLength, payload + 4, sizeof(xorLength));
+    if (k > MAX_BLOCK)
+        return;
+    peerLoss = (uint8_t)payload[3];
+    if (k == 0)
+        return;
+
+    Block *block = this->block(ntohs(id), stats);
+    if (!block)
+        return;
+    if (block->received & 1u << PARITY_BIT)
+        return;
+    /* the data carries the planned k, the parity of a flushed block a smaller one */
+    uint32_t data = block->received & ~(1u << PARITY_BIT);
+    if ((block->k != 0 && k > block->k) || data >> k)
+        return;
+    block->k = k;
+
+    block->received |= 1u << PARITY_BIT;
+    add(*block, payload + PARITY_HEADER_SIZE, length - PARITY_HEADER_SIZE, ntohs(xorLength), payload[6]);
+    check(*block, stats);
+}
+
+const char *Fec::recovered(int &length, int &type)
+{
+    if (!rebuilt)
+        return NULL;
+    length = rebuilt->length;
+    type = rebuilt->type;
+    const char *packet = payload(*rebuilt);
+    rebuilt = NULL;
+    return packet;
+}
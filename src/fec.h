@@ -0,0 +1,123 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FEC_H
+#define FEC_H
+
+#include "stats.h"
+
+#include <vector>
+#include <stdint.h>
+
+/*
+ * Forward error correction: data packets go out in blocks of k, each closed by
+ * a parity packet XORing the block, from which the receiver rebuilds a packet
+ * lost of it without waiting for a resend. Multi-byte fields are in network
+ * byte order.
+ *
+ * TYPE_DATA_FEC: [block uint16_t][index << 4 | k - 1][type][payload], the
+ * payload of a packet of `type`, TYPE_DATA or TYPE_DATA_SEQ.
+ *
+ * TYPE_FEC_PARITY: [block uint16_t][k][loss][length uint16_t][type][payload],
+ * lengths, types and payloads XORed over the block, payloads padded with
+ * zeros. A block flushed before it was full has a smaller k than its data. `loss` is the loss in permille of what the sender receives, which
+ * sizes the blocks sent to it; a parity of k 0 only carries that, for data
+ * flowing one way.
+ */
+class Fec
+{
+public:
+    enum { DATA_HEADER_SIZE = 4, PARITY_HEADER_SIZE = 7 };
+
+    /* For payloads of up to `maxLength` bytes. */
+    explicit Fec(int maxLength);
+
+    /* Write the TYPE_DATA_FEC payload of a packet of `type` to `buffer`;
+     * returns its length. Call parity() after each. */
+    int encode(char *buffer, const char *packet, int length, int type);
+    /* Write the TYPE_FEC_PARITY payload to `buffer` if the block is full;
+     * returns its length, 0 if it is not. */
+    int parity(char *buffer, Stats &stats);
+    /* Write the TYPE_FEC_PARITY payload of the packets the block has so far,
+     * closing it early; returns its length, 0 if the block is empty. */
+    int flush(char *buffer, Stats &stats);
+    /* Whether packets were encoded that no parity covers yet. */
+    bool open() const { return sendIndex > 0; }
+    /* Write a TYPE_FEC_PARITY payload of k 0 to `buffer`, only reporting the
+     * loss, if no parity did over the last blocks received; returns its
+     * length, 0 if none is due. */
+    int report(char *buffer);
+
+    /* The packet in a TYPE_DATA_FEC payload, setting `length` and `type`; NULL
+     * if it is invalid or was rebuilt before. */
+    const char *decode(const char *payload, int &length, int &type, Stats &stats);
+    void decodeParity(const char *payload, int length, Stats &stats);
+    /* The packet rebuilt by the last decode() or decodeParity(), NULL if none.
+     * It stays valid until the next of them. */
+    const char *recovered(int &length, int &type);
+
+private:
+    enum { SLOTS = 4, MAX_BLOCK = 16, PARITY_BIT = MAX_BLOCK, REPORT_BLOCKS = 4 };
+
+    /* A block being received: the XOR of what arrived of it, which once only
+     * one data packet is missing is that packet. */
+    struct Block
+    {
+        bool used;
+        uint16_t id;
+        int k;
+        uint32_t received; // data packets by index, rebuilt too, and PARITY_BIT
+        int arrived;
+        bool done;         // complete or rebuilt
+        uint16_t length;
+        uint8_t type;
+        int size;          // of the payload XOR, zero beyond
+    };
+
+    static int blockSize(int lossPermille);
+    static void addXor(char *to, const char *from, int length);
+    void writeParityHeader(char *buffer, int k);
+
+    Block *block(uint16_t id, Stats &stats);
+    char *payload(const Block &block) { return &buffers[(&block - blocks) * maxLength]; }
+    void add(Block &block, const char *payload, int length, uint16_t xorLength, uint8_t xorType);
+    void check(Block &block, Stats &stats);
+    void finish(Block &block, Stats &stats);
+
+    int maxLength;
+
+    /* sending */
+    uint16_t sendBlock;
+    int sendIndex;
+    int sendK;
+    uint16_t sendLength;
+    uint8_t sendType;
+    int sendSize;
+    std::vector<char> sendParity;
+    int peerLoss; // permille, as the peer measured what we send
+
+    /* receiving */
+    Block blocks[SLOTS];
+    std::vector<char> buffers;
+    Block *rebuilt;
+    int lossAverage; // permille * 16, over blocks
+    int unreported;  // blocks received since the loss went out
+};
+
+#endif
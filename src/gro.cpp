@@ -0,0 +1,245 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "gro.h"
+#include "tun.h"
+#include "checksum.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_URG 0x20
+#define TCP_CWR 0x80
+
+static const int MAX_PACKET = 65535;
+
+Gro::Gro(int flowCount, int frameHeaderSize)
+    : frameHeaderSize(frameHeaderSize),
+      bufferSize(frameHeaderSize + MAX_PACKET),
+      buffers((flowCount + 1) * (frameHeaderSize + MAX_PACKET)),
+      flows(flowCount),
+      clock(0)
+{
+    /* one buffer more than flows: a flow that is made ready keeps its buffer
+       until written, while the packet that displaced it starts a new one */
+    for (int i = 0; i <= flowCount; i++)
+        freeBuffers.push_back(i);
+    for (int i = 0; i < flowCount; i++)
+        flows[i].buffer = -1;
+}
+
+/* IPv4 TCP without IP options or fragmentation. The checksum is verified
+ * by checksumValid() once the payload has been copied and summed. */
+bool Gro::parse(const char *packet, int length, Segment &segment)
+{
+    const unsigned char *ip = (const unsigned char *)packet;
+    if (length < 40 || ip[0] != 0x45 || ip[9] != IPPROTO_TCP)
+        return false;
+    if (((ip[2] << 8) | ip[3]) != length || ((ip[6] & 0x3f) | ip[7]) != 0)
+        return false;
+
+    const unsigned char *tcp = ip + 20;
+    segment.ipLength = 20;
+    segment.headerLength = 20 + (tcp[12] >> 4) * 4;
+    if (segment.headerLength < 40 || segment.headerLength > length)
+        return false;
+
+    memcpy(segment.key, packet + 12, 12); // addresses and ports
+    memcpy(&segment.seq, tcp + 4, 4);
+    segment.seq = ntohl(segment.seq);
+    segment.flags = tcp[13];
+    segment.payloadLength = length - segment.headerLength;
+    return true;
+}
+
+/* The segment continues the flow exactly: next sequence number, no more than
+ * a full segment, and IP and TCP headers equal apart from length, id,
+ * checksums, sequence number and the FIN and PSH flags. */
+bool Gro::canAppend(const Flow &flow, const char *packet, const Segment &segment)
+{
+    if (flow.closed || segment.seq != flow.nextSeq || segment.headerLength != flow.headerLength ||
+        segment.payloadLength > flow.segmentSize || flow.length + segment.payloadLength > MAX_PACKET)
+        return false;
+
+    const char *first = &buffers[flow.buffer * bufferSize] + frameHeaderSize;
+    return packet[1] == first[1] && packet[6] == first[6] && packet[8] == first[8] && // tos, DF, ttl
+           memcmp(packet + 28, first + 28, 4) == 0 &&                             // ack
+           ((packet[33] ^ first[33]) & ~(TCP_FIN | TCP_PSH)) == 0 &&              // flags
+           memcmp(packet + 34, first + 34, 2) == 0 &&                             // window
+           memcmp(packet + 40, first + 40, segment.headerLength - 40) == 0;       // options
+}
+
+bool Gro::checksumValid(const char *packet, const Segment &segment, uint32_t payloadSum)
+{
+    int tcpLength = segment.headerLength - segment.ipLength + segment.payloadLength;
+    uint32_t sum = Checksum::addPseudoHeader(payloadSum, packet + 12, IPPROTO_TCP, tcpLength);
+    return Checksum::fold(Checksum::add(sum, packet + segment.ipLength,
+                                        segment.headerLength - segment.ipLength)) == 0;
+}
+
+bool Gro::start(Flow &flow, const char *packet, const Segment &segment)
+{
+    flow.buffer = freeBuffers.back();
+    freeBuffers.pop_back();
+    memcpy(flow.key, segment.key, sizeof(flow.key));
+    flow.headerLength = segment.headerLength;
+    flow.segmentSize = segment.payloadLength;
+    flow.segments = 1;
+    flow.length = segment.headerLength + segment.payloadLength;
+    flow.nextSeq = segment.seq + segment.payloadLength;
+    flow.closed = (segment.flags & (TCP_FIN | TCP_PSH)) != 0;
+    flow.lastUsed = clock;
+
+    char *packetStart = buffer(flow.buffer) + frameHeaderSize;
+    memcpy(packetStart, packet, segment.headerLength);
+    uint32_t payloadSum = Checksum::copy(packetStart + segment.headerLength, packet + segment.headerLength,
+                                         segment.payloadLength);
+    if (!checksumValid(packet, segment, payloadSum))
+    {
+        freeBuffers.push_back(flow.buffer);
+        flow.buffer = -1;
+        return false;
+    }
+    return true;
+}
+
+bool Gro::add(const char *packet, int length)
+{
+    clock++;
+
+    Segment segment;
+    if (!parse(packet, length, segment))
+        return false; // not TCP, or not ours to touch: no flow to keep in order
+
+    Flow *match = NULL;
+    Flow *unused = NULL;
+    Flow *oldest = NULL;
+    for (int i = 0; i < (int)flows.size(); i++)
+    {
+        Flow &flow = flows[i];
+        if (flow.buffer == -1)
+        {
+            unused = &flow;
+            continue;
+        }
+        if (memcmp(flow.key, segment.key, sizeof(flow.key)) == 0)
+            match = &flow;
+        if (!oldest || flow.lastUsed < oldest->lastUsed)
+            oldest = &flow;
+    }
+
+    bool coalescable = segment.payloadLength > 0 &&
+                       !(segment.flags & (TCP_SYN | TCP_RST | TCP_URG | TCP_CWR));
+
+    if (match && coalescable && canAppend(*match, packet, segment))
+    {
+        char *packetStart = buffer(match->buffer) + frameHeaderSize;
+        uint32_t payloadSum = Checksum::copy(packetStart + match->length, packet + segment.headerLength,
+                                             segment.payloadLength);
+        if (!checksumValid(packet, segment, payloadSum))
+        {
+            makeReady(*match); // the copy past its end is ignored
+            return false;
+        }
+        packetStart[33] |= segment.flags & (TCP_FIN | TCP_PSH);
+        match->length += segment.payloadLength;
+        match->nextSeq += segment.payloadLength;
+        match->segments++;
+        match->lastUsed = clock;
+        if (segment.payloadLength < match->segmentSize || (segment.flags & (TCP_FIN | TCP_PSH)))
+            match->closed = true;
+        return true;
+    }
+
+    /* whatever was held for the flow goes before this packet */
+    if (match)
+    {
+        makeReady(*match);
+        unused = match;
+    }
+    if (!coalescable)
+        return false;
+
+    if (!unused)
+    {
+        makeReady(*oldest);
+        unused = oldest;
+    }
+    return start(*unused, packet, segment);
+}
+
+/* Write the frame header and fix up the IP header of a coalesced packet. The
+ * TCP checksum field gets the pseudo header sum, the kernel completes it. */
+void Gro::makeReady(Flow &flow)
+{
+    char *frame = buffer(flow.buffer);
+    char *packet = frame + frameHeaderSize;
+
+    Tun::VnetHeader header;
+    memset(&header, 0, sizeof(header));
+
+    if (flow.segments > 1)
+    {
+        uint16_t length = htons(flow.length);
+        memcpy(packet + 2, &length, 2);
+        packet[10] = packet[11] = 0;
+        uint16_t sum = htons(Checksum::fold(Checksum::add(0, packet, 20)));
+        memcpy(packet + 10, &sum, 2);
+
+        sum = htons((uint16_t)~Checksum::fold(Checksum::addPseudoHeader(0, packet + 12, IPPROTO_TCP,
+                                                              flow.length - 20)));
+        memcpy(packet + 36, &sum, 2);
+
+        header.flags = Tun::VNET_F_NEEDS_CSUM;
+        header.gsoType = Tun::VNET_GSO_TCPV4;
+        header.headerLength = flow.headerLength;
+        header.gsoSize = flow.segmentSize;
+        header.csumStart = 20;
+        header.csumOffset = 16;
+    }
+    memcpy(frame, &header, sizeof(header));
+
+    ready.push_back(std::make_pair(flow.buffer, frameHeaderSize + flow.length));
+    flow.buffer = -1;
+}
+
+void Gro::flush()
+{
+    for (int i = 0; i < (int)flows.size(); i++)
+        if (flows[i].buffer != -1)
+            makeReady(flows[i]);
+}
+
+const char *Gro::nextReady(int &length)
+{
+    if (ready.empty())
+        return NULL;
+
+    /* written in the order they were made ready */
+    int index = ready.front().first;
+    length = ready.front().second;
+    ready.erase(ready.begin());
+    freeBuffers.push_back(index);
+    return buffer(index);
+}
@@ -0,0 +1,87 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GRO_H
+#define GRO_H
+
+#include <vector>
+#include <stdint.h>
+
+/* Receive offload for the tunnel device: consecutive in-order segments of a
+ * TCP flow are coalesced into one super-packet, written with a virtio-net
+ * header that has the kernel take it as a single GSO packet. Segments are held
+ * for at most one receive batch. */
+class Gro
+{
+public:
+    /* Up to `flowCount` flows are held at a time; the least recently used one
+     * is written out to make room for another. */
+    Gro(int flowCount, int frameHeaderSize);
+
+    /* Take a packet. Returns false if it has to be written as it is, which the
+     * caller does after writing the frames that are ready. */
+    bool add(const char *packet, int length);
+    /* Make every held flow ready, at the end of a receive batch. */
+    void flush();
+    /* Next frame to write, header included; NULL if none. It stays valid until
+     * the next add(). */
+    const char *nextReady(int &length);
+
+protected:
+    struct Segment
+    {
+        uint32_t key[3]; // addresses and ports
+        int ipLength;
+        int headerLength; // IP and TCP
+        int payloadLength;
+        uint32_t seq;
+        uint8_t flags;
+    };
+
+    struct Flow
+    {
+        int buffer; // -1 if the flow is unused
+        uint32_t key[3];
+        int headerLength;
+        int segmentSize; // payload of the first segment, the gso size
+        int segments;
+        int length;      // coalesced packet, without the frame header
+        uint32_t nextSeq;
+        bool closed;     // a short, FIN or PSH segment ended it
+        unsigned int lastUsed;
+    };
+
+    bool parse(const char *packet, int length, Segment &segment);
+    bool canAppend(const Flow &flow, const char *packet, const Segment &segment);
+    /* The segment's TCP checksum, given the sum of its payload, taken while copying it. */
+    bool checksumValid(const char *packet, const Segment &segment, uint32_t payloadSum);
+    bool start(Flow &flow, const char *packet, const Segment &segment);
+    void makeReady(Flow &flow);
+    char *buffer(int index) { return &buffers[index * bufferSize]; }
+
+    int frameHeaderSize;
+    int bufferSize;
+    std::vector<char> buffers;
+    std::vector<int> freeBuffers;
+    std::vector<Flow> flows;
+    std::vector<std::pair<int, int> > ready; // buffer, frame length
+    unsigned int clock;
+};
+
+#endif
@@ -20,6 +20,7 @@
 #include "client.h"
 #include "server.h"
 #include "exception.h"
+#include "config.h"
 
 #include <iostream>
 #include <arpa/inet.h>
@@ -74,11 +75,12 @@ static void usage()
         "  hans -c server [-fv] [-p passphrase] [-u user] [-d tun_device]\n"
         "       [-m reference_mtu] [-w polls]\n\n"
         "RUN AS SERVER (linux only)\n"
-        "  hans -s network [-fvr] [-p passphrase] [-u user] [-d tun_device]\n"
-        "       [-m reference_mtu] [-a ip]\n\n"
+        "  hans -s network[/bits] [-fvr] [-p passphrase] [-u user] [-d tun_device]\n"
+        "       [-m reference_mtu] [-a ip] [-T threads]\n\n"
         "ARGUMENTS\n"
         "  -c server     Run as client. Connect to given server address.\n"
         "  -s network    Run as server. Use given network address on virtual interfaces.\n"
+        "                Append /bits for a prefix length from 12 to 30. Default /24.\n"
         "  -p passphrase Set passphrase.\n"
         "  -u username   Change user under which the program runs.\n"
         "  -a ip         Request assignment of given tunnel ip address from the server.\n"
@@ -96,9 +98,30 @@ static void usage()
         "  -q            Change echo sequence number on every echo request. May help with\n"
         "                buggy routers. May impact performance with others.\n"
         "  -B buf        Socket buffer sizes: recv,snd in bytes (e.g. 262144,262144).\n"
-        "  -R rate       Pacing: max send rate in Kbps (0 = disabled).\n"
+        "  -R rate       Pacing: max send rate in Kbps (0 = disabled). Packets over the\n"
+        "                rate wait in a bounded queue.\n"
+        "  -K            Kernel pacing (Linux, with -R): send packets over the rate right\n"
+        "                away with their departure time (SO_TXTIME), for an fq qdisc on\n"
+        "                the outgoing device to hold.\n"
+        "  -C            Congestion control (client only): probe the path about once per\n"
+        "                RTT and set the pacing rate and the number of outstanding polls\n"
+        "                from its measured bandwidth, RTT and loss. -R becomes the limit.\n"
+        "  -N            Sequenced data (client only): number tunnel packets in both\n"
+        "                directions and resend those the other side reports missing.\n"
+        "  -F            Forward error correction (client only): send a parity packet\n"
+        "                after every block of data packets in both directions, from which\n"
+        "                a packet lost of the block is rebuilt. Blocks shrink as loss grows.\n"
         "  -W packets   Max buffered packets per client (server only). Default 20.\n"
         "  -6            Use IPv6 (client only). Connect to server via AAAA.\n"
+        "  -U            Use io_uring for tunnel and ICMP I/O (Linux 6.0+). Falls back\n"
+        "                to epoll if the kernel does not support it.\n"
+        "  -T threads    Server threads (Linux only). Each thread serves its share of the\n"
+        "                clients from its own queue of a multi-queue tun device. Default 1.\n"
+        "  -P device     Exchange ICMP over AF_PACKET rings on the given Ethernet device\n"
+        "                (Linux, IPv4 only) instead of a raw socket.\n"
+        "  -b usecs      Busy polling: after receiving anything, keep polling the tunnel\n"
+        "                and ICMP sockets without sleeping for usecs microseconds. Trades\n"
+        "                CPU time for wakeup latency. Default 0 (off).\n"
         "  -f            Run in foreground.\n"
         "  -v            Print debug information.\n"
         "  SIGUSR1       Dump packet stats to syslog.\n";
@@ -110,12 +133,14 @@ int main(int argc, char *argv[])
     string userName;
     string passphrase;
     string device;
+    string ringDevice;
     bool isServer = false;
     bool isClient = false;
     bool foreground = false;
     int mtu = 1500;
     int maxPolls = 10;
     uint32_t network = INADDR_NONE;
+    int prefixLength = 24;
     uint32_t clientIp = INADDR_NONE;
     bool answerPing = false;
     uid_t uid = 0;
@@ -126,13 +151,20 @@ int main(int argc, char *argv[])
     int recvBufSize = 256 * 1024;
     int sndBufSize = 256 * 1024;
     int rateKbps = 0;
+    int busyPoll = 0;
+    bool kernelPacing = false;
+    bool congestionControl = false;
+    bool sequencing = false;
+    bool fec = false;
     int maxBufferedPackets = 20;
     bool useIPv6 = false;
+    bool useUring = false;
+    int threads = 1;
 
     openlog(argv[0], LOG_PERROR, LOG_DAEMON);
 
     int c;
-    while ((c = getopt(argc, argv, "fru:d:p:s:c:m:w:qiva:B:R:W:6")) != -1)
+    while ((c = getopt(argc, argv, "fru:d:p:s:c:m:w:qiva:B:R:KCNFW:6UT:P:b:")) != -1)
     {
         switch(c) {
             case 'f':
@@ -152,12 +184,20 @@ int main(int argc, char *argv[])
                 isClient = true;
                 serverName = optarg;
                 break;
-            case 's':
+            case 's': {
                 isServer = true;
-                network = ntohl(inet_addr(optarg));
+                string address = optarg;
+                size_t slash = address.find('/');
+                if (slash != string::npos)
+                {
+                    prefixLength = atoi(address.c_str() + slash + 1);
+                    address.erase(slash);
+                }
+                network = ntohl(inet_addr(address.c_str()));
                 if (network == INADDR_NONE)
                     std::cerr << "invalid network\n";
                 break;
+            }
             case 'm':
                 mtu = atoi(optarg);
                 break;
@@ -193,6 +233,18 @@ int main(int argc, char *argv[])
                 if (rateKbps < 0)
                     rateKbps = 0;
                 break;
+            case 'K':
+                kernelPacing = true;
+                break;
+            case 'C':
+                congestionControl = true;
+                break;
+            case 'N':
+                sequencing = true;
+                break;
+            case 'F':
+                fec = true;
+                break;
             case 'W':
                 maxBufferedPackets = atoi(optarg);
                 if (maxBufferedPackets < 1)
@@ -201,6 +253,20 @@ int main(int argc, char *argv[])
             case '6':
                 useIPv6 = true;
                 break;
+            case 'U':
+                useUring = true;
+                break;
+            case 'T':
+                threads = atoi(optarg);
+                break;
+            case 'P':
+                ringDevice = optarg;
+                break;
+            case 'b':
+                busyPoll = atoi(optarg);
+                if (busyPoll < 0)
+                    busyPoll = 0;
+                break;
             default:
                 usage();
                 return 1;
@@ -209,6 +275,16 @@ int main(int argc, char *argv[])
 
     mtu -= Echo::headerSize() + Worker::headerSize();
 
+    /* the echo packets of sequenced data carry the tunnel's packets behind a
+       sequence number, and the server sends them to any client that asks */
+    if (isServer || sequencing || SEQUENCE_ENABLED)
+        mtu -= SendWindow::HEADER_SIZE;
+
+    /* FEC wraps those payloads once more, and parity packets are larger than
+       the largest packet they protect */
+    if (isServer || fec || FEC_ENABLED)
+        mtu -= Fec::PARITY_HEADER_SIZE;
+
     if (mtu < 68)
     {
         // RFC 791: Every internet module must be able to forward a datagram of
@@ -219,13 +295,23 @@ int main(int argc, char *argv[])
 
     if ((isClient == isServer) ||
         (isServer && network == INADDR_NONE) ||
+        (prefixLength < 12 || prefixLength > 30) ||
         (maxPolls < 0 || maxPolls > 255) ||
+        (threads < 1 || threads > 64) ||
         (isServer && (changeEchoSeq || changeEchoId)))
     {
         usage();
         return 1;
     }
 
+#ifndef LINUX
+    if (threads > 1)
+    {
+        syslog(LOG_WARNING, "multiple server threads are only supported on Linux");
+        threads = 1;
+    }
+#endif
+
     if (!userName.empty())
     {
 #ifdef WIN32
@@ -261,7 +347,9 @@ int main(int argc, char *argv[])
         {
             worker = new Server(mtu, device.empty() ? NULL : &device, passphrase,
                                 network, answerPing, uid, gid, 5000,
-                                maxBufferedPackets, recvBufSize, sndBufSize, rateKbps);
+                                maxBufferedPackets, recvBufSize, sndBufSize, rateKbps,
+                                useUring, ringDevice.empty() ? NULL : &ringDevice, threads,
+                                prefixLength, busyPoll);
         }
         else
         {
@@ -293,7 +381,7 @@ int main(int argc, char *argv[])
                                     0, maxPolls, passphrase, uid, gid,
                                     changeEchoId, changeEchoSeq, clientIp,
                                     recvBufSize, sndBufSize, rateKbps,
-                                    true, &serverIp6);
+                                    true, &serverIp6, useUring);
             }
             else
             {
@@ -311,7 +399,7 @@ int main(int argc, char *argv[])
                                     ntohl(serverIp), maxPolls, passphrase, uid, gid,
                                     changeEchoId, changeEchoSeq, clientIp,
                                     recvBufSize, sndBufSize, rateKbps,
-                                    false, NULL);
+                                    false, NULL, useUring, ringDevice.empty() ? NULL : &ringDevice);
             }
             freeaddrinfo(res);
         }
@@ -329,6 +417,16 @@ int main(int argc, char *argv[])
 #endif
         }
 
+        if (isClient) // the server set it up before dropping privileges
+            worker->setBusyPoll(busyPoll);
+        if (kernelPacing)
+            worker->setKernelPacing();
+        if (congestionControl)
+            worker->setCongestionControl();
+        if (sequencing)
+            worker->setSequencing();
+        if (fec)
+            worker->setFec();
         worker->run();
     }
     catch (Exception e)
@@ -0,0 +1,234 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "msgbatch.h"
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef LINUX
+#include <time.h>
+#include <linux/net_tstamp.h>
+#ifndef SO_TXTIME // Linux 4.19
+#define SO_TXTIME 61
+#endif
+#ifndef SCM_TXTIME
+#define SCM_TXTIME SO_TXTIME
+#endif
+#endif
+
+/* slots start on their own cache line */
+#define SLOT_ALIGN 64
+
+MsgBatch::MsgBatch(int slotCount, int slotSize)
+{
+    if (slotCount < 1)
+        slotCount = 1;
+
+    this->slotCount = slotCount;
+    this->slotSize = slotSize;
+    this->slotStride = (slotSize + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+
+    data.resize(this->slotCount * slotStride);
+    lengths.resize(this->slotCount);
+    offsets.resize(this->slotCount);
+    tails.resize(this->slotCount);
+    tailLengths.resize(this->slotCount);
+    addresses.resize(this->slotCount);
+    addressLengths.resize(this->slotCount);
+    txTimes.resize(this->slotCount);
+    controls.resize(this->slotCount * TXTIME_CONTROL_SIZE);
+
+#ifdef LINUX
+    headers.resize(this->slotCount);
+    memset(&headers[0], 0, headers.size() * sizeof(struct mmsghdr));
+#endif
+    iovecs.resize(2 * this->slotCount);
+}
+
+int MsgBatch::receive(int fd, int maxCount)
+{
+    if (maxCount > slotCount)
+        maxCount = slotCount;
+    if (maxCount < 1)
+        return 0;
+
+#ifdef LINUX
+    for (int i = 0; i < maxCount; i++)
+    {
+        iovecs[i].iov_base = buffer(i);
+        iovecs[i].iov_len = slotSize;
+
+        struct msghdr &msg = headers[i].msg_hdr;
+        msg.msg_name = &addresses[i];
+        msg.msg_namelen = sizeof(struct sockaddr_storage);
+        msg.msg_iov = &iovecs[i];
+        msg.msg_iovlen = 1;
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        msg.msg_flags = 0;
+    }
+
+    int count = recvmmsg(fd, &headers[0], maxCount, MSG_DONTWAIT, NULL);
+    if (count == -1)
+        return -1;
+
+    for (int i = 0; i < count; i++)
+        lengths[i] = headers[i].msg_len;
+    return count;
+#else
+    int count = 0;
+    while (count < maxCount)
+    {
+        socklen_t addressLength = sizeof(struct sockaddr_storage);
+        int length = recvfrom(fd, buffer(count), slotSize, 0,
+                              (struct sockaddr *)&addresses[count], &addressLength);
+        if (length == -1)
+            return count > 0 ? count : -1;
+
+        lengths[count++] = length;
+#ifdef WIN32
+        break; /* socket is blocking on Windows */
+#endif
+    }
+    return count;
+#endif
+}
+
+void MsgBatch::setPacket(int slot, int offset, int length, const struct sockaddr *address, socklen_t addressLength,
+                         const char *tail, int tailLength)
+{
+    offsets[slot] = offset;
+    lengths[slot] = length;
+    tails[slot] = tail;
+    tailLengths[slot] = tail ? tailLength : 0;
+    memcpy(&addresses[slot], address, addressLength);
+    addressLengths[slot] = addressLength;
+    txTimes[slot] = 0;
+}
+
+void MsgBatch::setMessage(int slot, struct msghdr &msg)
+{
+    struct iovec *iov = &iovecs[2 * slot];
+    iov[0].iov_base = buffer(slot) + offsets[slot];
+    iov[0].iov_len = lengths[slot];
+    iov[1].iov_base = (char *)tails[slot];
+    iov[1].iov_len = tailLengths[slot];
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &addresses[slot];
+    msg.msg_namelen = addressLengths[slot];
+    msg.msg_iov = iov;
+    msg.msg_iovlen = tailLengths[slot] ? 2 : 1;
+    if (txTimes[slot])
+        addTxTime(msg, &controls[slot * TXTIME_CONTROL_SIZE], txTimes[slot]);
+}
+
+void MsgBatch::addTxTime(struct msghdr &msg, char *control, uint64_t ns)
+{
+#ifdef LINUX
+    memset(control, 0, TXTIME_CONTROL_SIZE);
+    msg.msg_control = control;
+    msg.msg_controllen = TXTIME_CONTROL_SIZE;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_TXTIME;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+    memcpy(CMSG_DATA(cmsg), &ns, sizeof(ns));
+#else
+    (void)msg;
+    (void)control;
+    (void)ns;
+#endif
+}
+
+bool MsgBatch::enableTxTime(int fd)
+{
+#ifdef LINUX
+    struct sock_txtime config;
+    memset(&config, 0, sizeof(config));
+    config.clockid = CLOCK_MONOTONIC;
+    return setsockopt(fd, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) == 0;
+#else
+    (void)fd;
+    errno = EOPNOTSUPP;
+    return false;
+#endif
+}
+
+int MsgBatch::send(int fd, int first, int count, SendResult &result)
+{
+    count += first;
+    if (count > slotCount)
+        count = slotCount;
+
+    int done = first;
+    int packets = 0;
+
+#ifdef LINUX
+    for (int i = first; i < count; i++)
+        setMessage(i, headers[i].msg_hdr);
+
+    while (done < count)
+    {
+        int sent = sendmmsg(fd, &headers[done], count - done, MSG_DONTWAIT);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+            {
+                /* socket buffer full: the rest of the batch would fail the same way */
+                result.failed += count - done;
+                break;
+            }
+            /* this datagram alone is undeliverable (e.g. no route to its destination) */
+            result.failed++;
+            done++;
+            continue;
+        }
+
+        for (int i = done; i < done + sent; i++)
+            result.bytes += headers[i].msg_len;
+        packets += sent;
+        done += sent;
+
+        if (done < count)
+            result.partial++;
+    }
+#else
+    for (; done < count; done++)
+    {
+        struct msghdr msg;
+        setMessage(done, msg);
+        int sent = sendmsg(fd, &msg, 0);
+        if (sent == -1)
+        {
+            result.failed++;
+            continue;
+        }
+        result.bytes += sent;
+        packets++;
+    }
+#endif
+
+    result.packets += packets;
+    return packets;
+}
@@ -0,0 +1,103 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MSGBATCH_H
+#define MSGBATCH_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* Array of datagram slots (buffer + peer address + length) filled or drained
+ * with one recvmmsg/sendmmsg call on Linux, one recvfrom/sendmsg per slot elsewhere.
+ * A datagram sent from a slot may end in a tail kept outside the batch, which is
+ * gathered by the send call instead of being copied in. */
+class MsgBatch
+{
+public:
+    struct SendResult
+    {
+        SendResult() : packets(0), bytes(0), failed(0), partial(0) { }
+
+        int packets;  // datagrams handed to the kernel
+        int bytes;
+        int failed;   // datagrams dropped on error
+        int partial;  // sendmmsg calls that stopped short of the batch
+    };
+
+    MsgBatch(int slotCount, int slotSize);
+
+    int size() const { return slotCount; }
+
+    char *buffer(int slot) { return &data[slot * slotStride]; }
+    const char *buffer(int slot) const { return &data[slot * slotStride]; }
+    int length(int slot) const { return lengths[slot]; }
+    int offset(int slot) const { return offsets[slot]; }
+    const char *tail(int slot) const { return tails[slot]; }
+    int tailLength(int slot) const { return tailLengths[slot]; }
+    const struct sockaddr *address(int slot) const { return (const struct sockaddr *)&addresses[slot]; }
+    socklen_t addressLength(int slot) const { return addressLengths[slot]; }
+
+    /* Receive up to maxCount datagrams into slots 0..n-1. Returns n, or -1 with errno set. */
+    int receive(int fd, int maxCount);
+
+    /* Describe the datagram in `slot`: `length` bytes at buffer(slot) + offset, followed by
+     * `tailLength` bytes at `tail`, sent to `address`. The tail has to stay in place until sent. */
+    void setPacket(int slot, int offset, int length, const struct sockaddr *address, socklen_t addressLength,
+                   const char *tail = NULL, int tailLength = 0);
+    /* Have the datagram in `slot` leave at `ns` on the socket's SO_TXTIME clock (Linux). */
+    void setTxTime(int slot, uint64_t ns) { txTimes[slot] = ns; }
+    uint64_t txTime(int slot) const { return txTimes[slot]; } // 0 if none
+    /* Attach an SCM_TXTIME message in `control`, TXTIME_CONTROL_SIZE bytes that have to stay
+     * in place until sent. */
+    static void addTxTime(struct msghdr &msg, char *control, uint64_t ns);
+    /* Have socket `fd` take departure times on CLOCK_MONOTONIC; false with errno set if it cannot. */
+    static bool enableTxTime(int fd);
+    enum { TXTIME_CONTROL_SIZE = CMSG_SPACE(sizeof(uint64_t)) };
+
+    /* Send slots first..first+count-1, adding the outcome to `result`. Returns the number of datagrams sent. */
+    int send(int fd, int first, int count, SendResult &result);
+
+protected:
+    void setMessage(int slot, struct msghdr &msg);
+
+    int slotCount;
+    int slotSize;
+    int slotStride;
+
+    std::vector<char> data;
+    std::vector<int> lengths;
+    std::vector<int> offsets;
+    std::vector<const char *> tails;
+    std::vector<int> tailLengths;
+    std::vector<struct sockaddr_storage> addresses;
+    std::vector<socklen_t> addressLengths;
+    std::vector<uint64_t> txTimes;
+    std::vector<char> controls;
+
+#ifdef LINUX
+    std::vector<struct mmsghdr> headers;
+#endif
+    std::vector<struct iovec> iovecs; // two per slot when sending
+};
+
+#endif
@@ -19,19 +19,25 @@
 
 #include "pacer.h"
 
+/* Tokens are kept in bytes times NS_PER_SECOND, so that a refill adds the
+ * rate in bytes per second times the nanoseconds passed, without rounding. */
+static const int64_t NS_PER_SECOND = 1000000000;
+
 Pacer::Pacer()
     : enabled(false)
     , tokens(0)
-    , refillRate(0)
+    , bytesPerSecond(0)
     , burstBytes(0)
+    , minBurstBytes(0)
 {
 }
 
 Pacer::Pacer(int rateKbps, int burstBytes_)
     : enabled(rateKbps > 0)
-    , tokens(static_cast<double>(burstBytes_))
-    , refillRate(rateKbps > 0 ? (rateKbps * 1000.0 / 8.0) / 1000.0 : 0) /* bytes/ms */
+    , tokens((int64_t)burstBytes_ * NS_PER_SECOND)
+    , bytesPerSecond(rateKbps > 0 ? (int64_t)rateKbps * 1000 / 8 : 0)
     , burstBytes(burstBytes_)
+    , minBurstBytes(burstBytes_)
     , lastRefill(Time::now())
 {
 }
@@ -40,27 +46,57 @@ void Pacer::refill(Time now)
 {
     if (!enabled)
         return;
-    Time delta = now - lastRefill;
-    if (delta < Time::ZERO)
-    {
-        lastRefill = now;
-        return;
-    }
-    double ms = delta.getTimeval().tv_sec * 1000.0 + delta.getTimeval().tv_usec / 1000.0;
-    tokens += refillRate * ms;
-    if (tokens > burstBytes)
-        tokens = burstBytes;
+    int64_t delta = (now - lastRefill).nanoseconds();
     lastRefill = now;
+    if (delta <= 0)
+        return;
+
+    int64_t full = (int64_t)burstBytes * NS_PER_SECOND;
+    if (delta >= (full - tokens) / bytesPerSecond + 1) // also keeps the product in range
+        tokens = full;
+    else
+        tokens += bytesPerSecond * delta;
 }
 
 bool Pacer::allowSend(int payloadBytes)
 {
     if (!enabled)
         return true;
-    if (tokens >= payloadBytes)
+    int64_t cost = (int64_t)payloadBytes * NS_PER_SECOND;
+    if (tokens >= cost)
     {
-        tokens -= payloadBytes;
+        tokens -= cost;
         return true;
     }
     return false;
 }
+
+Time Pacer::departure(int payloadBytes) const
+{
+    int64_t missing = (int64_t)payloadBytes * NS_PER_SECOND - tokens;
+    if (!enabled || missing <= 0)
+        return lastRefill;
+    return lastRefill + Time::fromNanoseconds((missing + bytesPerSecond - 1) / bytesPerSecond);
+}
+
+bool Pacer::schedule(int payloadBytes, Time latest, Time &at)
+{
+    at = departure(payloadBytes);
+    if (!enabled)
+        return true;
+    if (latest < at)
+        return false;
+    tokens -= (int64_t)payloadBytes * NS_PER_SECOND;
+    return true;
+}
+
+void Pacer::setRate(int rateKbps)
+{
+    int64_t rate = rateKbps > 0 ? (int64_t)rateKbps * 1000 / 8 : 0;
+    int64_t burst = rate / 1000;
+    burstBytes = burst > 64 * 1024 ? 64 * 1024 : burst > minBurstBytes ? (int)burst : minBurstBytes;
+    if (!enabled || tokens > (int64_t)burstBytes * NS_PER_SECOND)
+        tokens = (int64_t)burstBytes * NS_PER_SECOND;
+    enabled = rate > 0;
+    bytesPerSecond = rate;
+}
@@ -22,6 +22,8 @@
 
 #include "time.h"
 
+#include <stdint.h>
+
 class Pacer
 {
 public:
@@ -30,12 +32,21 @@ public:
 
     void refill(Time now);
     bool allowSend(int payloadBytes);
+    /* When allowSend(payloadBytes) will succeed at the earliest. */
+    Time departure(int payloadBytes) const;
+    /* Take the bytes for a packet that leaves at `at` = departure(payloadBytes), going
+     * into debt for the packets after it; false, taking nothing, if `at` is after `latest`. */
+    bool schedule(int payloadBytes, Time latest, Time &at);
+    bool isEnabled() const { return enabled; }
+    /* Change the rate, 0 = disabled. The burst grows to a millisecond's worth at high rates. */
+    void setRate(int rateKbps);
 
 private:
     bool enabled;
-    double tokens;       /* bytes */
-    double refillRate;    /* bytes per millisecond */
+    int64_t tokens;          /* bytes * 10^9 */
+    int64_t bytesPerSecond;
     int burstBytes;
+    int minBurstBytes;
     Time lastRefill;
 };
 
@@ -0,0 +1,55 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "packetpool.h"
+
+#include <stdint.h>
+
+PacketPool::PacketPool(int slotCount, int slotSize)
+{
+    stride = (slotSize + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    resize(slotCount);
+}
+
+void PacketPool::resize(int slotCount)
+{
+    this->slotCount = slotCount;
+    storage.clear();
+    storage.resize(slotCount * stride + ALIGNMENT - 1);
+    memory = &storage[0] + (ALIGNMENT - (uintptr_t)&storage[0] % ALIGNMENT) % ALIGNMENT;
+
+    /* taken from the back, so slot 0 goes first */
+    freeSlots.resize(slotCount);
+    for (int i = 0; i < slotCount; i++)
+        freeSlots[i] = slotCount - 1 - i;
+}
+
+int PacketPool::take()
+{
+    if (freeSlots.empty())
+        return -1;
+    int slot = freeSlots.back();
+    freeSlots.pop_back();
+    return slot;
+}
+
+void PacketPool::release(int slot)
+{
+    freeSlots.push_back(slot);
+}
@@ -0,0 +1,52 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PACKETPOOL_H
+#define PACKETPOOL_H
+
+#include <vector>
+
+/* Fixed number of packet buffers allocated in one piece, each starting on a
+ * cache line of its own, handed out and taken back by slot number. */
+class PacketPool
+{
+public:
+    PacketPool(int slotCount, int slotSize);
+
+    /* Reallocate for `slotCount` slots; none may be taken. */
+    void resize(int slotCount);
+
+    int take(); // -1 if all slots are taken
+    void release(int slot);
+    char *data(int slot) { return memory + slot * stride; }
+
+    int size() const { return slotCount; }
+    int available() const { return freeSlots.size(); }
+
+protected:
+    enum { ALIGNMENT = 64 };
+
+    int slotCount;
+    int stride;
+    std::vector<char> storage;
+    char *memory; // first aligned byte of storage
+    std::vector<int> freeSlots;
+};
+
+#endif
@@ -0,0 +1,377 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "packetring.h"
+
+#ifdef LINUX
+
+#include "exception.h"
+#include "checksum.h"
+#include "config.h"
+#include "bpf.h"
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+/* frames start at tp_mac; transmit frames at the aligned header's end */
+static const int TX_DATA_OFFSET = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+static const int ETHERNET_HEADER = 14;
+static const int IP_HEADER = 20;
+
+PacketRing::PacketRing(const std::string &device, int maxDatagram)
+    : device(device), rxFd(-1), rxRing(NULL), txFd(-1), txRing(NULL), neighbors(HANS_PACKET_NEIGHBORS)
+{
+    ifIndex = if_nametoindex(device.c_str());
+    if (ifIndex == 0)
+        throw Exception("packet ring device " + device, true);
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1)
+        throw Exception("creating socket", true);
+    struct ifreq request;
+    memset(&request, 0, sizeof(request));
+    strncpy(request.ifr_name, device.c_str(), IFNAMSIZ - 1);
+    bool ethernet = ioctl(fd, SIOCGIFHWADDR, &request) == 0 &&
+                    request.ifr_hwaddr.sa_family == ARPHRD_ETHER;
+    memcpy(mac, request.ifr_hwaddr.sa_data, 6);
+    mtu = ioctl(fd, SIOCGIFMTU, &request) == 0 ? request.ifr_mtu : 0;
+    close(fd);
+    if (!ethernet || mtu == 0)
+        throw Exception(device + " is not an Ethernet device");
+
+    try
+    {
+        setupRx();
+        setupTx(maxDatagram);
+    }
+    catch (...)
+    {
+        closeRings();
+        throw;
+    }
+
+    ipId = getpid();
+}
+
+PacketRing::~PacketRing()
+{
+    closeRings();
+}
+
+void PacketRing::closeRings()
+{
+    if (rxRing)
+        munmap(rxRing, (size_t)rxBlockSize * rxBlocks);
+    if (txRing)
+        munmap(txRing, (size_t)txFrameSize * txFrames);
+    if (rxFd != -1)
+        close(rxFd);
+    if (txFd != -1)
+        close(txFd);
+}
+
+/* The socket is bound only once it rejects everything, so nothing is queued
+ * to it before its owner's filter is in place. */
+void PacketRing::setupRx()
+{
+    rxFd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (rxFd == -1)
+        throw Exception("creating packet socket", true);
+
+    if (!BpfProgram::rejectAll(rxFd))
+        throw Exception("attaching filter to packet socket", true);
+
+    int version = TPACKET_V3;
+    if (setsockopt(rxFd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1)
+        throw Exception("TPACKET_V3", true);
+
+    rxBlockSize = HANS_PACKET_RX_BLOCK_SIZE;
+    rxBlocks = HANS_PACKET_RX_BLOCKS;
+
+    struct tpacket_req3 ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.tp_block_size = rxBlockSize;
+    ring.tp_block_nr = rxBlocks;
+    ring.tp_frame_size = TPACKET_ALIGNMENT << 7;
+    ring.tp_frame_nr = rxBlockSize / ring.tp_frame_size * rxBlocks;
+    ring.tp_retire_blk_tov = HANS_PACKET_RX_TIMEOUT;
+    if (setsockopt(rxFd, SOL_PACKET, PACKET_RX_RING, &ring, sizeof(ring)) == -1)
+        throw Exception("packet receive ring", true);
+
+    void *memory = mmap(NULL, (size_t)rxBlockSize * rxBlocks, PROT_READ | PROT_WRITE, MAP_SHARED, rxFd, 0);
+    if (memory == MAP_FAILED)
+        throw Exception("mapping packet receive ring", true);
+    rxRing = (char *)memory;
+    rxBlock = 0;
+    rxRemaining = -1;
+    rxNext = NULL;
+    rxTaken = 0;
+
+    struct sockaddr_ll address;
+    memset(&address, 0, sizeof(address));
+    address.sll_family = AF_PACKET;
+    address.sll_protocol = htons(ETH_P_IP);
+    address.sll_ifindex = ifIndex;
+    if (bind(rxFd, (struct sockaddr *)&address, sizeof(address)) == -1)
+        throw Exception("binding packet socket", true);
+}
+
+/* Bound without a protocol, the transmit socket receives nothing. */
+void PacketRing::setupTx(int maxDatagram)
+{
+    txFd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (txFd == -1)
+        throw Exception("creating packet socket", true);
+
+    int version = TPACKET_V3;
+    if (setsockopt(txFd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1)
+        throw Exception("TPACKET_V3", true);
+
+    txFrameSize = TPACKET_ALIGNMENT;
+    while (txFrameSize < TX_DATA_OFFSET + ETHERNET_HEADER + maxDatagram)
+        txFrameSize <<= 1;
+    txFrames = HANS_PACKET_TX_FRAMES;
+    int pageSize = getpagesize();
+    int blockSize = txFrameSize > pageSize ? txFrameSize : pageSize;
+
+    struct tpacket_req3 ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.tp_block_size = blockSize;
+    ring.tp_frame_size = txFrameSize;
+    ring.tp_block_nr = txFrames / (blockSize / txFrameSize);
+    ring.tp_frame_nr = ring.tp_block_nr * (blockSize / txFrameSize);
+    txFrames = ring.tp_frame_nr;
+    if (setsockopt(txFd, SOL_PACKET, PACKET_TX_RING, &ring, sizeof(ring)) == -1)
+        throw Exception("packet transmit ring", true);
+
+    void *memory = mmap(NULL, (size_t)txFrameSize * txFrames, PROT_READ | PROT_WRITE, MAP_SHARED, txFd, 0);
+    if (memory == MAP_FAILED)
+        throw Exception("mapping packet transmit ring", true);
+    txRing = (char *)memory;
+    txNext = 0;
+    txPending = 0;
+    txPendingBytes = 0;
+
+    struct sockaddr_ll address;
+    memset(&address, 0, sizeof(address));
+    address.sll_family = AF_PACKET;
+    address.sll_ifindex = ifIndex;
+    if (bind(txFd, (struct sockaddr *)&address, sizeof(address)) == -1)
+        throw Exception("binding packet socket", true);
+}
+
+int PacketRing::receive(int maxPackets)
+{
+    if ((int)received.size() < maxPackets)
+        received.resize(maxPackets);
+
+    int count = 0;
+    while (count < maxPackets)
+    {
+        struct tpacket_block_desc *block = (struct tpacket_block_desc *)(rxRing + rxBlock * rxBlockSize);
+        if (rxRemaining == -1)
+        {
+            if (!(block->hdr.bh1.block_status & TP_STATUS_USER))
+                break;
+            __sync_synchronize(); // read the packets only after the status
+            rxRemaining = block->hdr.bh1.num_pkts;
+            rxNext = (char *)block + block->hdr.bh1.offset_to_first_pkt;
+        }
+
+        while (rxRemaining > 0 && count < maxPackets)
+        {
+            struct tpacket3_hdr *header = (struct tpacket3_hdr *)rxNext;
+            rxNext += header->tp_next_offset;
+            rxRemaining--;
+
+            /* Ethernet pads short frames; the IP header has the true length */
+            unsigned char *frame = (unsigned char *)header + header->tp_mac;
+            char *ip = (char *)header + header->tp_net;
+            int captured = header->tp_snaplen - (header->tp_net - header->tp_mac);
+            int length = captured >= IP_HEADER ? ntohs(*(uint16_t *)(ip + 2)) : 0;
+            if (length < IP_HEADER || length > captured)
+                continue;
+
+            if (header->tp_net - header->tp_mac == ETHERNET_HEADER)
+                learn(frame, ip);
+            received[count].data = ip;
+            received[count].length = length;
+            count++;
+        }
+
+        if (rxRemaining == 0)
+        {
+            rxBlock = (rxBlock + 1) % rxBlocks;
+            rxRemaining = -1;
+            rxTaken++;
+        }
+    }
+    return count;
+}
+
+void PacketRing::release()
+{
+    int block = (rxBlock - rxTaken + rxBlocks) % rxBlocks;
+    if (rxTaken)
+        __sync_synchronize(); // done with the packets before the kernel may overwrite them
+    for (; rxTaken > 0; rxTaken--)
+    {
+        struct tpacket_block_desc *desc = (struct tpacket_block_desc *)(rxRing + block * rxBlockSize);
+        desc->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        block = (block + 1) % rxBlocks;
+    }
+}
+
+/* Members are numbered in the order they join; a CBPF program picks one per
+ * datagram, so every peer stays with the same ring. */
+bool PacketRing::joinFanout(int group, int index, int members)
+{
+    int fanout = (group & 0xffff) | PACKET_FANOUT_CBPF << 16;
+    if (setsockopt(rxFd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) == -1)
+    {
+        syslog(LOG_WARNING, "could not join packet fanout group as member %d: %s", index, strerror(errno));
+        return false;
+    }
+
+    BpfProgram program;
+    program.load(BPF_W, SKF_NET_OFF + 12); // ip_src
+    program.statement(BPF_ALU | BPF_MOD | BPF_K, members);
+    program.statement(BPF_RET | BPF_A, 0);
+    if (!program.attach(rxFd, SOL_PACKET, PACKET_FANOUT_DATA))
+    {
+        syslog(LOG_WARNING, "could not program packet fanout group: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* Replies go back the way the peer's datagrams came: to the sender of its
+ * last frame, from the address it was sent to. */
+void PacketRing::learn(const unsigned char *frame, const char *ip)
+{
+    uint32_t peer, local;
+    memcpy(&peer, ip + 12, 4);
+    memcpy(&local, ip + 16, 4);
+
+    Neighbor &entry = neighbor(ntohl(peer));
+    entry.ip = ntohl(peer);
+    memcpy(entry.mac, frame + 6, 6);
+    entry.localIp = local;
+}
+
+bool PacketRing::send(uint32_t ip, int protocol, const char *head, int headLength,
+                      const char *tail, int tailLength)
+{
+    int length = IP_HEADER + headLength + tailLength;
+    if (length > mtu || TX_DATA_OFFSET + ETHERNET_HEADER + length > txFrameSize)
+        return false;
+
+    const Neighbor &entry = neighbor(ip);
+    if (entry.ip != ip)
+        return false;
+
+    struct tpacket3_hdr *header = (struct tpacket3_hdr *)(txRing + txNext * txFrameSize);
+    if (header->tp_status == TP_STATUS_WRONG_FORMAT)
+    {
+        syslog(LOG_ERR, "packet transmit ring rejected a frame on %s", device.c_str());
+        header->tp_status = TP_STATUS_AVAILABLE;
+    }
+    if (header->tp_status != TP_STATUS_AVAILABLE)
+        return false; // the kernel is still sending from here
+    __sync_synchronize(); // write the frame only after the status
+
+    unsigned char *frame = (unsigned char *)header + TX_DATA_OFFSET;
+    memcpy(frame, entry.mac, 6);
+    memcpy(frame + 6, mac, 6);
+    frame[12] = ETH_P_IP >> 8;
+    frame[13] = ETH_P_IP & 0xff;
+
+    unsigned char *packet = frame + ETHERNET_HEADER;
+    uint16_t totalLength = htons(length);
+    uint16_t id = htons(ipId++);
+    uint32_t destination = htonl(ip);
+    packet[0] = 0x45;
+    packet[1] = 0;
+    memcpy(packet + 2, &totalLength, 2);
+    memcpy(packet + 4, &id, 2);
+    packet[6] = packet[7] = 0; // may be fragmented on the way, as from the raw socket
+    packet[8] = 64;
+    packet[9] = protocol;
+    packet[10] = packet[11] = 0;
+    memcpy(packet + 12, &entry.localIp, 4);
+    memcpy(packet + 16, &destination, 4);
+    uint16_t sum = htons(Checksum::fold(Checksum::add(0, (const char *)packet, IP_HEADER)));
+    memcpy(packet + 10, &sum, 2);
+
+    memcpy(packet + IP_HEADER, head, headLength);
+    if (tailLength)
+        memcpy(packet + IP_HEADER + headLength, tail, tailLength);
+
+    header->tp_len = ETHERNET_HEADER + length;
+    header->tp_snaplen = header->tp_len;
+    header->tp_next_offset = 0;
+    __sync_synchronize(); // the frame is complete before the kernel may take it
+    header->tp_status = TP_STATUS_SEND_REQUEST;
+
+    txNext = (txNext + 1) % txFrames;
+    txPending++;
+    txPendingBytes += headLength + tailLength;
+    return true;
+}
+
+bool PacketRing::transmit()
+{
+    if (txPending == 0)
+        return true;
+
+    struct sockaddr_ll address;
+    memset(&address, 0, sizeof(address));
+    address.sll_family = AF_PACKET;
+    address.sll_protocol = htons(ETH_P_IP);
+    address.sll_ifindex = ifIndex;
+
+    while (sendto(txFd, NULL, 0, MSG_DONTWAIT, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        if (errno == EINTR)
+            continue;
+        /* the kernel leaves the frames it could not send yet marked for sending */
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+            return true;
+        syslog(LOG_ERR, "error sending from packet ring: %s", strerror(errno));
+        txPending = 0;
+        txPendingBytes = 0;
+        return false;
+    }
+    txPending = 0;
+    txPendingBytes = 0;
+    return true;
+}
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PACKETRING_H
+#define PACKETRING_H
+
+#ifdef LINUX
+
+#include "addresstable.h"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/* IPv4 datagrams over AF_PACKET sockets on one Ethernet device. Received
+ * frames are read in place from a TPACKET_V3 ring of blocks, each handed
+ * back to the kernel as a whole once its packets have been dealt with;
+ * outgoing datagrams are framed straight into a PACKET_TX_RING and sent with
+ * one call per batch. The link-layer and local addresses used to reach a peer
+ * are learned from the frames it sends, for a fixed number of peers. */
+class PacketRing
+{
+public:
+    /* Datagrams of up to `maxDatagram` bytes get transmit frames. Every frame
+     * is rejected until a filter is attached to getFd(). */
+    PacketRing(const std::string &device, int maxDatagram);
+    ~PacketRing();
+
+    int getFd() { return rxFd; }
+
+    /* Take up to maxPackets received datagrams. They stay in place at
+     * packet(0..n-1) until release(). */
+    int receive(int maxPackets);
+    char *packet(int index) { return received[index].data; }
+    int length(int index) const { return received[index].length; }
+    /* Hand the blocks whose packets have all been taken back to the kernel. */
+    void release();
+
+    /* Join fanout group `group` of the rings on the device as member `index`
+     * of `members`, which have to join in order: each datagram goes to the
+     * member its source address, taken modulo `members`, names. */
+    bool joinFanout(int group, int index, int members);
+
+    /* Frame the datagram `head` + `tail` to `ip` with `protocol` for the next
+     * transmit(). False if the peer has not been heard from lately, the
+     * datagram exceeds the device MTU or no frame is free; it has to go
+     * another way. */
+    bool send(uint32_t ip, int protocol, const char *head, int headLength,
+              const char *tail, int tailLength);
+    /* Have the kernel send the framed datagrams. Returns false on error. If
+     * the device is busy they stay framed, still pending(), for the next
+     * transmit(). */
+    bool transmit();
+    int pending() const { return txPending; }
+    int pendingBytes() const { return txPendingBytes; } // without IP headers
+
+protected:
+    struct Received
+    {
+        char *data; // IP header
+        int length;
+    };
+
+    /* Peers share the entry their address hashes to: one that lost it to
+     * another goes the other way until it is heard from again. */
+    struct Neighbor
+    {
+        uint32_t ip;      // host order, 0 if unused
+        unsigned char mac[6];
+        uint32_t localIp; // network order
+    };
+
+    Neighbor &neighbor(uint32_t ip) { return neighbors[addressHash(ip) & (neighbors.size() - 1)]; }
+
+    void setupRx();
+    void setupTx(int maxDatagram);
+    void learn(const unsigned char *frame, const char *ip);
+    void closeRings();
+
+    std::string device;
+    int ifIndex;
+    int mtu;
+    unsigned char mac[6];
+
+    int rxFd;
+    char *rxRing;
+    int rxBlockSize;
+    int rxBlocks;
+    int rxBlock;      // block being read
+    int rxRemaining;  // packets of it not taken yet, -1 if not started
+    char *rxNext;     // next packet of it
+    int rxTaken;      // blocks read to the end since the last release()
+    std::vector<Received> received;
+
+    int txFd;
+    char *txRing;
+    int txFrameSize;
+    int txFrames;
+    int txNext;
+    int txPending;
+    int txPendingBytes;
+    uint16_t ipId;
+
+    std::vector<Neighbor> neighbors; // HANS_PACKET_NEIGHBORS
+};
+
+#endif
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "sequence.h"
+#include "config.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+SendWindow::SendWindow(int packets, int inFlight, int mtu)
+    : slots(packets + inFlight)
+    , lengths(packets + inFlight, 0)
+    , kept(packets)
+    , stride(mtu + HEADER_SIZE)
+    , next(0)
+{
+}
+
+const char *SendWindow::add(const char *packet, int &length)
+{
+    int slot = next % lengths.size();
+    if (slots[slot].empty())
+        slots[slot].resize(stride);
+    char *data = &slots[slot][0];
+    uint32_t seq = htonl(next++);
+    memcpy(data, &seq, HEADER_SIZE);
+    memcpy(data + HEADER_SIZE, packet, length);
+    length += HEADER_SIZE;
+    lengths[slot] = length;
+    return data;
+}
+
+const char *SendWindow::find(uint32_t seq, int &length)
+{
+    if (next - seq - 1 >= kept)
+        return NULL;
+
+    int slot = seq % lengths.size();
+    if (lengths[slot] == 0)
+        return NULL;
+    const char *data = &slots[slot][0];
+    uint32_t kept;
+    memcpy(&kept, data, HEADER_SIZE);
+    if (ntohl(kept) != seq) // overwritten across the wrap
+        return NULL;
+
+    length = lengths[slot];
+    return data;
+}
+
+void SendWindow::nackRange(const char *nack, int index, uint32_t &first, int &count)
+{
+    const char *range = nack + index * ReceiveWindow::NACK_RANGE_SIZE;
+    uint16_t rangeCount;
+    memcpy(&first, range, sizeof(first));
+    memcpy(&rangeCount, range + sizeof(first), sizeof(rangeCount));
+    first = ntohl(first);
+    count = ntohs(rangeCount);
+}
+
+ReceiveWindow::ReceiveWindow()
+    : started(false)
+    , next(0)
+{
+    memset(bits, 0, sizeof(bits));
+}
+
+void ReceiveWindow::mark(uint32_t seq, bool on)
+{
+    if (on)
+        bits[seq % WINDOW / 32] |= 1u << seq % 32;
+    else
+        bits[seq % WINDOW / 32] &= ~(1u << seq % 32);
+}
+
+bool ReceiveWindow::receive(uint32_t seq, Stats &stats)
+{
+    if (!started)
+    {
+        started = true;
+        next = seq + 1;
+        mark(seq, true);
+        return true;
+    }
+
+    int32_t ahead = (int32_t)(seq - next);
+    if (ahead >= WINDOW)
+    {
+        /* too far ahead to keep track of what is missing */
+        for (size_t i = 0; i < gaps.size(); i++)
+            stats.addUnrecovered(gaps[i].count);
+        stats.addUnrecovered(ahead);
+        gaps.clear();
+        memset(bits, 0, sizeof(bits));
+    }
+    else if (ahead > 0)
+    {
+        for (uint32_t missing = next; missing != seq; missing++)
+            mark(missing, false);
+
+        while (gaps.size() >= MAX_GAPS)
+        {
+            stats.addUnrecovered(gaps.front().count);
+            gaps.erase(gaps.begin());
+        }
+        Gap gap;
+        gap.first = next;
+        gap.count = ahead;
+        gap.nacks = 0;
+        gaps.push_back(gap);
+    }
+
+    if (ahead >= 0)
+    {
+        mark(seq, true);
+        next = seq + 1;
+        forget(next - WINDOW, stats);
+        return true;
+    }
+
+    if (next - seq > WINDOW || received(seq))
+    {
+        stats.incSequenceDuplicate();
+        return false;
+    }
+
+    mark(seq, true);
+    if (fill(seq))
+        stats.incRecovered();
+    return true;
+}
+
+/* Take a resent packet out of its gap; false if it was in none. */
+bool ReceiveWindow::fill(uint32_t seq)
+{
+    for (size_t i = 0; i < gaps.size(); i++)
+    {
+        Gap &gap = gaps[i];
+        uint32_t offset = seq - gap.first;
+        if (offset >= gap.count)
+            continue;
+
+        if (gap.count == 1)
+            gaps.erase(gaps.begin() + i);
+        else if (offset == 0)
+        {
+            gap.first++;
+            gap.count--;
+        }
+        else if (offset == gap.count - 1)
+            gap.count--;
+        else
+        {
+            Gap after = gap;
+            after.first = seq + 1;
+            after.count = gap.count - offset - 1;
+            gap.count = offset;
+            gaps.insert(gaps.begin() + i + 1, after);
+        }
+        return true;
+    }
+    return false;
+}
+
+/* Packets before `oldest` are out of the window and no longer awaited. */
+void ReceiveWindow::forget(uint32_t oldest, Stats &stats)
+{
+    while (!gaps.empty() && (int32_t)(gaps.front().first - oldest) < 0)
+    {
+        Gap &gap = gaps.front();
+        uint32_t over = oldest - gap.first;
+        if (over < gap.count)
+        {
+            stats.addUnrecovered(over);
+            gap.first += over;
+            gap.count -= over;
+            break;
+        }
+        stats.addUnrecovered(gap.count);
+        gaps.erase(gaps.begin());
+    }
+}
+
+/* Ranges are NACKed again every HANS_NACK_INTERVAL ms, in case the NACK or the
+ * packets resent were lost too, and given up after HANS_NACK_TRIES times. */
+int ReceiveWindow::nack(char *buffer, int maxLength, Time now, Stats &stats)
+{
+    int length = 0;
+    for (size_t i = 0; i < gaps.size(); )
+    {
+        Gap &gap = gaps[i];
+        if (gap.nacks > 0 && now - gap.nackedAt < Time(HANS_NACK_INTERVAL))
+        {
+            i++;
+            continue;
+        }
+        if (gap.nacks == HANS_NACK_TRIES)
+        {
+            stats.addUnrecovered(gap.count);
+            gaps.erase(gaps.begin() + i);
+            continue;
+        }
+        if (length + NACK_RANGE_SIZE > maxLength)
+            break;
+
+        uint32_t first = htonl(gap.first);
+        uint16_t count = htons(gap.count);
+        memcpy(buffer + length, &first, sizeof(first));
+        memcpy(buffer + length + sizeof(first), &count, sizeof(count));
+        length += NACK_RANGE_SIZE;
+        gap.nacks++;
+        gap.nackedAt = now;
+        i++;
+    }
+    return length;
+}
@@ -0,0 +1,111 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include "time.h"
+#include "stats.h"
+
+#include <vector>
+#include <stdint.h>
+
+/*
+ * Sequenced data (TYPE_DATA_SEQ) is the packet behind its sequence number, in
+ * network byte order, counted per direction from the connection on. The
+ * receiver answers gaps with a TYPE_NACK of ranges: a uint32_t first sequence
+ * number and a uint16_t count each, in network byte order.
+ */
+
+/* The sending side: numbers packets and keeps the last ones for resending. */
+class SendWindow
+{
+public:
+    enum { HEADER_SIZE = 4 };
+
+    /* Resends the last `packets` packets of up to `mtu` bytes. Payloads, also
+     * those found to resend, stay valid for `inFlight` more packets. Slots are
+     * allocated as they are first used. */
+    SendWindow(int packets, int inFlight, int mtu);
+
+    /* Number a packet and keep it; returns the payload to send and adds
+     * HEADER_SIZE to `length`. */
+    const char *add(const char *packet, int &length);
+    /* The payload numbered `seq`, NULL if it is no longer kept. */
+    const char *find(uint32_t seq, int &length);
+    /* Range `index` of a NACK payload. */
+    static void nackRange(const char *nack, int index, uint32_t &first, int &count);
+
+private:
+    std::vector<std::vector<char> > slots; // never resized, so payloads stay put
+    std::vector<int> lengths; // 0 if the slot is unused
+    uint32_t kept;
+    int stride;
+    uint32_t next;
+};
+
+/* The receiving side: tells duplicates from new packets and which are missing. */
+class ReceiveWindow
+{
+public:
+    enum { NACK_RANGE_SIZE = 6 };
+
+    ReceiveWindow();
+
+    /* Whether to deliver the packet numbered `seq`: false for one delivered
+     * before, or too old to tell. Packets skipped are due for a NACK. */
+    bool receive(uint32_t seq, Stats &stats);
+    /* Write the ranges due for a NACK, first or again, to `buffer`, `maxLength`
+     * bytes at most. Returns the length, 0 if none is due. */
+    int nack(char *buffer, int maxLength, Time now, Stats &stats);
+    /* Whether packets are missing, to be NACKed now or again later. */
+    bool waiting() const { return !gaps.empty(); }
+
+private:
+    enum { WINDOW = 1024, MAX_GAPS = 32 };
+
+    struct Gap
+    {
+        uint32_t first;
+        uint32_t count;
+        int nacks;
+        Time nackedAt;
+    };
+
+    bool received(uint32_t seq) const { return bits[seq % WINDOW / 32] & (1u << seq % 32); }
+    void mark(uint32_t seq, bool on);
+    bool fill(uint32_t seq);
+    void forget(uint32_t oldest, Stats &stats);
+
+    bool started;
+    uint32_t next;          // after the highest received
+    uint32_t bits[WINDOW / 32]; // received, of next - WINDOW up to next
+    std::vector<Gap> gaps;  // oldest first
+};
+
+/* Both directions of a connection using sequenced data. */
+struct Sequencing
+{
+    Sequencing(int packets, int inFlight, int mtu) : send(packets, inFlight, mtu) { }
+
+    SendWindow send;
+    ReceiveWindow receive;
+};
+
+#endif
@@ -22,12 +22,14 @@
 #include "config.h"
 #include "utility.h"
 #include "hmac.h"
+#include "exception.h"
 
 #ifndef NUM_CHANNELS
 #define NUM_CHANNELS 1
 #endif
 
 #include <string.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <syslog.h>
 #include <iostream>
@@ -37,6 +39,7 @@ using std::cout;
 using std::endl;
 
 #define FIRST_ASSIGNED_IP_OFFSET 100
+#define SERVER_IP_OFFSET 1
 
 const Worker::TunnelHeader::Magic Server::magic("hans");
 
@@ -57,147 +60,265 @@ static int getFlowIdFromPayload(const char *data, int dataLength)
     return (int)(hash % (unsigned int)HANS_NUM_FLOW_QUEUES);
 }
 
+/* The pacing rate is split evenly between the shards. */
+static int shardRate(int rateKbps, int shardCount)
+{
+    if (rateKbps <= 0 || shardCount <= 1)
+        return rateKbps;
+    return rateKbps / shardCount > 0 ? rateKbps / shardCount : 1;
+}
+
 Server::Server(int tunnelMtu, const string *deviceName, const string &passphrase,
                uint32_t network, bool answerEcho, uid_t uid, gid_t gid, int pollTimeout,
-               int maxBufferedPackets, int recvBufSize, int sndBufSize, int rateKbps)
-    : Worker(tunnelMtu, deviceName, answerEcho, uid, gid, recvBufSize, sndBufSize, rateKbps, true, true), auth(passphrase)
+               int maxBufferedPackets, int recvBufSize, int sndBufSize, int rateKbps,
+               bool useUring, const string *ringDevice, int shardCount, int prefixLength, int busyPollUs)
+    : Worker(tunnelMtu, deviceName, answerEcho, uid, gid, recvBufSize, sndBufSize,
+             shardRate(rateKbps, shardCount), true, true, useUring, ringDevice,
+             shardCount > 1 ? Tun::FIRST_QUEUE : Tun::SINGLE_QUEUE),
+      auth(passphrase), shardIndex(0), handoff(NULL)
 {
-    this->network = network & 0xffffff00;
+    this->prefixLength = prefixLength;
+    this->network = network & Utility::netmask(prefixLength);
     this->pollTimeout = pollTimeout;
     this->maxBufferedPackets = maxBufferedPackets > 0 ? maxBufferedPackets : 20;
-    this->latestAssignedIpOffset = FIRST_ASSIGNED_IP_OFFSET - 1;
+    setupAddresses(0, 1);
+    reservePoolSlots(HANS_PACKET_POOL);
+
+    tun.setIp(this->network + SERVER_IP_OFFSET, this->network + SERVER_IP_OFFSET + 1, prefixLength);
+
+    shards.push_back(this);
+    if (shardCount > 1)
+    {
+        try
+        {
+            for (int i = 1; i < shardCount; i++)
+                shards.push_back(new Server(this, i, tunnelMtu, passphrase, answerEcho, uid, gid,
+                                            recvBufSize, sndBufSize, shardRate(rateKbps, shardCount),
+                                            useUring, ringDevice));
+
+            for (int i = 0; i < shardCount; i++)
+            {
+                Server *shard = shards[i];
+                shard->shards = shards;
+                shard->setupAddresses(i, shardCount);
+                shard->handoff = new ShardQueue(HANS_SHARD_QUEUE, tunnelMtu);
+                if (shard->echo)
+                    shard->echo->setShard(i, shardCount);
+                if (shard->echo6)
+                    shard->echo6->setShard(i, shardCount);
+            }
+        }
+        catch (...)
+        {
+            for (size_t i = 1; i < shards.size(); i++)
+                delete shards[i];
+            delete handoff;
+            throw;
+        }
+
+        syslog(LOG_INFO, "serving clients with %d shards", shardCount);
+    }
+
+    /* the kernel drops all ICMP but the clients' requests, and pings to answer */
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        if (shards[i]->echo)
+            shards[i]->echo->acceptOnly(false, Client::magic.data, answerEcho);
+        if (shards[i]->echo6)
+            shards[i]->echo6->acceptOnly(false, Client::magic.data, answerEcho);
+    }
 
-    tun.setIp(this->network + 1, this->network + 2);
+    /* the busy polling socket options need CAP_NET_ADMIN */
+    setBusyPoll(busyPollUs);
 
     dropPrivileges();
 }
 
+/* Opens one more queue of the primary's tunnel device. */
+Server::Server(Server *primary, int shardIndex, int tunnelMtu, const string &passphrase,
+               bool answerEcho, uid_t uid, gid_t gid, int recvBufSize, int sndBufSize,
+               int rateKbps, bool useUring, const string *ringDevice)
+    : Worker(tunnelMtu, &primary->tun.getDevice(), answerEcho, uid, gid, recvBufSize, sndBufSize,
+             rateKbps, true, true, useUring, ringDevice, Tun::ATTACH_QUEUE),
+      auth(passphrase), shardIndex(shardIndex), handoff(NULL)
+{
+    this->prefixLength = primary->prefixLength;
+    this->network = primary->network;
+    this->pollTimeout = primary->pollTimeout;
+    this->maxBufferedPackets = primary->maxBufferedPackets;
+    reservePoolSlots(HANS_PACKET_POOL);
+}
+
 Server::~Server()
 {
+    for (uint32_t i = 0; i < clients.end(); i++)
+        if (clients.used(i))
+        {
+            dropPending(&clients[i]);
+            endPeer(clients[i]);
+        }
 
+    if (shardIndex == 0)
+    {
+        for (size_t i = 1; i < shards.size(); i++)
+            delete shards[i];
+    }
+    delete handoff;
 }
 
-void Server::handleUnknownClient(const TunnelHeader &header, int dataLength, uint32_t realIp, uint16_t echoId, uint16_t echoSeq)
+int Server::writeConnectionRequest(char *data, uint8_t maxPolls, uint32_t desiredIp, uint8_t features)
 {
-    ClientData client;
-    client.realIp = realIp;
-    memset(&client.realIp6, 0, sizeof(client.realIp6));
-    client.isV6 = false;
-    client.useHmac = false;
-    client.maxPolls = 1;
+    ClientConnectData *connectData = (ClientConnectData *)data;
+    connectData->version = 2;
+    connectData->maxPolls = maxPolls;
+    connectData->features = features;
+    connectData->featuresCheck = ~features;
+    connectData->desiredIp = htonl(desiredIp);
+    return sizeof(ClientConnectData);
+}
 
-    pollReceived(&client, echoId, echoSeq);
+bool Server::parseConnectionRequest(const char *data, int length, ConnectionRequest &request)
+{
+    if (length != sizeof(ClientConnectDataLegacy) && length != sizeof(ClientConnectData))
+        return false;
 
-    if (header.type != TunnelHeader::TYPE_CONNECTION_REQUEST ||
-        (dataLength != sizeof(ClientConnectDataLegacy) && dataLength != sizeof(ClientConnectData)))
+    /* both layouts have the same size: version 2 is told apart from the
+       padding of older clients by the check byte of its features */
+    const ClientConnectData *connectData = (const ClientConnectData *)data;
+    if (connectData->version == 2 && connectData->featuresCheck == (uint8_t)~connectData->features)
     {
-        syslog(LOG_DEBUG, "invalid request (type %d) from %s", header.type,
-               Utility::formatIp(realIp).c_str());
-        sendReset(&client);
-        return;
+        request.maxPolls = connectData->maxPolls;
+        request.desiredIp = ntohl(connectData->desiredIp);
+        request.features = connectData->features;
+    }
+    else
+    {
+        const ClientConnectDataLegacy *legacy = (const ClientConnectDataLegacy *)data;
+        request.maxPolls = legacy->maxPolls;
+        request.desiredIp = ntohl(legacy->desiredIp);
+        request.features = 0;
     }
+    return true;
+}
+
+int Server::challengeSize(uint8_t features)
+{
+    return features & FEATURE_HMAC ? HMAC_CHALLENGE_SIZE : CHALLENGE_SIZE;
+}
+
+/*
+ * Take the connection request a new client sent with its first poll: size the
+ * client's poll ring for the polls it will keep outstanding, save the poll and
+ * reserve a tunnel address, which stays 0 if none is free. Returns false if the
+ * packet is no valid connection request.
+ */
+bool Server::readConnectionRequest(ClientData *client, const TunnelHeader &header, int dataLength,
+                                   uint16_t echoId, uint16_t echoSeq)
+{
+    ConnectionRequest request;
+    bool valid = header.type == TunnelHeader::TYPE_CONNECTION_REQUEST &&
+        parseConnectionRequest(echoReceivePayloadBuffer(), dataLength, request);
 
     uint32_t desiredIp = 0;
-    if (dataLength == sizeof(ClientConnectDataLegacy))
+    client->maxPolls = 1;
+    client->useHmac = false;
+    client->features = 0;
+    if (valid)
     {
-        ClientConnectDataLegacy *connectData = (ClientConnectDataLegacy *)echoReceivePayloadBuffer();
-        client.maxPolls = connectData->maxPolls;
-        desiredIp = ntohl(connectData->desiredIp);
-        client.useHmac = false;
+        client->maxPolls = request.maxPolls;
+        desiredIp = request.desiredIp;
+        client->useHmac = (request.features & FEATURE_HMAC) != 0;
+        client->features = request.features & (FEATURE_SEQUENCE | FEATURE_FEC);
     }
-    else
+
+    client->polls.resize((client->maxPolls != 0 ? client->maxPolls : 1) * NUM_CHANNELS);
+    pollReceived(client, echoId, echoSeq);
+
+    client->state = ClientData::STATE_NEW;
+    client->tunnelIp = valid ? reserveTunnelIp(desiredIp) : 0;
+    return valid;
+}
+
+void Server::handleUnknownClient(const TunnelHeader &header, int dataLength, uint32_t realIp, uint16_t echoId, uint16_t echoSeq)
+{
+    uint32_t index = clients.insert();
+    ClientData *client = &clients[index];
+    client->realIp = realIp;
+    memset(&client->realIp6, 0, sizeof(client->realIp6));
+    client->timerData = index;
+    client->isV6 = false;
+
+    if (!readConnectionRequest(client, header, dataLength, echoId, echoSeq))
     {
-        ClientConnectData *connectData = (ClientConnectData *)echoReceivePayloadBuffer();
-        client.maxPolls = connectData->maxPolls;
-        desiredIp = ntohl(connectData->desiredIp);
-        client.useHmac = (connectData->version >= 2);
+        syslog(LOG_DEBUG, "invalid request (type %d) from %s", header.type,
+               Utility::formatIp(realIp).c_str());
+        sendReset(client);
+        dropPending(client);
+        clients.erase(index);
+        return;
     }
-    client.state = ClientData::STATE_NEW;
-    client.tunnelIp = reserveTunnelIp(desiredIp);
 
     syslog(LOG_DEBUG, "new client %s with tunnel address %s\n",
-           Utility::formatIp(client.realIp).data(),
-           Utility::formatIp(client.tunnelIp).data());
+           Utility::formatIp(client->realIp).data(),
+           Utility::formatIp(client->tunnelIp).data());
 
-    if (client.tunnelIp != 0)
+    if (client->tunnelIp != 0)
     {
-        client.challenge = auth.generateChallenge(CHALLENGE_SIZE);
-        sendChallenge(&client);
+        client->challenge = auth.generateChallenge(challengeSize(client->useHmac ? FEATURE_HMAC : 0));
+        sendChallenge(client);
 
-        // add client to list
-        clientList.push_front(client);
-        clientList.front().pendingByFlow.resize(HANS_NUM_FLOW_QUEUES);
-        clientList.front().lastSentFlow = 0;
-        clientList.front().pollIdsByChannel.resize(NUM_CHANNELS > 0 ? NUM_CHANNELS : 1);
-        clientList.front().nextChannelToSend = 0;
-        clientRealIpMap[realIp] = clientList.begin();
-        clientTunnelIpMap[client.tunnelIp] = clientList.begin();
+        clientsByRealIp.insert(realIp, index);
+        clientsByTunnelIp[addresses.index(client->tunnelIp - network)] = index;
+        client->lastActivity = now;
+        client->expiryTimer = addTimer(KEEP_ALIVE_INTERVAL, index);
     }
     else
     {
         syslog(LOG_WARNING, "server full");
-        sendEchoToClient(&client, TunnelHeader::TYPE_SERVER_FULL, 0);
+        sendEchoToClient(client, TunnelHeader::TYPE_SERVER_FULL, 0);
+        dropPending(client);
+        clients.erase(index);
     }
 }
 
 void Server::handleUnknownClient6(const TunnelHeader &header, int dataLength, const struct in6_addr &realIp, uint16_t echoId, uint16_t echoSeq)
 {
-    ClientData client;
-    client.realIp = 0;
-    client.realIp6 = realIp;
-    client.isV6 = true;
-    client.useHmac = false;
-    client.maxPolls = 1;
-
-    pollReceived(&client, echoId, echoSeq);
-
-    if (header.type != TunnelHeader::TYPE_CONNECTION_REQUEST ||
-        (dataLength != sizeof(ClientConnectDataLegacy) && dataLength != sizeof(ClientConnectData)))
+    uint32_t index = clients.insert();
+    ClientData *client = &clients[index];
+    client->realIp = 0;
+    client->realIp6 = realIp;
+    client->timerData = index;
+    client->isV6 = true;
+
+    if (!readConnectionRequest(client, header, dataLength, echoId, echoSeq))
     {
         syslog(LOG_DEBUG, "invalid request (type %d) from %s", header.type, Utility::formatIp6(realIp).c_str());
-        sendReset(&client);
+        sendReset(client);
+        dropPending(client);
+        clients.erase(index);
         return;
     }
 
-    uint32_t desiredIp6 = 0;
-    if (dataLength == sizeof(ClientConnectDataLegacy))
-    {
-        ClientConnectDataLegacy *connectData = (ClientConnectDataLegacy *)echoReceivePayloadBuffer();
-        client.maxPolls = connectData->maxPolls;
-        desiredIp6 = ntohl(connectData->desiredIp);
-        client.useHmac = false;
-    }
-    else
-    {
-        ClientConnectData *connectData = (ClientConnectData *)echoReceivePayloadBuffer();
-        client.maxPolls = connectData->maxPolls;
-        desiredIp6 = ntohl(connectData->desiredIp);
-        client.useHmac = (connectData->version >= 2);
-    }
-    client.state = ClientData::STATE_NEW;
-    client.tunnelIp = reserveTunnelIp(desiredIp6);
-
     syslog(LOG_DEBUG, "new IPv6 client %s with tunnel address %s\n",
-           Utility::formatIp6(client.realIp6).data(),
-           Utility::formatIp(client.tunnelIp).data());
+           Utility::formatIp6(client->realIp6).data(),
+           Utility::formatIp(client->tunnelIp).data());
 
-    if (client.tunnelIp != 0)
+    if (client->tunnelIp != 0)
     {
-        client.challenge = auth.generateChallenge(CHALLENGE_SIZE);
-        sendChallenge(&client);
+        client->challenge = auth.generateChallenge(challengeSize(client->useHmac ? FEATURE_HMAC : 0));
+        sendChallenge(client);
 
-        clientList.push_front(client);
-        clientList.front().pendingByFlow.resize(HANS_NUM_FLOW_QUEUES);
-        clientList.front().lastSentFlow = 0;
-        clientList.front().pollIdsByChannel.resize(NUM_CHANNELS > 0 ? NUM_CHANNELS : 1);
-        clientList.front().nextChannelToSend = 0;
-        clientRealIp6Map[realIp] = clientList.begin();
-        clientTunnelIpMap[client.tunnelIp] = clientList.begin();
+        clientsByRealIp6.insert(realIp, index);
+        clientsByTunnelIp[addresses.index(client->tunnelIp - network)] = index;
+        client->lastActivity = now;
+        client->expiryTimer = addTimer(KEEP_ALIVE_INTERVAL, index);
     }
     else
     {
         syslog(LOG_WARNING, "server full");
-        sendEchoToClient(&client, TunnelHeader::TYPE_SERVER_FULL, 0);
+        sendEchoToClient(client, TunnelHeader::TYPE_SERVER_FULL, 0);
+        dropPending(client);
+        clients.erase(index);
     }
 }
 
@@ -212,6 +333,11 @@ void Server::sendChallenge(ClientData *client)
     client->state = ClientData::STATE_CHALLENGE_SENT;
 }
 
+uint32_t Server::clientIndex(ClientData *client)
+{
+    return clientsByTunnelIp[addresses.index(client->tunnelIp - network)];
+}
+
 void Server::removeClient(ClientData *client)
 {
     syslog(LOG_DEBUG, "removing client %s with tunnel ip %s\n",
@@ -220,38 +346,62 @@ void Server::removeClient(ClientData *client)
 
     releaseTunnelIp(client->tunnelIp);
 
-    ClientList::iterator it;
+    uint32_t index = clientIndex(client);
+    clientsByTunnelIp[addresses.index(client->tunnelIp - network)] = NO_CLIENT;
     if (client->isV6)
-    {
-        it = clientRealIp6Map[client->realIp6];
-        clientRealIp6Map.erase(client->realIp6);
-    }
+        clientsByRealIp6.erase(client->realIp6);
     else
-    {
-        it = clientRealIpMap[client->realIp];
-        clientRealIpMap.erase(client->realIp);
-    }
-    clientTunnelIpMap.erase(client->tunnelIp);
-    clientList.erase(it);
+        clientsByRealIp.erase(client->realIp);
+
+    if (client->expiryTimer != NO_TIMER)
+        cancelTimer(client->expiryTimer);
+    dropPending(client);
+    endPeer(*client);
+    clients.erase(index);
 }
 
-void Server::checkChallenge(ClientData *client, int length)
+void Server::dropPending(ClientData *client)
 {
-    bool valid = false;
-    if (client->useHmac)
-    {
-        if (length == (int)Hmac::SHA256_SIZE &&
-            auth.verifyChallengeResponseHMAC(client->challenge, echoReceivePayloadBuffer(), length))
-            valid = true;
-    }
-    else
+    PendingPackets *pending = client->pending;
+    if (!pending)
+        return;
+
+    for (int flow = 0; flow < (int)pending->flows.size(); flow++)
+        for (; pending->flows[flow].count > 0; pending->pop(flow))
+            dropPooled(pending->front(flow).slot);
+    delete pending;
+    client->pending = NULL;
+}
+
+Server::PendingPackets::PendingPackets(int flows, int perFlow)
+    : packets(flows * perFlow), flows(flows), perFlow(perFlow), total(0), lastSentFlow(0)
+{
+    for (int i = 0; i < flows; i++)
     {
-        Auth::Response rightResponse = auth.getResponse(client->challenge);
-        if (length == (int)sizeof(Auth::Response) && memcmp(&rightResponse, echoReceivePayloadBuffer(), length) == 0)
-            valid = true;
+        this->flows[i].head = 0;
+        this->flows[i].count = 0;
     }
+}
+
+void Server::PendingPackets::push(int flow, const Packet &packet)
+{
+    Flow &f = flows[flow];
+    packets[flow * perFlow + (f.head + f.count) % perFlow] = packet;
+    f.count++;
+    total++;
+}
 
-    if (!valid)
+void Server::PendingPackets::pop(int flow)
+{
+    Flow &f = flows[flow];
+    f.head = (f.head + 1) % perFlow;
+    f.count--;
+    total--;
+}
+
+void Server::checkChallenge(ClientData *client, int length)
+{
+    if (!auth.checkResponse(client->challenge, client->useHmac, echoReceivePayloadBuffer(), length))
     {
         syslog(LOG_DEBUG, "wrong challenge response from %s\n",
                client->isV6 ? Utility::formatIp6(client->realIp6).data() : Utility::formatIp(client->realIp).data());
@@ -270,9 +420,30 @@ void Server::checkChallenge(ClientData *client, int length)
         buf[4] = (char)NUM_CHANNELS;
         acceptLen = 5;
     }
+    if (prefixLength != 24 || client->features) // clients not sent a prefix length assume a /24
+    {
+        buf[4] = (char)(NUM_CHANNELS <= 255 ? NUM_CHANNELS : 1);
+        buf[5] = (char)prefixLength;
+        acceptLen = 6;
+    }
+    if (client->features) // only clients that asked for features know the byte
+    {
+        buf[6] = (char)client->features;
+        acceptLen = 7;
+    }
+    /* every packet to the client answers a poll: the window covers twice its
+       poll ring, for a NACK's round trip */
+    if (client->features & FEATURE_SEQUENCE)
+    {
+        int packets = 2 * client->polls.size();
+        client->sequencing = newSequencing(packets < SEND_BUF_SIZE ? packets : SEND_BUF_SIZE);
+    }
+    if (client->features & FEATURE_FEC)
+        client->fec = newFec();
     sendEchoToClient(client, TunnelHeader::TYPE_CONNECTION_ACCEPT, acceptLen);
 
     client->state = ClientData::STATE_ESTABLISHED;
+    Auth::Challenge().swap(client->challenge);
 
     syslog(LOG_INFO, "connection established to %s",
            Utility::formatIp(client->realIp).data());
@@ -300,7 +471,8 @@ bool Server::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
         return true;
     }
 
-    pollReceived(client, id, seq);
+    if (!requestReceived(client, header, dataLength, id, seq))
+        return true;
 
     switch (header.type)
     {
@@ -311,9 +483,7 @@ bool Server::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
                 return true;
             }
 
-            for (size_t c = 0; c < client->pollIdsByChannel.size(); c++)
-                while (client->pollIdsByChannel[c].size() > 0)
-                    client->pollIdsByChannel[c].pop();
+            client->pollCount = 0;
 
             syslog(LOG_DEBUG, "reconnecting %s", Utility::formatIp(realIp).data());
             sendReset(client);
@@ -329,13 +499,29 @@ bool Server::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
         case TunnelHeader::TYPE_DATA:
             if (client->state == ClientData::STATE_ESTABLISHED)
             {
-                if (dataLength == 0)
-                {
-                    syslog(LOG_WARNING, "received empty data packet");
-                    return true;
-                }
-
-                sendToTun(dataLength);
+                receiveFromPeer(*client, TunnelHeader::TYPE_DATA, dataLength);
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_DATA_SEQ:
+            if (client->state == ClientData::STATE_ESTABLISHED && client->sequencing)
+            {
+                receiveFromPeer(*client, TunnelHeader::TYPE_DATA_SEQ, dataLength);
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_DATA_FEC:
+        case TunnelHeader::TYPE_FEC_PARITY:
+            if (client->state == ClientData::STATE_ESTABLISHED && client->fec)
+            {
+                receiveFromPeer(*client, (TunnelHeader::Type)header.type, dataLength);
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_NACK:
+            if (client->state == ClientData::STATE_ESTABLISHED && client->sequencing)
+            {
+                handleNack(*client, dataLength);
                 return true;
             }
             break;
@@ -366,7 +552,8 @@ bool Server::handleEchoData6(const TunnelHeader &header, int dataLength, const s
         return true;
     }
 
-    pollReceived(client, id, seq);
+    if (!requestReceived(client, header, dataLength, id, seq))
+        return true;
 
     switch (header.type)
     {
@@ -376,9 +563,7 @@ bool Server::handleEchoData6(const TunnelHeader &header, int dataLength, const s
                 sendChallenge(client);
                 return true;
             }
-            for (size_t c = 0; c < client->pollIdsByChannel.size(); c++)
-                while (client->pollIdsByChannel[c].size() > 0)
-                    client->pollIdsByChannel[c].pop();
+            client->pollCount = 0;
             syslog(LOG_DEBUG, "reconnecting %s", Utility::formatIp6(realIp).data());
             sendReset(client);
             removeClient(client);
@@ -393,12 +578,29 @@ bool Server::handleEchoData6(const TunnelHeader &header, int dataLength, const s
         case TunnelHeader::TYPE_DATA:
             if (client->state == ClientData::STATE_ESTABLISHED)
             {
-                if (dataLength == 0)
-                {
-                    syslog(LOG_WARNING, "received empty data packet");
-                    return true;
-                }
-                sendToTun(dataLength);
+                receiveFromPeer(*client, TunnelHeader::TYPE_DATA, dataLength);
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_DATA_SEQ:
+            if (client->state == ClientData::STATE_ESTABLISHED && client->sequencing)
+            {
+                receiveFromPeer(*client, TunnelHeader::TYPE_DATA_SEQ, dataLength);
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_DATA_FEC:
+        case TunnelHeader::TYPE_FEC_PARITY:
+            if (client->state == ClientData::STATE_ESTABLISHED && client->fec)
+            {
+                receiveFromPeer(*client, (TunnelHeader::Type)header.type, dataLength);
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_NACK:
+            if (client->state == ClientData::STATE_ESTABLISHED && client->sequencing)
+            {
+                handleNack(*client, dataLength);
                 return true;
             }
             break;
@@ -416,36 +618,40 @@ bool Server::handleEchoData6(const TunnelHeader &header, int dataLength, const s
 
 Server::ClientData *Server::getClientByTunnelIp(uint32_t ip)
 {
-    ClientIpMap::iterator it = clientTunnelIpMap.find(ip);
-    if (it == clientTunnelIpMap.end())
+    uint32_t offset = ip - network;
+    if (!addresses.owns(offset) || clientsByTunnelIp[addresses.index(offset)] == NO_CLIENT)
         return NULL;
 
-    return &*it->second;
+    return &clients[clientsByTunnelIp[addresses.index(offset)]];
 }
 
 Server::ClientData *Server::getClientByRealIp(uint32_t ip)
 {
-    ClientIpMap::iterator it = clientRealIpMap.find(ip);
-    if (it == clientRealIpMap.end())
-        return NULL;
-
-    return &*it->second;
+    uint32_t index = clientsByRealIp.find(ip);
+    return index != NO_CLIENT ? &clients[index] : NULL;
 }
 
 Server::ClientData *Server::getClientByRealIp6(const struct in6_addr &ip6)
 {
-    ClientIp6Map::iterator it = clientRealIp6Map.find(ip6);
-    if (it == clientRealIp6Map.end())
-        return NULL;
-
-    return &*it->second;
+    uint32_t index = clientsByRealIp6.find(ip6);
+    return index != NO_CLIENT ? &clients[index] : NULL;
 }
 
 void Server::handleTunData(int dataLength, uint32_t, uint32_t destIp)
 {
-    if (destIp == network + 255) // ignore broadcasts
+    if (destIp == broadcast()) // ignore broadcasts
         return;
 
+    if (shards.size() > 1)
+    {
+        int shard = shardOf(destIp);
+        if (shard != shardIndex)
+        {
+            handOff(shard, dataLength);
+            return;
+        }
+    }
+
     ClientData *client = getClientByTunnelIp(destIp);
 
     if (client == NULL)
@@ -455,72 +661,87 @@ void Server::handleTunData(int dataLength, uint32_t, uint32_t destIp)
         return;
     }
 
-    sendEchoToClient(client, TunnelHeader::TYPE_DATA, dataLength);
+    sendEchoToClient(client, TunnelHeader::TYPE_DATA, dataLength, tunPayloadBuffer());
 }
 
-bool Server::getNextPollFromChannels(ClientData *client, uint16_t &outId, uint16_t &outSeq)
+bool Server::getNextPoll(ClientData *client, uint16_t &outId, uint16_t &outSeq)
 {
-    const int N = (int)client->pollIdsByChannel.size();
-    if (N <= 0)
+    if (!getNextPollPeek(client, outId, outSeq))
         return false;
-    for (int i = 0; i < N; i++)
-    {
-        int c = (client->nextChannelToSend + i) % N;
-        if (client->pollIdsByChannel[c].size() > 0)
-        {
-            ClientData::EchoId e = client->pollIdsByChannel[c].front();
-            client->pollIdsByChannel[c].pop();
-            client->nextChannelToSend = (c + 1) % N;
-            outId = e.id;
-            outSeq = e.seq;
-            return true;
-        }
-    }
-    return false;
+    client->pollHead = (client->pollHead + 1) % client->polls.size();
+    client->pollCount--;
+    return true;
 }
 
 bool Server::getNextPollPeek(ClientData *client, uint16_t &outId, uint16_t &outSeq)
 {
-    const int N = (int)client->pollIdsByChannel.size();
-    for (int c = 0; c < N; c++)
+    if (client->pollCount == 0)
+        return false;
+    outId = client->polls[client->pollHead].id;
+    outSeq = client->polls[client->pollHead].seq;
+    return true;
+}
+
+/* Count a request for the probe replies and save it as a poll; probes are
+ * answered right away instead. Returns false if it was a probe. */
+bool Server::requestReceived(ClientData *client, const TunnelHeader &header, int dataLength,
+                             uint16_t echoId, uint16_t echoSeq)
+{
+    if (header.type == TunnelHeader::TYPE_PROBE)
     {
-        if (client->pollIdsByChannel[c].size() > 0)
-        {
-            outId = client->pollIdsByChannel[c].front().id;
-            outSeq = client->pollIdsByChannel[c].front().seq;
-            return true;
-        }
+        answerProbe(client, dataLength, echoId, echoSeq);
+        return false;
     }
-    return false;
+
+    client->bytesReceived += dataLength + headerSize();
+    client->packetsReceived++;
+    pollReceived(client, echoId, echoSeq);
+    return true;
 }
 
-void Server::pollReceived(ClientData *client, uint16_t echoId, uint16_t echoSeq)
+void Server::answerProbe(ClientData *client, int dataLength, uint16_t echoId, uint16_t echoSeq)
 {
-    unsigned int maxSavedPolls = client->maxPolls != 0 ? client->maxPolls : 1;
-    const int numCh = (int)client->pollIdsByChannel.size();
-    if (numCh <= 0)
+    if (client->state != ClientData::STATE_ESTABLISHED || dataLength != sizeof(uint32_t))
         return;
-    int channel = (int)((unsigned int)echoId % (unsigned int)numCh);
 
-    client->pollIdsByChannel[channel].push(ClientData::EchoId(echoId, echoSeq));
-    if (client->pollIdsByChannel[channel].size() > maxSavedPolls)
-        client->pollIdsByChannel[channel].pop();
-    DEBUG_ONLY(cout << "poll -> channel " << channel << endl);
+    ProbeReply *reply = (ProbeReply *)echoSendPayloadBuffer();
+    memcpy(&reply->stamp, echoReceivePayloadBuffer(), sizeof(uint32_t));
+    reply->bytesReceived = htonl(client->bytesReceived);
+    reply->packetsReceived = htonl(client->packetsReceived);
+    reply->packetsSent = htonl(client->packetsSent);
+    reply->pending = htonl(client->pending ? client->pending->total : 0);
+    sendReply(client, TunnelHeader::TYPE_PROBE, sizeof(ProbeReply), NULL, echoId, echoSeq);
+
+    client->lastActivity = now;
+}
+
+void Server::pollReceived(ClientData *client, uint16_t echoId, uint16_t echoSeq)
+{
+    int size = client->polls.size();
+    if (client->pollCount == size)
+    {
+        client->pollHead = (client->pollHead + 1) % size;
+        client->pollCount--;
+    }
+    client->polls[(client->pollHead + client->pollCount) % size] = ClientData::EchoId(echoId, echoSeq);
+    client->pollCount++;
+    DEBUG_ONLY(cout << "poll saved, " << client->pollCount << " waiting" << endl);
 
-    const int N = (int)client->pendingByFlow.size();
-    if (N > 0)
+    PendingPackets *pending = client->pending;
+    if (pending && pending->total > 0)
     {
+        const int N = pending->flows.size();
         for (int i = 0; i < N; i++)
         {
-            int q = (client->lastSentFlow + 1 + i) % N;
-            if (client->pendingByFlow[q].size() > 0)
+            int q = (pending->lastSentFlow + 1 + i) % N;
+            if (pending->flows[q].count > 0)
             {
-                Packet &packet = client->pendingByFlow[q].front();
-                memcpy(echoSendPayloadBuffer(), &packet.data[0], packet.data.size());
-                client->pendingByFlow[q].pop();
-                client->lastSentFlow = q;
-                DEBUG_ONLY(cout << "pending packet: " << packet.data.size() << " bytes (flow " << q << ")\n");
-                sendEchoToClient(client, packet.type, packet.data.size());
+                Packet packet = pending->front(q);
+                const char *payload = sendPooled(packet.slot);
+                pending->pop(q);
+                pending->lastSentFlow = q;
+                DEBUG_ONLY(cout << "pending packet: " << packet.length << " bytes (flow " << q << ")\n");
+                sendEchoToClient(client, (TunnelHeader::Type)packet.type, packet.length, payload);
                 break;
             }
         }
@@ -529,121 +750,306 @@ void Server::pollReceived(ClientData *client, uint16_t echoId, uint16_t echoSeq)
     client->lastActivity = now;
 }
 
-void Server::sendEchoToClient(ClientData *client, TunnelHeader::Type type, int dataLength)
+void Server::sendEchoToClient(ClientData *client, TunnelHeader::Type type, int dataLength, const char *payload)
 {
     uint16_t outId = 0, outSeq = 0;
     if (client->maxPolls == 0)
     {
         if (getNextPollPeek(client, outId, outSeq))
-        {
-            if (client->isV6)
-            {
-                memcpy(echoSendPayloadBuffer6() - sizeof(TunnelHeader), echoSendPayloadBuffer() - sizeof(TunnelHeader), dataLength + sizeof(TunnelHeader));
-                sendEcho6(magic, type, dataLength, client->realIp6, true, outId, outSeq);
-            }
-            else
-                sendEcho(magic, type, dataLength, client->realIp, true, outId, outSeq);
-        }
+            sendReply(client, type, dataLength, payload, outId, outSeq);
         return;
     }
 
-    if (getNextPollFromChannels(client, outId, outSeq))
+    if (getNextPoll(client, outId, outSeq))
     {
-        DEBUG_ONLY(cout << "sending (channel round-robin)" << endl);
-        if (client->isV6)
-        {
-            memcpy(echoSendPayloadBuffer6() - sizeof(TunnelHeader), echoSendPayloadBuffer() - sizeof(TunnelHeader), dataLength + sizeof(TunnelHeader));
-            sendEcho6(magic, type, dataLength, client->realIp6, true, outId, outSeq);
-        }
-        else
-            sendEcho(magic, type, dataLength, client->realIp, true, outId, outSeq);
+        sendReply(client, type, dataLength, payload, outId, outSeq);
         return;
     }
 
-    const int N = (int)client->pendingByFlow.size();
-    if (N <= 0)
-        return;
-    /* TUN data is in echoSendPayloadBuffer(); ICMP receive payload is in echoReceivePayloadBuffer(). */
-    char *payloadSrc = (type == TunnelHeader::TYPE_DATA) ? echoSendPayloadBuffer() : echoReceivePayloadBuffer();
+    const int N = HANS_NUM_FLOW_QUEUES;
+    /* TUN data is passed in `payload`; ICMP receive payload is in echoReceivePayloadBuffer(). */
+    const char *payloadSrc = payload ? payload
+        : (type == TunnelHeader::TYPE_DATA || type == TunnelHeader::TYPE_NACK ||
+           type == TunnelHeader::TYPE_FEC_PARITY) ? echoSendPayloadBuffer()
+        : echoReceivePayloadBuffer();
     int flowId = (type == TunnelHeader::TYPE_DATA && N > 1)
         ? getFlowIdFromPayload(payloadSrc, dataLength) : 0;
-    int maxPerFlow = (maxBufferedPackets > 0) ? (maxBufferedPackets + N - 1) / N : maxBufferedPackets;
-    if (maxPerFlow < 1)
-        maxPerFlow = 1;
 
-    if ((int)client->pendingByFlow[flowId].size() >= maxPerFlow)
+    if (!client->pending)
+    {
+        int maxPerFlow = (maxBufferedPackets + N - 1) / N;
+        client->pending = new PendingPackets(N, maxPerFlow > 0 ? maxPerFlow : 1);
+    }
+    PendingPackets *pending = client->pending;
+
+    if (pending->full(flowId))
     {
-        client->pendingByFlow[flowId].pop();
+        dropPooled(pending->front(flowId).slot);
+        pending->pop(flowId);
         stats.incDroppedQueueFull();
         syslog(LOG_WARNING, "packet to %s dropped (queue full, flow %d)",
                Utility::formatIp(client->tunnelIp).data(), flowId);
     }
 
+    /* tunnel packets stay in the pool slot they were read into */
+    Packet packet;
+    packet.type = type;
+    packet.length = dataLength;
+    packet.slot = payloadSrc == tunPayloadBuffer() ? poolTunPayload(dataLength) : poolCopy(payloadSrc, dataLength);
+    if (packet.slot == -1)
+    {
+        stats.incDroppedQueueFull();
+        syslog(LOG_DEBUG, "packet to %s dropped (packet pool exhausted)",
+               Utility::formatIp(client->tunnelIp).data());
+        return;
+    }
+
     DEBUG_ONLY(cout << "packet queued: " << dataLength << " bytes (flow " << flowId << ")\n");
+    pending->push(flowId, packet);
+}
 
-    client->pendingByFlow[flowId].push(Packet());
-    Packet &packet = client->pendingByFlow[flowId].back();
-    packet.type = type;
-    packet.data.resize(dataLength);
-    memcpy(&packet.data[0], payloadSrc, dataLength);
+/* Payloads passed by reference go out without a copy for either address family.
+ * Those in echoSendPayloadBuffer() are control messages, copied for IPv6. */
+void Server::sendReply(ClientData *client, TunnelHeader::Type type, int dataLength, const char *payload,
+                       uint16_t id, uint16_t seq)
+{
+    if (type != TunnelHeader::TYPE_PROBE)
+        client->packetsSent++;
+
+    /* numbered as they go out, not as they are queued, so that the client
+       only sees gaps that are losses */
+    if (type == TunnelHeader::TYPE_DATA && client->sequencing && payload)
+    {
+        payload = client->sequencing->send.add(payload, dataLength);
+        type = TunnelHeader::TYPE_DATA_SEQ;
+    }
+
+    /* so are blocks of forward error correction, their data copied behind its header */
+    bool fecData = client->fec && payload &&
+        (type == TunnelHeader::TYPE_DATA || type == TunnelHeader::TYPE_DATA_SEQ);
+    if (fecData)
+    {
+        dataLength = client->fec->encode(echoSendPayloadBuffer(), payload, dataLength, type);
+        payload = NULL;
+        type = TunnelHeader::TYPE_DATA_FEC;
+    }
+
+    if (!client->isV6)
+        sendEcho(magic, type, dataLength, client->realIp, true, id, seq, payload);
+    else
+    {
+        if (!payload && echoSendPayloadBuffer() != echoSendPayloadBuffer6())
+            memcpy(echoSendPayloadBuffer6(), echoSendPayloadBuffer(), dataLength);
+        sendEcho6(magic, type, dataLength, client->realIp6, true, id, seq, payload);
+    }
+
+    if (fecData)
+        sendParity(*client, false);
+}
+
+/* Parity and NACKs wait for a poll like anything else. */
+void Server::sendToPeer(Peer &peer, TunnelHeader::Type type, int dataLength, const char *payload)
+{
+    sendEchoToClient(static_cast<ClientData *>(&peer), type, dataLength, payload);
 }
 
 void Server::releaseTunnelIp(uint32_t tunnelIp)
 {
-    usedIps.erase(tunnelIp);
+    addresses.release(tunnelIp - network);
 }
 
-void Server::handleTimeout()
+/* Every client has a timer that checks on it at least once per keep-alive
+ * interval, until it has been silent for two. */
+void Server::handleTimer(uint32_t data)
 {
-    ClientList::iterator it = clientList.begin();
-    while (it != clientList.end())
+    uint32_t index = data & ~TIMER_KINDS;
+    ClientData &client = clients[index];
+    if (data & TIMER_KINDS)
     {
-        ClientData &client = *it++;
+        handlePeerTimer(client, data);
+        return;
+    }
 
-        if (client.lastActivity + KEEP_ALIVE_INTERVAL * 2 < now)
-        {
-            syslog(LOG_DEBUG, "client %s timed out\n",
-                   client.isV6 ? Utility::formatIp6(client.realIp6).data() : Utility::formatIp(client.realIp).data());
-            removeClient(&client);
-        }
+    client.expiryTimer = NO_TIMER;
+
+    Time expires = client.lastActivity + KEEP_ALIVE_INTERVAL * 2;
+    if (!(now < expires))
+    {
+        syslog(LOG_DEBUG, "client %s timed out\n",
+               client.isV6 ? Utility::formatIp6(client.realIp6).data() : Utility::formatIp(client.realIp).data());
+        removeClient(&client);
+        return;
     }
 
-    setTimeout(KEEP_ALIVE_INTERVAL);
+    if (client.pending && client.pending->total == 0)
+        dropPending(&client); // idle clients keep no queues
+
+    Time delta = expires - now;
+    if (Time(KEEP_ALIVE_INTERVAL) < delta)
+        delta = KEEP_ALIVE_INTERVAL;
+    client.expiryTimer = addTimer(delta, index);
 }
 
 uint32_t Server::reserveTunnelIp(uint32_t desiredIp)
 {
-    if (desiredIp > network + 1 && desiredIp < network + 255 && !usedIps.count(desiredIp))
-    {
-        usedIps.insert(desiredIp);
+    if (desiredIp != 0 && addresses.reserve(desiredIp - network))
         return desiredIp;
+
+    uint32_t offset = addresses.reserve();
+    if (offset == AddressPool::NONE)
+        return 0;
+
+    return network + offset;
+}
+
+/* The network and broadcast addresses and the server's own are never handed
+ * out. Shard `shard` of `shardCount` owns the offsets it gets from shardOf(). */
+void Server::setupAddresses(int shard, int shardCount)
+{
+    uint32_t first = SERVER_IP_OFFSET + 1;
+    first += (shard - first % shardCount + shardCount) % shardCount;
+
+    addresses.setup(first, broadcast() - network - 1, shardCount, FIRST_ASSIGNED_IP_OFFSET);
+    clientsByTunnelIp.assign(addresses.size(), NO_CLIENT);
+}
+
+uint32_t Server::broadcast() const
+{
+    return network | ~Utility::netmask(prefixLength);
+}
+
+void Server::run()
+{
+#ifdef LINUX
+    if (shardIndex == 0 && shards.size() > 1)
+    {
+        runShards();
+        return;
     }
+#endif
+
+    Worker::run();
+}
+
+void Server::stop()
+{
+    for (size_t i = 0; i < shards.size(); i++)
+        shards[i]->Worker::stop();
+}
 
-    bool ipAvailable = false;
+void Server::dumpStats() const
+{
+    Stats total;
+    for (size_t i = 0; i < shards.size(); i++)
+        total += shards[i]->stats;
+    total.dumpToSyslog();
+}
 
-    for (int i = 0; i < 255 - FIRST_ASSIGNED_IP_OFFSET; i++)
+void Server::setBusyPoll(int us)
+{
+    for (size_t i = 0; i < shards.size(); i++)
+        shards[i]->Worker::setBusyPoll(us);
+}
+
+void Server::setCongestionControl()
+{
+    syslog(LOG_WARNING, "congestion control (-C) is a client option");
+}
+
+void Server::setKernelPacing()
+{
+    for (size_t i = 0; i < shards.size(); i++)
+        shards[i]->Worker::setKernelPacing();
+}
+
+int Server::shardOf(uint32_t tunnelIp) const
+{
+    return (tunnelIp - network) % shards.size();
+}
+
+void Server::handOff(int shard, int dataLength)
+{
+    bool wake;
+    if (!shards[shard]->handoff->push(tunPayloadBuffer(), dataLength, wake))
     {
-        latestAssignedIpOffset++;
-        if (latestAssignedIpOffset == 255)
-            latestAssignedIpOffset = FIRST_ASSIGNED_IP_OFFSET;
+        stats.incDroppedQueueFull();
+        return;
+    }
+
+    if (wake)
+        shards[shard]->wake();
+}
 
-        if (!usedIps.count(network + latestAssignedIpOffset))
+bool Server::handleWakeup()
+{
+    if (!handoff)
+        return false;
+
+    for (int i = 0; i < TUN_BUDGET; i++)
+    {
+        char *buffer = nextTunPayloadBuffer();
+        int length = handoff->pop(buffer);
+        if (length == -1)
         {
-            ipAvailable = true;
-            break;
+            releaseTunPayloadBuffer();
+            return !handoff->empty(); // a packet is still being copied in
         }
+
+        uint32_t sourceIp, destIp;
+        Tun::addresses(buffer, sourceIp, destIp);
+        handleTunData(length, sourceIp, destIp);
     }
 
-    if (!ipAvailable)
-        return 0;
+    return true;
+}
+
+#ifdef LINUX
+void Server::runShards()
+{
+    std::vector<pthread_t> threads(shards.size());
+    size_t started = 1;
+
+    try
+    {
+        for (; started < shards.size(); started++)
+        {
+            int error = pthread_create(&threads[started], NULL, runShard, shards[started]);
+            if (error)
+            {
+                errno = error;
+                throw Exception("starting shard thread", true);
+            }
+        }
+
+        Worker::run();
+    }
+    catch (...)
+    {
+        stop();
+        for (size_t i = 1; i < started; i++)
+            pthread_join(threads[i], NULL);
+        throw;
+    }
 
-    usedIps.insert(network + latestAssignedIpOffset);
-    return network + latestAssignedIpOffset;
+    stop();
+    for (size_t i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
 }
 
-void Server::run()
+void *Server::runShard(void *server)
 {
-    setTimeout(KEEP_ALIVE_INTERVAL);
+    Server *shard = (Server *)server;
 
-    Worker::run();
+    try
+    {
+        shard->run();
+    }
+    catch (Exception e)
+    {
+        syslog(LOG_ERR, "shard %d: %s", shard->shardIndex, e.errorMessage().data());
+        shard->stop();
+    }
+
+    return NULL;
 }
+#endif
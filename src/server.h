@@ -22,24 +22,35 @@
 
 #include "worker.h"
 #include "auth.h"
+#include "shardqueue.h"
+#include "slab.h"
+#include "addresstable.h"
+#include "addresspool.h"
 
-#include <map>
-#include <queue>
 #include <vector>
-#include <list>
-#include <set>
 #include <string>
 #include <cstring>
 #include <netinet/in.h>
+#ifdef LINUX
+#include <pthread.h>
+#endif
 
 class Server : public Worker
 {
 public:
     Server(int tunnelMtu, const std::string *deviceName, const std::string &passphrase,
            uint32_t network, bool answerEcho, uid_t uid, gid_t gid, int pollTimeout,
-           int maxBufferedPackets = 20, int recvBufSize = 256 * 1024, int sndBufSize = 256 * 1024, int rateKbps = 0);
+           int maxBufferedPackets = 20, int recvBufSize = 256 * 1024, int sndBufSize = 256 * 1024, int rateKbps = 0,
+           bool useUring = false, const std::string *ringDevice = NULL, int shardCount = 1,
+           int prefixLength = 24, int busyPollUs = 0);
     virtual ~Server();
 
+    virtual void stop();
+    virtual void dumpStats() const;
+    virtual void setBusyPoll(int us);
+    virtual void setKernelPacing();
+    virtual void setCongestionControl();
+
     struct ClientConnectDataLegacy
     {
         uint8_t maxPolls;
@@ -49,8 +60,46 @@ public:
     struct ClientConnectData
     {
         uint8_t version;
+        uint8_t maxPolls;
+        uint8_t features;      // FEATURE_* the client asks for
+        uint8_t featuresCheck; // ~features, the two bytes being padding before
+        uint32_t desiredIp;
+    };
+
+    /* Agreed to by a seventh byte of the CONNECTION_ACCEPT payload. */
+    enum
+    {
+        FEATURE_SEQUENCE = 1, // TYPE_DATA_SEQ and TYPE_NACK
+        FEATURE_FEC = 2,      // TYPE_DATA_FEC and TYPE_FEC_PARITY
+        FEATURE_HMAC = 4      // agreed to by the size of the challenge instead
+    };
+
+    /* A connection request of either layout. */
+    struct ConnectionRequest
+    {
         uint8_t maxPolls;
         uint32_t desiredIp;
+        uint8_t features; // FEATURE_* asked for, 0 from older clients
+    };
+
+    /* Write a version 2 connection request to `data`; returns its length. */
+    static int writeConnectionRequest(char *data, uint8_t maxPolls, uint32_t desiredIp, uint8_t features);
+    /* Read the connection request `data` of `length` bytes into `request`;
+     * false if it is none. */
+    static bool parseConnectionRequest(const char *data, int length, ConnectionRequest &request);
+    /* The challenge for a client asking `features`: HMAC_CHALLENGE_SIZE bytes
+     * for an HMAC-SHA256 response if it asked for one, CHALLENGE_SIZE otherwise. */
+    static int challengeSize(uint8_t features);
+
+    /* Payload of the reply to a TYPE_PROBE, whose payload is a uint32_t stamp.
+     * Counters are of everything else, in network byte order and wrapping. */
+    struct ProbeReply
+    {
+        uint32_t stamp;           // of the probe, as it came
+        uint32_t bytesReceived;   // from the client, tunnel headers included
+        uint32_t packetsReceived;
+        uint32_t packetsSent;     // to the client
+        uint32_t pending;         // packets waiting for polls
     };
 
     static const TunnelHeader::Magic magic;
@@ -58,11 +107,37 @@ public:
 protected:
     struct Packet
     {
-        TunnelHeader::Type type;
-        std::vector<char> data;
+        int slot; // in the packet pool
+        uint16_t length;
+        uint8_t type;
+    };
+
+    /* Packets of a client waiting for polls, in per-flow rings (sent round-robin
+     * for fairness) of one allocation. Only exists while packets are waiting. */
+    struct PendingPackets
+    {
+        PendingPackets(int flows, int perFlow);
+
+        bool full(int flow) const { return flows[flow].count == perFlow; }
+        Packet &front(int flow) { return packets[flow * perFlow + flows[flow].head]; }
+        void push(int flow, const Packet &packet);
+        void pop(int flow);
+
+        struct Flow
+        {
+            uint16_t head;
+            uint16_t count;
+        };
+
+        std::vector<Packet> packets;
+        std::vector<Flow> flows;
+        int perFlow;
+        int total;
+        int lastSentFlow;
     };
 
-    struct ClientData
+    /* Timers of a client have its index as data, or'ed with their kind as a Peer. */
+    struct ClientData : Peer
     {
         enum State
         {
@@ -73,46 +148,54 @@ protected:
 
         struct EchoId
         {
+            EchoId() { }
             EchoId(uint16_t id, uint16_t seq) { this->id = id; this->seq = seq; }
 
             uint16_t id;
             uint16_t seq;
         };
 
+        ClientData() : pollHead(0), pollCount(0), pending(NULL), expiryTimer(TimerWheel::NONE),
+                       bytesReceived(0), packetsReceived(0), packetsSent(0) { }
+
         uint32_t realIp;
         struct in6_addr realIp6;
-        bool isV6;
         uint32_t tunnelIp;
+        Time lastActivity;
 
-        /* Per-flow queues (round-robin send for fairness); size = HANS_NUM_FLOW_QUEUES. If 1, single FIFO. */
-        std::vector<std::queue<Packet> > pendingByFlow;
-        int lastSentFlow;
+        /* Saved polls, oldest first, in a ring sized for all the client keeps
+         * outstanding (maxPolls on each of NUM_CHANNELS); when it is full the
+         * oldest poll is dropped. */
+        std::vector<EchoId> polls;
+        uint16_t pollHead;
+        uint16_t pollCount;
 
-        int maxPolls;
-        /* Per-channel POLL queues for multiplexing; size = NUM_CHANNELS. Channel = echoId % NUM_CHANNELS. */
-        std::vector<std::queue<EchoId> > pollIdsByChannel;
-        int nextChannelToSend;
-        Time lastActivity;
+        PendingPackets *pending; // NULL while no packet waits
+        uint32_t expiryTimer;
 
-        State state;
+        /* for probe replies */
+        uint32_t bytesReceived;
+        uint32_t packetsReceived;
+        uint32_t packetsSent;
+
+        uint8_t features; // asked for
+
+        uint8_t maxPolls;
+        bool isV6;
         bool useHmac;
+        State state;
 
-        Auth::Challenge challenge;
+        Auth::Challenge challenge; // emptied once established
     };
 
-    typedef std::list<ClientData> ClientList;
-    typedef std::map<uint32_t, ClientList::iterator> ClientIpMap;
-    struct In6AddrCompare {
-        bool operator()(const struct in6_addr &a, const struct in6_addr &b) const {
-            return memcmp(&a, &b, sizeof(a)) < 0;
-        }
-    };
-    typedef std::map<struct in6_addr, ClientList::iterator, In6AddrCompare> ClientIp6Map;
+    typedef Slab<ClientData> ClientSlab;
+    enum { NO_CLIENT = AddressTable<uint32_t>::NONE };
 
     virtual bool handleEchoData(const TunnelHeader &header, int dataLength, uint32_t realIp, bool reply, uint16_t id, uint16_t seq);
     virtual bool handleEchoData6(const TunnelHeader &header, int dataLength, const struct in6_addr &realIp, bool reply, uint16_t id, uint16_t seq);
     virtual void handleTunData(int dataLength, uint32_t sourceIp, uint32_t destIp);
-    virtual void handleTimeout();
+    virtual void handleTimer(uint32_t data);
+    virtual bool handleWakeup();
 
     virtual void run();
 
@@ -120,17 +203,29 @@ protected:
 
     void handleUnknownClient(const TunnelHeader &header, int dataLength, uint32_t realIp, uint16_t echoId, uint16_t echoSeq);
     void handleUnknownClient6(const TunnelHeader &header, int dataLength, const struct in6_addr &realIp, uint16_t echoId, uint16_t echoSeq);
+    bool readConnectionRequest(ClientData *client, const TunnelHeader &header, int dataLength,
+                               uint16_t echoId, uint16_t echoSeq);
+    uint32_t clientIndex(ClientData *client); // of an established client
     void removeClient(ClientData *client);
+    void dropPending(ClientData *client);
 
     void sendChallenge(ClientData *client);
     void checkChallenge(ClientData *client, int dataLength);
     void sendReset(ClientData *client);
 
-    void sendEchoToClient(ClientData *client, TunnelHeader::Type type, int dataLength);
+    /* Payload in echoSendPayloadBuffer(), or at `payload` until flushEcho. */
+    void sendEchoToClient(ClientData *client, TunnelHeader::Type type, int dataLength, const char *payload = NULL);
+    void sendReply(ClientData *client, TunnelHeader::Type type, int dataLength, const char *payload,
+                   uint16_t id, uint16_t seq);
 
+    bool requestReceived(ClientData *client, const TunnelHeader &header, int dataLength,
+                         uint16_t echoId, uint16_t echoSeq);
     void pollReceived(ClientData *client, uint16_t echoId, uint16_t echoSeq);
+    void answerProbe(ClientData *client, int dataLength, uint16_t echoId, uint16_t echoSeq);
 
-    bool getNextPollFromChannels(ClientData *client, uint16_t &outId, uint16_t &outSeq);
+    virtual void sendToPeer(Peer &peer, TunnelHeader::Type type, int dataLength, const char *payload);
+
+    bool getNextPoll(ClientData *client, uint16_t &outId, uint16_t &outSeq);
     bool getNextPollPeek(ClientData *client, uint16_t &outId, uint16_t &outSeq);
 
     uint32_t reserveTunnelIp(uint32_t desiredIp);
@@ -143,16 +238,44 @@ protected:
     Auth auth;
 
     uint32_t network;
-    std::set<uint32_t> usedIps;
-    uint32_t latestAssignedIpOffset;
+    int prefixLength;
+    AddressPool addresses;
 
     Time pollTimeout;
     int maxBufferedPackets;
 
-    ClientList clientList;
-    ClientIpMap clientRealIpMap;
-    ClientIp6Map clientRealIp6Map;
-    ClientIpMap clientTunnelIpMap;
+    ClientSlab clients;
+    /* slab indexes by real address, and by tunnel address position in `addresses` */
+    AddressTable<uint32_t> clientsByRealIp;
+    AddressTable<struct in6_addr> clientsByRealIp6;
+    std::vector<uint32_t> clientsByTunnelIp;
+
+    /*
+     * With more than one shard (-T), every shard is a Server of its own running
+     * in its own thread, with its own TUN queue and ICMP sockets. A shard only
+     * receives echo packets whose source address is its share of the clients,
+     * and hands out tunnel addresses from its share of the network, so client
+     * state is never shared. Tunnel packets read from the wrong TUN queue are
+     * passed to the owning shard through its handoff queue.
+     */
+    int shardIndex;
+    std::vector<Server *> shards; // shards[0] is the primary and owns the others
+    ShardQueue *handoff;
+
+private:
+    Server(Server *primary, int shardIndex, int tunnelMtu, const std::string &passphrase,
+           bool answerEcho, uid_t uid, gid_t gid, int recvBufSize, int sndBufSize,
+           int rateKbps, bool useUring, const std::string *ringDevice);
+
+    int shardOf(uint32_t tunnelIp) const;
+    void setupAddresses(int shard, int shardCount);
+    uint32_t broadcast() const;
+    void handOff(int shard, int dataLength);
+
+#ifdef LINUX
+    void runShards();
+    static void *runShard(void *server);
+#endif
 };
 
 #endif
@@ -0,0 +1,91 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "shardqueue.h"
+
+#include <string.h>
+
+ShardQueue::ShardQueue(int slotCount, int slotSize)
+{
+    uint32_t count = 1;
+    while (count < (uint32_t)slotCount)
+        count <<= 1;
+
+    this->mask = count - 1;
+    this->slotSize = slotSize;
+    this->head = 0;
+    this->tail = 0;
+
+    slots.resize(count);
+    data.resize(count * slotSize);
+    for (uint32_t i = 0; i < count; i++)
+        slots[i].sequence = i;
+}
+
+bool ShardQueue::push(const char *packet, int length, bool &wake)
+{
+    if (length > slotSize)
+        return false;
+
+    uint32_t position = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        uint32_t sequence = __atomic_load_n(&slots[position & mask].sequence, __ATOMIC_ACQUIRE);
+        int32_t lag = (int32_t)(sequence - position);
+
+        if (lag < 0)
+            return false; // the consumer has not popped this slot yet
+        if (lag > 0)
+            position = __atomic_load_n(&tail, __ATOMIC_RELAXED); // another producer took it
+        else if (__atomic_compare_exchange_n(&tail, &position, position + 1, true,
+                                             __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            break;
+    }
+
+    Slot &slot = slots[position & mask];
+    memcpy(&data[(position & mask) * slotSize], packet, length);
+    slot.length = length;
+    __atomic_store_n(&slot.sequence, position + 1, __ATOMIC_RELEASE);
+
+    /* The consumer only goes idle after seeing head == tail, so the producer
+     * that claims the slot at head is the one that has to wake it. */
+    wake = __atomic_load_n(&head, __ATOMIC_SEQ_CST) == position;
+    return true;
+}
+
+int ShardQueue::pop(char *packet)
+{
+    uint32_t position = head;
+    Slot &slot = slots[position & mask];
+
+    if (__atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE) != position + 1)
+        return -1;
+
+    int length = slot.length;
+    memcpy(packet, &data[(position & mask) * slotSize], length);
+
+    __atomic_store_n(&slot.sequence, position + mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&head, position + 1, __ATOMIC_SEQ_CST);
+    return length;
+}
+
+bool ShardQueue::empty() const
+{
+    return __atomic_load_n(&tail, __ATOMIC_SEQ_CST) == head;
+}
@@ -0,0 +1,58 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SHARDQUEUE_H
+#define SHARDQUEUE_H
+
+#include <vector>
+#include <stdint.h>
+
+/* Bounded queue of tunnel packets handed to a server shard by the other shards:
+ * any thread may push, only the owning shard pops. Lock-free; each slot carries
+ * a sequence number telling producers and the consumer whose turn it is. */
+class ShardQueue
+{
+public:
+    ShardQueue(int slotCount, int slotSize);
+
+    /* Copy a packet in. Returns false if the queue is full. `wake` is set when
+     * the consumer may have gone idle and has to be woken up. */
+    bool push(const char *data, int length, bool &wake);
+    /* Copy the oldest packet out; returns its length or -1 if none is ready. */
+    int pop(char *data);
+    /* No packet is queued or being pushed. */
+    bool empty() const;
+
+protected:
+    struct Slot
+    {
+        uint32_t sequence;
+        int length;
+    };
+
+    uint32_t mask;
+    int slotSize;
+    std::vector<Slot> slots;
+    std::vector<char> data;
+
+    uint32_t head; // next slot to pop, written by the consumer
+    uint32_t tail; // next slot to claim, shared by producers
+};
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <vector>
+#include <stdint.h>
+
+/* Records allocated in chunks that never move, addressed by index. Freed
+ * indexes are reused before the slab grows. */
+template <class T>
+class Slab
+{
+public:
+    enum { CHUNK = 256 };
+
+    Slab() : count(0) { }
+    ~Slab()
+    {
+        for (size_t i = 0; i < chunks.size(); i++)
+            delete[] chunks[i];
+    }
+
+    /* Index of a record in its default state. */
+    uint32_t insert()
+    {
+        if (freeIndexes.empty())
+        {
+            uint32_t first = chunks.size() * CHUNK;
+            chunks.push_back(new T[CHUNK]);
+            live.resize(first + CHUNK, false);
+            for (uint32_t i = first + CHUNK; i > first; i--)
+                freeIndexes.push_back(i - 1);
+        }
+
+        uint32_t index = freeIndexes.back();
+        freeIndexes.pop_back();
+        live[index] = true;
+        count++;
+        return index;
+    }
+
+    /* Resets the record to T(), freeing what it holds. */
+    void erase(uint32_t index)
+    {
+        (*this)[index] = T();
+        live[index] = false;
+        freeIndexes.push_back(index);
+        count--;
+    }
+
+    T &operator[](uint32_t index) { return chunks[index / CHUNK][index % CHUNK]; }
+    bool used(uint32_t index) const { return live[index]; }
+    uint32_t end() const { return live.size(); } // indexes are below
+    uint32_t size() const { return count; }
+
+private:
+    Slab(const Slab &);
+    Slab &operator=(const Slab &);
+
+    std::vector<T *> chunks;
+    std::vector<bool> live;
+    std::vector<uint32_t> freeIndexes;
+    uint32_t count;
+};
+
+#endif
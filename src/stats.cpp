@@ -29,7 +29,28 @@ Stats::Stats()
     , bytes_received(0)
     , packets_dropped_send_fail(0)
     , packets_dropped_queue_full(0)
+    , partial_sends(0)
+    , tun_batches(0)
+    , tun_batch_packets(0)
+    , send_latencies(0)
+    , send_latency_total(0)
+    , send_latency_max(0)
+    , paced(0)
+    , paced_dropped_backlog(0)
+    , pace_backlog_max(0)
+    , nacks_sent(0)
+    , retransmitted(0)
+    , recovered(0)
+    , seq_duplicates(0)
+    , unrecovered(0)
+    , fec_parity_sent(0)
+    , fec_recovered(0)
+    , fec_lost(0)
 {
+    for (int i = 0; i < TUN_BATCH_BUCKETS; i++)
+        tun_batch_sizes[i] = 0;
+    for (int i = 0; i < SEND_LATENCY_BUCKETS; i++)
+        send_latency_sizes[i] = 0;
 }
 
 void Stats::incPacketsSent(int bytes)
@@ -39,6 +60,13 @@ void Stats::incPacketsSent(int bytes)
         bytes_sent += bytes;
 }
 
+void Stats::addPacketsSent(int packets, int bytes)
+{
+    packets_sent += packets;
+    if (bytes > 0)
+        bytes_sent += bytes;
+}
+
 void Stats::incPacketsReceived(int bytes)
 {
     packets_received++;
@@ -51,18 +79,185 @@ void Stats::incDroppedSendFail()
     packets_dropped_send_fail++;
 }
 
+void Stats::addDroppedSendFail(int packets)
+{
+    packets_dropped_send_fail += packets;
+}
+
 void Stats::incDroppedQueueFull()
 {
     packets_dropped_queue_full++;
 }
 
+void Stats::addPartialSends(int count)
+{
+    partial_sends += count;
+}
+
+void Stats::addTunBatch(int packets)
+{
+    if (packets <= 0)
+        return;
+
+    int bucket = 0;
+    while (bucket < TUN_BATCH_BUCKETS - 1 && packets >> (bucket + 1))
+        bucket++;
+
+    tun_batches++;
+    tun_batch_packets += packets;
+    tun_batch_sizes[bucket]++;
+}
+
+void Stats::addSendLatency(int64_t us)
+{
+    if (us < 0)
+        us = 0; // the clock was set back
+
+    int bucket = 0;
+    while (bucket < SEND_LATENCY_BUCKETS - 1 && us >> (bucket + 1))
+        bucket++;
+
+    send_latencies++;
+    send_latency_total += us;
+    if ((uint64_t)us > send_latency_max)
+        send_latency_max = us;
+    send_latency_sizes[bucket]++;
+}
+
+void Stats::incPaced(int backlog)
+{
+    paced++;
+    if ((uint64_t)backlog > pace_backlog_max)
+        pace_backlog_max = backlog;
+}
+
+void Stats::incDroppedPaceBacklog()
+{
+    paced_dropped_backlog++;
+}
+
+void Stats::incNacksSent()
+{
+    nacks_sent++;
+}
+
+void Stats::incRetransmitted()
+{
+    retransmitted++;
+}
+
+void Stats::incRecovered()
+{
+    recovered++;
+}
+
+void Stats::incSequenceDuplicate()
+{
+    seq_duplicates++;
+}
+
+void Stats::addUnrecovered(int packets)
+{
+    unrecovered += packets;
+}
+
+void Stats::incFecParitySent()
+{
+    fec_parity_sent++;
+}
+
+void Stats::incFecRecovered()
+{
+    fec_recovered++;
+}
+
+void Stats::addFecLost(int packets)
+{
+    fec_lost += packets;
+}
+
+Stats &Stats::operator+=(const Stats &other)
+{
+    packets_sent += other.packets_sent;
+    packets_received += other.packets_received;
+    bytes_sent += other.bytes_sent;
+    bytes_received += other.bytes_received;
+    packets_dropped_send_fail += other.packets_dropped_send_fail;
+    packets_dropped_queue_full += other.packets_dropped_queue_full;
+    partial_sends += other.partial_sends;
+    tun_batches += other.tun_batches;
+    tun_batch_packets += other.tun_batch_packets;
+    for (int i = 0; i < TUN_BATCH_BUCKETS; i++)
+        tun_batch_sizes[i] += other.tun_batch_sizes[i];
+    send_latencies += other.send_latencies;
+    send_latency_total += other.send_latency_total;
+    if (other.send_latency_max > send_latency_max)
+        send_latency_max = other.send_latency_max;
+    for (int i = 0; i < SEND_LATENCY_BUCKETS; i++)
+        send_latency_sizes[i] += other.send_latency_sizes[i];
+    paced += other.paced;
+    paced_dropped_backlog += other.paced_dropped_backlog;
+    if (other.pace_backlog_max > pace_backlog_max)
+        pace_backlog_max = other.pace_backlog_max;
+    nacks_sent += other.nacks_sent;
+    retransmitted += other.retransmitted;
+    recovered += other.recovered;
+    seq_duplicates += other.seq_duplicates;
+    unrecovered += other.unrecovered;
+    fec_parity_sent += other.fec_parity_sent;
+    fec_recovered += other.fec_recovered;
+    fec_lost += other.fec_lost;
+    return *this;
+}
+
 void Stats::dumpToSyslog() const
 {
-    syslog(LOG_INFO, "stats: packets_sent=%" PRIu64 " packets_received=%" PRIu64 " bytes_sent=%" PRIu64 " bytes_received=%" PRIu64 " dropped_send_fail=%" PRIu64 " dropped_queue_full=%" PRIu64,
+    syslog(LOG_INFO, "stats: packets_sent=%" PRIu64 " packets_received=%" PRIu64 " bytes_sent=%" PRIu64 " bytes_received=%" PRIu64 " dropped_send_fail=%" PRIu64 " dropped_queue_full=%" PRIu64 " partial_sends=%" PRIu64,
            packets_sent,
            packets_received,
            bytes_sent,
            bytes_received,
            packets_dropped_send_fail,
-           packets_dropped_queue_full);
+           packets_dropped_queue_full,
+           partial_sends);
+    syslog(LOG_INFO, "stats: tun_batches=%" PRIu64 " tun_batch_packets=%" PRIu64 " tun_batch_sizes=1:%" PRIu64 ",2-3:%" PRIu64 ",4-7:%" PRIu64 ",8-15:%" PRIu64 ",16-31:%" PRIu64 ",32-63:%" PRIu64 ",64+:%" PRIu64,
+           tun_batches,
+           tun_batch_packets,
+           tun_batch_sizes[0],
+           tun_batch_sizes[1],
+           tun_batch_sizes[2],
+           tun_batch_sizes[3],
+           tun_batch_sizes[4],
+           tun_batch_sizes[5],
+           tun_batch_sizes[6]);
+    syslog(LOG_INFO, "stats: send_latencies=%" PRIu64 " send_latency_avg_us=%" PRIu64 " send_latency_max_us=%" PRIu64 " send_latency_us=0-1:%" PRIu64 ",2-3:%" PRIu64 ",4-7:%" PRIu64 ",8-15:%" PRIu64 ",16-31:%" PRIu64 ",32-63:%" PRIu64 ",64-127:%" PRIu64 ",128-255:%" PRIu64 ",256-511:%" PRIu64 ",512+:%" PRIu64,
+           send_latencies,
+           send_latencies ? send_latency_total / send_latencies : 0,
+           send_latency_max,
+           send_latency_sizes[0],
+           send_latency_sizes[1],
+           send_latency_sizes[2],
+           send_latency_sizes[3],
+           send_latency_sizes[4],
+           send_latency_sizes[5],
+           send_latency_sizes[6],
+           send_latency_sizes[7],
+           send_latency_sizes[8],
+           send_latency_sizes[9]);
+    syslog(LOG_INFO, "stats: paced=%" PRIu64 " paced_dropped_backlog=%" PRIu64 " pace_backlog_max=%" PRIu64,
+           paced,
+           paced_dropped_backlog,
+           pace_backlog_max);
+    if (nacks_sent || retransmitted || recovered || seq_duplicates || unrecovered)
+        syslog(LOG_INFO, "stats: nacks_sent=%" PRIu64 " retransmitted=%" PRIu64 " recovered=%" PRIu64 " seq_duplicates=%" PRIu64 " unrecovered=%" PRIu64,
+               nacks_sent,
+               retransmitted,
+               recovered,
+               seq_duplicates,
+               unrecovered);
+    if (fec_parity_sent || fec_recovered || fec_lost)
+        syslog(LOG_INFO, "stats: fec_parity_sent=%" PRIu64 " fec_recovered=%" PRIu64 " fec_lost=%" PRIu64,
+               fec_parity_sent,
+               fec_recovered,
+               fec_lost);
 }
@@ -28,9 +28,26 @@ public:
     Stats();
 
     void incPacketsSent(int bytes = 0);
+    void addPacketsSent(int packets, int bytes);
     void incPacketsReceived(int bytes = 0);
     void incDroppedSendFail();
+    void addDroppedSendFail(int packets);
     void incDroppedQueueFull();
+    void addPartialSends(int count);
+    void addTunBatch(int packets); // one drain of the tunnel device
+    void addSendLatency(int64_t us); // from the wakeup that led to a send to the send
+    void incPaced(int backlog);      // a packet held back for pacing, and the ones waiting with it
+    void incDroppedPaceBacklog();
+    void incNacksSent();
+    void incRetransmitted();
+    void incRecovered();          // a resent packet filled a gap
+    void incSequenceDuplicate();  // a sequenced packet received before
+    void addUnrecovered(int packets);
+    void incFecParitySent();
+    void incFecRecovered();       // a lost packet rebuilt from its block
+    void addFecLost(int packets); // lost from blocks missing more than the parity rebuilds
+
+    Stats &operator+=(const Stats &other);
 
     void dumpToSyslog() const;
 
@@ -41,6 +58,34 @@ private:
     uint64_t bytes_received;
     uint64_t packets_dropped_send_fail;
     uint64_t packets_dropped_queue_full;
+    uint64_t partial_sends;
+
+    /* tunnel drains by packets read: 1, 2-3, 4-7, ... 64 and more */
+    enum { TUN_BATCH_BUCKETS = 7 };
+    uint64_t tun_batches;
+    uint64_t tun_batch_packets;
+    uint64_t tun_batch_sizes[TUN_BATCH_BUCKETS];
+
+    /* wakeup-to-send latencies in microseconds: 0-1, 2-3, 4-7, ... 512 and more */
+    enum { SEND_LATENCY_BUCKETS = 10 };
+    uint64_t send_latencies;
+    uint64_t send_latency_total;
+    uint64_t send_latency_max;
+    uint64_t send_latency_sizes[SEND_LATENCY_BUCKETS];
+
+    uint64_t paced;
+    uint64_t paced_dropped_backlog;
+    uint64_t pace_backlog_max;
+
+    uint64_t nacks_sent;
+    uint64_t retransmitted;
+    uint64_t recovered;
+    uint64_t seq_duplicates;
+    uint64_t unrecovered;
+
+    uint64_t fec_parity_sent;
+    uint64_t fec_recovered;
+    uint64_t fec_lost;
 };
 
 #endif
@@ -21,65 +21,47 @@
 
 const Time Time::ZERO = Time(0);
 
-Time::Time(int ms)
+struct timeval Time::toTimeval() const
 {
-    tv.tv_sec = ms / 1000;
-    tv.tv_usec = (ms % 1000) * 1000;
+    struct timeval tv;
+    tv.tv_sec = ns / 1000000000;
+    tv.tv_usec = ns % 1000000000 / 1000;
+    return tv;
 }
 
-Time Time::operator-(const Time &other) const
+struct timespec Time::toTimespec() const
 {
-    Time result;
-    result.tv.tv_sec = tv.tv_sec - other.tv.tv_sec;
-    result.tv.tv_usec = tv.tv_usec - other.tv.tv_usec;
-
-    if (result.tv.tv_usec < 0)
-    {
-        result.tv.tv_usec += 1000000;
-        result.tv.tv_sec -= 1;
-    }
-
-    return result;
-}
-
-Time Time::operator+(const Time &other) const
-{
-    Time result;
-    result.tv.tv_sec = tv.tv_sec + other.tv.tv_sec;
-    result.tv.tv_usec = tv.tv_usec + other.tv.tv_usec;
-
-    if (result.tv.tv_usec >= 1000000)
-    {
-        result.tv.tv_usec -= 1000000;
-        result.tv.tv_sec += 1;
-    }
-
-    return result;
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    return ts;
 }
 
-bool Time::operator==(const Time &other) const
+#ifdef CLOCK_MONOTONIC
+static Time readClock(clockid_t clock)
 {
-    return tv.tv_sec != other.tv.tv_sec ? false : tv.tv_usec == other.tv.tv_usec;
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return Time::fromNanoseconds((int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
 }
+#endif
 
-bool Time::operator!=(const Time &other) const
-{
-    return tv.tv_sec != other.tv.tv_sec ? true : tv.tv_usec != other.tv.tv_usec;
-}
-
-bool Time::operator<(const Time &other) const
-{
-    return tv.tv_sec != other.tv.tv_sec ? tv.tv_sec < other.tv.tv_sec : tv.tv_usec < other.tv.tv_usec;
-}
-
-bool Time::operator>(const Time &other) const
+Time Time::now()
 {
-    return tv.tv_sec != other.tv.tv_sec ? tv.tv_sec > other.tv.tv_sec : tv.tv_usec > other.tv.tv_usec;
+#ifdef CLOCK_MONOTONIC
+    return readClock(CLOCK_MONOTONIC);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return fromMicroseconds((int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+#endif
 }
 
-Time Time::now()
+Time Time::coarseNow()
 {
-    Time result;
-    gettimeofday(&result.tv, 0);
-    return result;
+#ifdef CLOCK_MONOTONIC_COARSE
+    return readClock(CLOCK_MONOTONIC_COARSE);
+#else
+    return now();
+#endif
 }
@@ -21,28 +21,40 @@
 #define TIME_H
 
 #include <sys/time.h>
+#include <time.h>
+#include <stdint.h>
 
+/* A point in CLOCK_MONOTONIC time, or a span of it, in nanoseconds. */
 class Time
 {
 public:
-    Time() { tv.tv_sec = 0; tv.tv_usec = 0; };
-    Time(int ms);
+    Time() : ns(0) { }
+    Time(int ms) : ns((int64_t)ms * 1000000) { }
 
-    timeval &getTimeval() { return tv; }
+    int64_t nanoseconds() const { return ns; }
+    int64_t microseconds() const { return ns / 1000; }
+    static Time fromNanoseconds(int64_t ns) { Time result; result.ns = ns; return result; }
+    static Time fromMicroseconds(int64_t us) { return fromNanoseconds(us * 1000); }
 
-    Time operator+(const Time &other) const;
-    Time operator-(const Time &other) const;
+    struct timeval toTimeval() const;
+    struct timespec toTimespec() const;
 
-    bool operator!=(const Time &other) const;
-    bool operator==(const Time &other) const;
-    bool operator<(const Time &other) const;
-    bool operator>(const Time &other) const;
+    Time operator+(const Time &other) const { return fromNanoseconds(ns + other.ns); }
+    Time operator-(const Time &other) const { return fromNanoseconds(ns - other.ns); }
+
+    bool operator!=(const Time &other) const { return ns != other.ns; }
+    bool operator==(const Time &other) const { return ns == other.ns; }
+    bool operator<(const Time &other) const { return ns < other.ns; }
+    bool operator>(const Time &other) const { return ns > other.ns; }
 
     static Time now();
+    /* Cheaper, but only as fine as the scheduler tick where the system has
+     * a coarse clock (Linux), the same as now() elsewhere. */
+    static Time coarseNow();
 
     static const Time ZERO;
 protected:
-    timeval tv;
+    int64_t ns;
 };
 
 #endif
@@ -0,0 +1,215 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "timerwheel.h"
+
+static const int64_t NEVER = (int64_t)1 << 62;
+
+static int64_t tickOf(Time time)
+{
+    return time.nanoseconds() / 1000000;
+}
+
+static int lowestBit(uint64_t bits)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    int bit = 0;
+    while (!(bits & 1))
+    {
+        bits >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+TimerWheel::TimerWheel() : freeTimers(NONE), current(0), count(0)
+{
+    for (int i = 0; i <= DUE; i++)
+        heads[i] = NONE;
+    for (int i = 0; i < LEVELS; i++)
+        occupied[i] = 0;
+}
+
+uint32_t TimerWheel::add(Time now, Time when, uint32_t data)
+{
+    advance(tickOf(now));
+
+    uint32_t timer = freeTimers;
+    if (timer == NONE)
+    {
+        timer = timers.size();
+        timers.push_back(Timer());
+    }
+    else
+        freeTimers = timers[timer].next;
+
+    timers[timer].expires = (when.nanoseconds() + 999999) / 1000000; // never early
+    timers[timer].data = data;
+    link(timer);
+    count++;
+    return timer;
+}
+
+void TimerWheel::cancel(uint32_t timer)
+{
+    unlink(timer);
+    timers[timer].next = freeTimers;
+    freeTimers = timer;
+    count--;
+}
+
+Time TimerWheel::next() const
+{
+    if (heads[DUE] != NONE)
+        return Time::fromNanoseconds(current * 1000000);
+
+    int64_t tick = nextTick();
+    return tick == NEVER ? Time::ZERO : Time::fromNanoseconds(tick * 1000000);
+}
+
+bool TimerWheel::expire(Time now, uint32_t &data)
+{
+    if (count == 0)
+        return false;
+
+    advance(tickOf(now));
+
+    uint32_t timer = heads[DUE];
+    if (timer == NONE)
+        return false;
+
+    data = timers[timer].data;
+    cancel(timer);
+    return true;
+}
+
+/* Level 0 takes the timers due within a turn of it, level 1 those within a
+ * turn of level 1, and so on. */
+void TimerWheel::link(uint32_t timer)
+{
+    Timer &t = timers[timer];
+    int64_t delta = t.expires - current;
+    int list = DUE;
+
+    if (delta > 0)
+    {
+        int64_t expires = t.expires;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (int64_t)SLOTS << (SLOT_BITS * level))
+            level++;
+        if (delta >= (int64_t)SLOTS << (SLOT_BITS * level))
+            expires = current + ((int64_t)SLOTS << (SLOT_BITS * level)) - 1;
+
+        int slot = (expires >> (SLOT_BITS * level)) & (SLOTS - 1);
+        list = level * SLOTS + slot;
+        occupied[level] |= (uint64_t)1 << slot;
+    }
+
+    t.list = list;
+    t.prev = NONE;
+    t.next = heads[list];
+    if (t.next != NONE)
+        timers[t.next].prev = timer;
+    heads[list] = timer;
+}
+
+void TimerWheel::unlink(uint32_t timer)
+{
+    Timer &t = timers[timer];
+
+    if (t.prev != NONE)
+        timers[t.prev].next = t.next;
+    else
+        heads[t.list] = t.next;
+    if (t.next != NONE)
+        timers[t.next].prev = t.prev;
+
+    if (t.list != DUE && heads[t.list] == NONE)
+        occupied[t.list / SLOTS] &= ~((uint64_t)1 << (t.list % SLOTS));
+}
+
+/* Skips the ticks without anything to do. */
+void TimerWheel::advance(int64_t tick)
+{
+    while (current < tick)
+    {
+        int64_t next = nextTick();
+        if (next > tick)
+        {
+            current = tick;
+            break;
+        }
+
+        current = next;
+        for (int level = LEVELS - 1; level > 0; level--)
+        {
+            if ((current & (((int64_t)1 << (SLOT_BITS * level)) - 1)) == 0)
+                cascade(level, (current >> (SLOT_BITS * level)) & (SLOTS - 1));
+        }
+        cascade(0, current & (SLOTS - 1));
+    }
+}
+
+/* A slot of level L comes up when the ticks above level L reach it, up to a
+ * whole turn of the level after the current one. */
+int64_t TimerWheel::nextTick() const
+{
+    int64_t next = NEVER;
+
+    for (int level = 0; level < LEVELS; level++)
+    {
+        if (occupied[level] == 0)
+            continue;
+
+        int shift = SLOT_BITS * level;
+        int from = ((current >> shift) + 1) & (SLOTS - 1);
+        uint64_t bits = occupied[level];
+        if (from > 0)
+            bits = bits >> from | bits << (SLOTS - from);
+
+        int64_t tick = ((current >> shift) + 1 + lowestBit(bits)) << shift;
+        if (tick < next)
+            next = tick;
+    }
+
+    return next;
+}
+
+/* Relinks the timers of a slot that came up, which puts them a level lower or
+ * on the due list. */
+void TimerWheel::cascade(int level, int slot)
+{
+    int list = level * SLOTS + slot;
+    uint32_t timer = heads[list];
+    if (timer == NONE)
+        return;
+
+    heads[list] = NONE;
+    occupied[level] &= ~((uint64_t)1 << slot);
+
+    while (timer != NONE)
+    {
+        uint32_t next = timers[timer].next;
+        link(timer);
+        timer = next;
+    }
+}
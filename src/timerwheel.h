@@ -0,0 +1,78 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include "time.h"
+
+#include <vector>
+#include <stdint.h>
+
+/* Timers at millisecond resolution in a hierarchical timing wheel: 4 levels of
+ * 64 slots, each slot of a level spanning a whole turn of the level below, so
+ * timers up to 4.6 hours out are filed in constant time and move down a level
+ * when their slot comes up. Timers further out are filed at the top and moved
+ * again. Timers fire at or up to a millisecond after their time. */
+class TimerWheel
+{
+public:
+    enum { NONE = 0xffffffff };
+
+    TimerWheel();
+
+    /* Returns the timer, which stays valid until it has been expired or
+     * cancelled. */
+    uint32_t add(Time now, Time when, uint32_t data);
+    void cancel(uint32_t timer);
+
+    /* When expire() has to be called next, ZERO without timers. */
+    Time next() const;
+    /* Take a timer that is due at `now`; false if there is none. */
+    bool expire(Time now, uint32_t &data);
+
+    uint32_t size() const { return count; }
+
+protected:
+    enum { LEVELS = 4, SLOT_BITS = 6, SLOTS = 1 << SLOT_BITS, DUE = LEVELS * SLOTS };
+
+    struct Timer
+    {
+        int64_t expires; // tick
+        uint32_t data;
+        uint32_t prev;
+        uint32_t next;
+        uint16_t list;   // slot, DUE or unused
+    };
+
+    void link(uint32_t timer);
+    void unlink(uint32_t timer);
+    void advance(int64_t tick);
+    int64_t nextTick() const; // next tick with a slot to expire or move down
+    void cascade(int level, int slot);
+
+    std::vector<Timer> timers;
+    uint32_t freeTimers;
+    uint32_t heads[DUE + 1];     // lists of timers per slot, and of due ones
+    uint64_t occupied[LEVELS];   // slots with timers
+    int64_t current;             // last tick dealt with
+    uint32_t count;
+};
+
+#endif
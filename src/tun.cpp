@@ -20,6 +20,8 @@
 #include "tun.h"
 #include "exception.h"
 #include "utility.h"
+#include "config.h"
+#include "checksum.h"
 
 #include <arpa/inet.h>
 #include <sys/types.h>
@@ -30,12 +32,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sstream>
 
 #ifdef WIN32
 #include <w32api/windows.h>
 #endif
 
+#ifdef LINUX
+#include <sys/uio.h>
+#endif
+
 typedef ip IpHeader;
 
 using std::string;
@@ -54,20 +62,42 @@ static void winsystem(char *cmd)
 }
 #endif
 
-Tun::Tun(const string *device, int mtu)
+Tun::Tun(const string *device, int mtu, Queue queue)
 {
     this->mtu = mtu;
+    frameHeader = 0;
+    frame = NULL;
+    frameLength = 0;
 
     if (device)
         this->device = *device;
 
     this->device.resize(VTUN_DEV_LEN);
+#ifdef LINUX
+    if (!openOffloaded(queue))
+        fd = tun_open_features(&this->device[0], queue != SINGLE_QUEUE, 0);
+#else
+    if (queue != SINGLE_QUEUE)
+        throw Exception("multi-queue tunnel devices are only supported on Linux");
     fd = tun_open(&this->device[0]);
+#endif
     this->device.resize(strlen(this->device.data()));
 
     if (fd == -1)
         throw Exception(string("could not create tunnel device: ") + tun_last_error());
 
+    if (frameHeader)
+        readBuffer.resize(frameSize());
+
+#ifndef WIN32
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        syslog(LOG_WARNING, "O_NONBLOCK: %s", strerror(errno));
+#endif
+
+    if (queue == ATTACH_QUEUE)
+        return; // the first queue configured the device
+
     syslog(LOG_INFO, "opened tunnel device: %s", this->device.data());
 
     std::stringstream cmdline;
@@ -88,21 +118,45 @@ Tun::~Tun()
     tun_close(fd, &device[0]);
 }
 
-void Tun::setIp(uint32_t ip, uint32_t destIp)
+/* Open the device with a virtio-net header and TCP segmentation and checksum
+ * offloads enabled. Returns false if the header is not available; the device
+ * then has to be opened without it. */
+bool Tun::openOffloaded(Queue queue)
+{
+#if defined(LINUX) && HANS_TUN_OFFLOAD
+    fd = tun_open_features(&device[0], queue != SINGLE_QUEUE, 1);
+    if (fd == -1)
+        return false;
+
+    /* the header is a setting of the device, not of the queue, so queues
+       attached later have to keep it even if the offloads cannot be used */
+    frameHeader = sizeof(VnetHeader);
+    if (tun_set_offload(fd) == -1 && queue != ATTACH_QUEUE)
+        syslog(LOG_INFO, "tunnel offloads unavailable: %s", strerror(errno));
+    return true;
+#else
+    (void)queue;
+    return false;
+#endif
+}
+
+void Tun::setIp(uint32_t ip, uint32_t destIp, int prefixLength)
 {
     std::stringstream cmdline;
     string ips = Utility::formatIp(ip);
     string destIps = Utility::formatIp(destIp);
+    uint32_t netmask = Utility::netmask(prefixLength);
+    string netmasks = Utility::formatIp(netmask);
 
 #ifdef WIN32
     cmdline << "netsh interface ip set address name=\"" << device << "\" "
-            << "static " << ips << " 255.255.255.0";
+            << "static " << ips << " " << netmasks;
     winsystem(cmdline.str().data());
 
-    if (!tun_set_ip(fd, ip, ip & 0xffffff00, 0xffffff00))
+    if (!tun_set_ip(fd, ip, ip & netmask, netmask))
         syslog(LOG_ERR, "could not set tun device driver ip address: %s", tun_last_error());
 #elif LINUX
-    cmdline << "/sbin/ifconfig " << device << " " << ips << " netmask 255.255.255.0";
+    cmdline << "/sbin/ifconfig " << device << " " << ips << " netmask " << netmasks;
     if (system(cmdline.str().data()) != 0)
         syslog(LOG_ERR, "could not set tun device ip address");
 #else
@@ -115,25 +169,217 @@ void Tun::setIp(uint32_t ip, uint32_t destIp)
 
 void Tun::write(const char *buffer, int length)
 {
+#ifdef LINUX
+    if (frameHeader)
+    {
+        VnetHeader header;
+        memset(&header, 0, sizeof(header)); // not segmented, checksum verified
+
+        struct iovec iov[2];
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = (char *)buffer;
+        iov[1].iov_len = length;
+
+        if (writev(fd, iov, 2) == -1)
+            syslog(LOG_ERR, "error writing %d bytes to tun: %s", length, strerror(errno));
+        return;
+    }
+#endif
     if (tun_write(fd, (char *)buffer, length) == -1)
         syslog(LOG_ERR, "error writing %d bytes to tun: %s", length, tun_last_error());
 }
 
+void Tun::writeFrame(const char *frame, int length)
+{
+    if (tun_write(fd, (char *)frame, length) == -1)
+        syslog(LOG_ERR, "error writing %d bytes to tun: %s", length, tun_last_error());
+}
+
 int Tun::read(char *buffer)
 {
+    if (frameHeader)
+    {
+        while (true)
+        {
+            int length = nextPacket(buffer);
+            if (length != -1)
+                return length;
+
+            length = tun_read(fd, &readBuffer[0], readBuffer.size());
+            if (length == -1)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    syslog(LOG_ERR, "error reading from tun: %s", tun_last_error());
+                return -1;
+            }
+            setFrame(&readBuffer[0], length);
+        }
+    }
+
     int length = tun_read(fd, buffer, mtu);
     if (length == -1)
+    {
+#ifndef WIN32
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
+#endif
         syslog(LOG_ERR, "error reading from tun: %s", tun_last_error());
+    }
+    return length;
+}
+
+void Tun::setFrame(const char *frame, int length)
+{
+    this->frame = frame;
+    frameLength = length;
+    segmentSize = 0;
+    segmentOffset = 0;
+    segmentIndex = 0;
+
+#ifdef LINUX
+    if (length < frameHeader + (int)sizeof(IpHeader))
+    {
+        this->frame = NULL;
+        return;
+    }
+
+    VnetHeader header;
+    memcpy(&header, frame, sizeof(header));
+    char *packet = (char *)frame + frameHeader;
+    int packetLength = length - frameHeader;
+
+    /* the stack left the transport checksum to us: the field holds the pseudo
+       header sum, the rest is summed from csumStart on. Segments of a
+       super-packet get theirs computed in full. */
+    if ((header.flags & VNET_F_NEEDS_CSUM) && header.gsoType == VNET_GSO_NONE &&
+        header.csumStart + header.csumOffset + 2 <= packetLength)
+    {
+        uint16_t sum = htons(Checksum::fold(Checksum::add(0, packet + header.csumStart,
+                                                      packetLength - header.csumStart)));
+        memcpy(packet + header.csumStart + header.csumOffset, &sum, 2);
+    }
+
+    switch (header.gsoType & ~VNET_GSO_ECN)
+    {
+        case VNET_GSO_NONE:
+            break;
+        case VNET_GSO_TCPV4:
+        {
+            const IpHeader *ip = (const IpHeader *)packet;
+            int ipLength = ip->ip_hl * 4;
+            if (packetLength < ipLength + 20)
+            {
+                this->frame = NULL;
+                return;
+            }
+            segmentHeader = ipLength + ((unsigned char)packet[ipLength + 12] >> 4) * 4;
+            segmentSize = header.gsoSize;
+            if (segmentSize == 0 || segmentHeader + segmentSize > mtu || segmentHeader >= packetLength)
+            {
+                syslog(LOG_WARNING, "dropping tcp super-packet with segment size %d", segmentSize);
+                this->frame = NULL;
+            }
+            break;
+        }
+        default:
+            syslog(LOG_WARNING, "dropping tunnel super-packet of gso type %d", header.gsoType);
+            this->frame = NULL;
+            break;
+    }
+#endif
+}
+
+int Tun::nextPacket(char *buffer)
+{
+    if (!frame)
+        return -1;
+
+    if (segmentSize)
+        return nextSegment(buffer);
+
+    const char *packet = frame + frameHeader;
+    int length = packetInPlace();
+    if (length != -1)
+        memcpy(buffer, packet, length);
     return length;
 }
 
+int Tun::packetInPlace()
+{
+    if (!frame)
+        return -1;
+
+    int length = frameLength - frameHeader;
+    frame = NULL;
+
+    if (length > mtu)
+    {
+        syslog(LOG_WARNING, "dropping %d byte tunnel packet larger than the mtu", length);
+        return -1;
+    }
+    return length;
+}
+
+/* Cut the next mss-sized segment off a TCP super-packet: its headers are the
+ * super-packet's with length, id, sequence number, flags and both checksums
+ * adjusted. */
+int Tun::nextSegment(char *buffer)
+{
+    const char *packet = frame + frameHeader;
+    int payloadLength = frameLength - frameHeader - segmentHeader;
+    int length = payloadLength - segmentOffset;
+    if (length > segmentSize)
+        length = segmentSize;
+    bool last = segmentOffset + length >= payloadLength;
+
+    memcpy(buffer, packet, segmentHeader);
+    uint32_t payloadSum = Checksum::copy(buffer + segmentHeader, packet + segmentHeader + segmentOffset, length);
+
+    IpHeader *ip = (IpHeader *)buffer;
+    int ipLength = ip->ip_hl * 4;
+    ip->ip_len = htons(segmentHeader + length);
+    ip->ip_id = htons(ntohs(ip->ip_id) + segmentIndex);
+    ip->ip_sum = 0;
+    ip->ip_sum = htons(Checksum::fold(Checksum::add(0, buffer, ipLength)));
+
+    char *tcp = buffer + ipLength;
+    int tcpLength = segmentHeader - ipLength + length;
+    uint32_t seq;
+    memcpy(&seq, tcp + 4, 4);
+    seq = htonl(ntohl(seq) + segmentOffset);
+    memcpy(tcp + 4, &seq, 4);
+
+    unsigned char &flags = (unsigned char &)tcp[13];
+    if (!last)
+        flags &= ~0x09; // FIN, PSH
+    if (segmentIndex > 0)
+        flags &= ~0x80; // CWR
+
+    tcp[16] = tcp[17] = 0;
+    uint32_t sum = Checksum::addPseudoHeader(0, (const char *)&ip->ip_src, IPPROTO_TCP, tcpLength);
+    sum = Checksum::add(sum, tcp, segmentHeader - ipLength) + payloadSum; // headers are whole words
+    uint16_t tcpSum = htons(Checksum::fold(sum));
+    memcpy(tcp + 16, &tcpSum, 2);
+
+    segmentOffset += length;
+    segmentIndex++;
+    if (last)
+        frame = NULL;
+
+    return segmentHeader + length;
+}
+
 int Tun::read(char *buffer, uint32_t &sourceIp, uint32_t &destIp)
 {
     int length = read(buffer);
+    addresses(buffer, sourceIp, destIp);
+    return length;
+}
 
-    IpHeader *header = (IpHeader *)buffer;
+void Tun::addresses(const char *packet, uint32_t &sourceIp, uint32_t &destIp)
+{
+    const IpHeader *header = (const IpHeader *)packet;
     sourceIp = ntohl(header->ip_src.s_addr);
     destIp = ntohl(header->ip_dst.s_addr);
-
-    return length;
 }
@@ -23,27 +23,90 @@
 #include "tun_dev.h"
 
 #include <string>
+#include <vector>
 #include <stdint.h>
 
 class Tun
 {
 public:
-    Tun(const std::string *device, int mtu);
+    enum Queue
+    {
+        SINGLE_QUEUE,   // ordinary device
+        FIRST_QUEUE,    // create a multi-queue device (Linux)
+        ATTACH_QUEUE    // open one more queue of an existing multi-queue device
+    };
+
+    Tun(const std::string *device, int mtu, Queue queue = SINGLE_QUEUE);
     ~Tun();
 
     int getFd() { return fd; }
+    const std::string &getDevice() const { return device; }
 
+    /* Read the next packet of at most mtu bytes. With offloads a read of the device
+     * may return a TCP super-packet, which is handed out one segment per call. */
     int read(char *buffer);
     int read(char *buffer, uint32_t &sourceIp, uint32_t &destIp);
+    static void addresses(const char *packet, uint32_t &sourceIp, uint32_t &destIp);
+
+    /* A frame is what one read of the device returns: frameHeaderSize() bytes of
+     * virtio-net header (with offloads) and a packet. Frames read elsewhere are
+     * split with setFrame() and nextPacket(), which returns -1 once the frame is
+     * used up; the frame has to stay in place until then. */
+    /* struct virtio_net_hdr, the frame header with offloads. <linux/virtio_net.h>
+     * does not compile as C++. Fields are in host byte order. */
+    struct VnetHeader
+    {
+        uint8_t flags;
+        uint8_t gsoType;
+        uint16_t headerLength;
+        uint16_t gsoSize;
+        uint16_t csumStart;
+        uint16_t csumOffset;
+    };
+
+    enum
+    {
+        VNET_F_NEEDS_CSUM = 1,
+        VNET_GSO_NONE = 0,
+        VNET_GSO_TCPV4 = 1,
+        VNET_GSO_ECN = 0x80
+    };
+
+    int frameSize() const { return frameHeader + (frameHeader ? MAX_SUPER_PACKET : mtu); }
+    int frameHeaderSize() const { return frameHeader; }
+    void setFrame(const char *frame, int length);
+    int nextPacket(char *buffer);
+    /* Whether the frame holds a super-packet, which only nextPacket() cuts up. */
+    bool segmenting() const { return frame && segmentSize; }
+    /* Hand out the packet of a frame that does not, without a copy: it starts
+     * frameHeaderSize() bytes into the frame. Returns its length, -1 once the
+     * frame is used up. */
+    int packetInPlace();
 
     void write(const char *buffer, int length);
+    void writeFrame(const char *frame, int length); // header included
 
-    void setIp(uint32_t ip, uint32_t destIp);
+    /* Point-to-point to `destIp` where the device can't take a network. */
+    void setIp(uint32_t ip, uint32_t destIp, int prefixLength = 24);
 protected:
+    enum { MAX_SUPER_PACKET = 65535 };
+
+    bool openOffloaded(Queue queue);
+    int nextSegment(char *buffer);
+
     std::string device;
 
     int mtu;
     int fd;
+    int frameHeader; // virtio-net header size, 0 without offloads
+
+    std::vector<char> readBuffer;
+    const char *frame;    // frame being split, NULL if none
+    int frameLength;
+    int segmentHeader;    // IP and TCP header length of a super-packet
+    int segmentSize;      // TCP payload per segment
+    int segmentOffset;    // payload handed out so far
+    int segmentIndex;
 };
 
 #endif
@@ -41,6 +41,11 @@ extern "C" {
     int tun_read(int fd, char *buf, int len);
     const char *tun_last_error();
 
+#ifdef LINUX
+    int tun_open_features(char *dev, int multi_queue, int vnet_hdr);
+    int tun_set_offload(int fd);
+#endif
+
 #ifdef WIN32
     bool tun_set_ip(int fd, uint32_t local, uint32_t network, uint32_t netmask);
 #endif
@@ -82,21 +82,21 @@ static int tun_open_common0(char *dev, int istun)
 #define OTUNSETOWNER   (('T'<< 8) | 204)
 #endif
 
-static int tun_open_common(char *dev, int istun)
+static int tun_open_common(char *dev, int istun, int flags)
 {
     struct ifreq ifr;
     int fd;
 
     if ((fd = open("/dev/net/tun", O_RDWR)) < 0)
-       return tun_open_common0(dev, istun);
+       return flags ? -1 : tun_open_common0(dev, istun);
 
     memset(&ifr, 0, sizeof(ifr));
-    ifr.ifr_flags = (istun ? IFF_TUN : IFF_TAP) | IFF_NO_PI;
+    ifr.ifr_flags = (istun ? IFF_TUN : IFF_TAP) | IFF_NO_PI | flags;
     if (*dev)
        strncpy(ifr.ifr_name, dev, IFNAMSIZ);
 
     if (ioctl(fd, TUNSETIFF, (void *) &ifr) < 0) {
-       if (errno == EBADFD) {
+       if (errno == EBADFD && !flags) {
       /* Try old ioctl */
        if (ioctl(fd, OTUNSETIFF, (void *) &ifr) < 0) 
          goto failed;
@@ -114,12 +114,54 @@ failed:
 
 #else
 
-# define tun_open_common(dev, type) tun_open_common0(dev, type)
+# define tun_open_common(dev, type, flags) tun_open_common0(dev, type)
 
 #endif /* New driver support */
 
-int tun_open(char *dev) { return tun_open_common(dev, 1); }
-int tap_open(char *dev) { return tun_open_common(dev, 0); }
+int tun_open(char *dev) { return tun_open_common(dev, 1, 0); }
+int tap_open(char *dev) { return tun_open_common(dev, 0, 0); }
+
+/* 
+ * Allocate TUN device with Linux-only features: as one queue of a multi-queue
+ * device (the first call creates it, later calls with the same name attach
+ * further queues), and/or with a virtio-net header in front of every packet.
+ */  
+int tun_open_features(char *dev, int multi_queue, int vnet_hdr)
+{
+#ifdef HAVE_LINUX_IF_TUN_H
+    int flags = vnet_hdr ? IFF_VNET_HDR : 0;
+
+    if (multi_queue) {
+#ifdef IFF_MULTI_QUEUE
+       flags |= IFF_MULTI_QUEUE;
+#else
+       errno = EOPNOTSUPP;
+       return -1;
+#endif
+    }
+    return tun_open_common(dev, 1, flags);
+#else
+    if (multi_queue || vnet_hdr) {
+       errno = EOPNOTSUPP;
+       return -1;
+    }
+    return tun_open(dev);
+#endif
+}
+
+/* 
+ * Let the device hand over TCP super-packets and packets with checksums
+ * still to be filled in. Needs the virtio-net header.
+ */  
+int tun_set_offload(int fd)
+{
+#if defined(HAVE_LINUX_IF_TUN_H) && defined(TUNSETOFFLOAD)
+    return ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO_ECN);
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
 
 int tun_close(int fd, char *dev) { return close(fd); }
 int tap_close(int fd, char *dev) { return close(fd); }
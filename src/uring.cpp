@@ -0,0 +1,231 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include "exception.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* probe room for every opcode the kernel may report */
+#define PROBE_OPS 256
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, const void *arg, unsigned int count)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+Uring::Uring(unsigned int entries, unsigned int completionEntries)
+    : ringMemory(MAP_FAILED), sqes((struct io_uring_sqe *)MAP_FAILED), probe(NULL),
+      bufferRing(NULL), bufferRingSize(0)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = completionEntries;
+
+    fd = io_uring_setup(entries, &params);
+    if (fd == -1)
+        throw Exception("io_uring_setup", true);
+    features = params.features;
+
+    if (!(features & IORING_FEAT_SINGLE_MMAP) || !(features & IORING_FEAT_NODROP))
+    {
+        close(fd);
+        throw Exception("io_uring: kernel too old");
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ringSize = sqSize > cqSize ? sqSize : cqSize;
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ringMemory = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ringMemory != MAP_FAILED)
+        sqes = (struct io_uring_sqe *)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ringMemory == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        Exception e("io_uring mmap", true);
+        if (ringMemory != MAP_FAILED)
+            munmap(ringMemory, ringSize);
+        close(fd);
+        throw e;
+    }
+
+    char *ring = (char *)ringMemory;
+    sqHead = (unsigned int *)(ring + params.sq_off.head);
+    sqTail = (unsigned int *)(ring + params.sq_off.tail);
+    sqMask = *(unsigned int *)(ring + params.sq_off.ring_mask);
+    sqArray = (unsigned int *)(ring + params.sq_off.array);
+    sqLocalTail = *sqTail;
+    sqSubmitted = sqLocalTail;
+
+    cqHead = (unsigned int *)(ring + params.cq_off.head);
+    cqTail = (unsigned int *)(ring + params.cq_off.tail);
+    cqMask = *(unsigned int *)(ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    /* submission slots map one-to-one to entries, so the index array never changes */
+    for (unsigned int i = 0; i <= sqMask; i++)
+        sqArray[i] = i;
+
+    size_t probeSize = sizeof(struct io_uring_probe) + PROBE_OPS * sizeof(struct io_uring_probe_op);
+    probe = (struct io_uring_probe *)calloc(1, probeSize);
+    if (probe && io_uring_register(fd, IORING_REGISTER_PROBE, probe, PROBE_OPS) == -1)
+    {
+        free(probe);
+        probe = NULL;
+    }
+}
+
+Uring::~Uring()
+{
+    if (bufferRing)
+        munmap(bufferRing, bufferRingSize);
+    free(probe);
+    munmap(sqes, sqesSize);
+    munmap(ringMemory, ringSize);
+    close(fd);
+}
+
+bool Uring::supports(int opcode) const
+{
+    if (!probe || opcode > probe->last_op)
+        return false;
+    return (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+}
+
+struct io_uring_sqe *Uring::getSqe()
+{
+    if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > sqMask)
+    {
+        submit(0);
+        if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > sqMask)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &sqes[sqLocalTail & sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqLocalTail++;
+    return sqe;
+}
+
+void Uring::submit(unsigned int waitFor)
+{
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+
+    unsigned int toSubmit = sqLocalTail - sqSubmitted;
+    if (toSubmit == 0 && waitFor == 0)
+        return;
+
+    int result;
+    do
+        result = io_uring_enter(fd, toSubmit, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0);
+    while (result == -1 && errno == EINTR && waitFor == 0);
+
+    if (result == -1)
+    {
+        /* a signal ends the wait early; the caller simply finds fewer completions */
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            return;
+        throw Exception("io_uring_enter", true);
+    }
+    sqSubmitted += result;
+}
+
+struct io_uring_cqe *Uring::peekCqe()
+{
+    unsigned int head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &cqes[head & cqMask];
+}
+
+void Uring::seenCqe()
+{
+    __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+}
+
+bool Uring::registerBuffers(const struct iovec *buffers, int count)
+{
+    return io_uring_register(fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+}
+
+bool Uring::setupBufferRing(uint16_t group, char *base, unsigned int size, unsigned int count)
+{
+    bufferRingSize = count * sizeof(struct io_uring_buf);
+    void *memory = mmap(NULL, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return false;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)memory;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (io_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        munmap(memory, bufferRingSize);
+        return false;
+    }
+
+    bufferRing = (struct io_uring_buf *)memory;
+    bufferBase = base;
+    bufferSize = size;
+    bufferMask = count - 1;
+    bufferTail = 0;
+
+    for (unsigned int i = 0; i < count; i++)
+        provideBuffer(i);
+    commitBuffers();
+    return true;
+}
+
+void Uring::provideBuffer(uint16_t id)
+{
+    struct io_uring_buf *buffer = &bufferRing[bufferTail & bufferMask];
+    buffer->addr = (uintptr_t)(bufferBase + (size_t)id * bufferSize);
+    buffer->len = bufferSize;
+    buffer->bid = id;
+    bufferTail++;
+}
+
+void Uring::commitBuffers()
+{
+    __atomic_store_n(&bufferRing[0].resv, bufferTail, __ATOMIC_RELEASE);
+}
+
+#endif
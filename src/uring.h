@@ -0,0 +1,97 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+/* multishot recvmsg (Linux 6.0) is the newest interface the io_uring engine relies on */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_RECV_MULTISHOT)
+#define HAVE_IO_URING
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Minimal io_uring binding on the raw system calls: submission and completion rings,
+ * fixed buffers and one provided-buffer ring for buffer-selecting receives. */
+class Uring
+{
+public:
+    Uring(unsigned int entries, unsigned int completionEntries);
+    ~Uring();
+
+    int getFd() { return fd; }
+
+    bool supports(int opcode) const;
+
+    /* Cleared submission entry; when the queue is full the pending entries are submitted first. */
+    struct io_uring_sqe *getSqe();
+    /* Submit all pending entries and wait until `waitFor` completions are available. */
+    void submit(unsigned int waitFor);
+
+    struct io_uring_cqe *peekCqe();
+    void seenCqe();
+
+    bool registerBuffers(const struct iovec *buffers, int count);
+
+    /* Provide `count` (a power of two) buffers of `size` bytes starting at `base` as buffer group `group`. */
+    bool setupBufferRing(uint16_t group, char *base, unsigned int size, unsigned int count);
+    void provideBuffer(uint16_t id);
+    void commitBuffers();
+
+protected:
+    int fd;
+    unsigned int features;
+
+    void *ringMemory;
+    size_t ringSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    unsigned int *sqHead;
+    unsigned int *sqTail;
+    unsigned int sqMask;
+    unsigned int *sqArray;
+    unsigned int sqLocalTail;
+    unsigned int sqSubmitted;
+
+    unsigned int *cqHead;
+    unsigned int *cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_probe *probe;
+
+    /* struct io_uring_buf_ring misplaces its entries when compiled as C++ (the
+     * flexible array macro adds a one-byte member), so the ring is addressed as a
+     * plain array with the tail in the resv field of entry 0 */
+    struct io_uring_buf *bufferRing;
+    size_t bufferRingSize;
+    char *bufferBase;
+    unsigned int bufferSize;
+    unsigned int bufferMask;
+    uint16_t bufferTail;
+};
+
+#endif
+
+#endif
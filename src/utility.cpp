@@ -43,6 +43,11 @@ std::string Utility::formatIp6(const struct in6_addr &ip6)
     return std::string(buf);
 }
 
+uint32_t Utility::netmask(int prefixLength)
+{
+    return prefixLength > 0 ? 0xffffffff << (32 - prefixLength) : 0;
+}
+
 int Utility::rand()
 {
     static bool init = false;
@@ -29,6 +29,7 @@ class Utility
 public:
     static std::string formatIp(uint32_t ip);
     static std::string formatIp6(const struct in6_addr &ip6);
+    static uint32_t netmask(int prefixLength); // host order
     static int rand();
 };
 
@@ -30,11 +30,156 @@
 #include <grp.h>
 #include <iostream>
 #include <errno.h>
+#include <signal.h>
+
+#ifdef HAVE_IO_URING
+#include <queue>
+#include <algorithm>
+#include <poll.h>
+#include <stdint.h>
+#endif
+
+#ifdef LINUX
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <pthread.h>
+
+#ifndef SO_PREFER_BUSY_POLL // Linux 5.11
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#endif
 
 using std::cout;
 using std::endl;
 
 const int Worker::RECV_BATCH_MAX = HANS_RECV_BATCH_MAX;
+const int Worker::SEND_BATCH_MAX = HANS_SEND_BATCH_MAX;
+const int Worker::TUN_BUDGET = HANS_TUN_BUDGET;
+const int Worker::TUN_BATCH_MAX = HANS_TUN_BATCH_MAX;
+const int Worker::ECHO_BUDGET = HANS_ECHO_BUDGET;
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring engine. Every ICMP socket keeps one multishot recvmsg posted that
+ * fills buffers from a provided-buffer ring, the tunnel keeps a number of reads
+ * posted into registered buffers, and tunnel writes and ICMP sends are queued as
+ * submissions. One io_uring_enter per loop iteration then submits the work of
+ * both devices and waits for completions.
+ */
+enum
+{
+    URING_ECHO = 1,
+    URING_ECHO6,
+    URING_TUN_READ,
+    URING_TUN_WRITE,
+    URING_SEND,
+    URING_TIMER,
+    URING_SIGNAL,
+    URING_WAKEUP,
+    URING_CANCEL
+};
+
+#define URING_RECV_GROUP 0
+
+struct Worker::UringState
+{
+    struct Send
+    {
+        struct msghdr msg;
+        struct iovec iov[2]; // the headers, copied, and the payload in place
+        struct sockaddr_storage address;
+        char control[MsgBatch::TXTIME_CONTROL_SIZE];
+        uint32_t flush;      // the number of the flush that queued it
+    };
+
+    /* The buffers the sends of one flush may refer to: packet pool and pacer
+     * slots, and tunnel reads handled in place. They are given back once all
+     * those sends have completed. */
+    struct Flush
+    {
+        Flush() : sends(0) { }
+
+        int sends;
+        std::vector<int> poolSlots;
+        std::vector<int> paceSlots;
+        std::vector<int> tunReads;
+    };
+
+    UringState(int tunReadSize, int tunWriteSize, int sendBufferSize, int recvBufferSize)
+        : ring(512, 4096),
+          fixedBuffers(false),
+          inFlight(0),
+          tunReadSize(tunReadSize),
+          tunWriteSize(tunWriteSize),
+          tunBuffers(HANS_URING_TUN_READS * tunReadSize + HANS_URING_TUN_WRITES * tunWriteSize),
+          tunFrame(-1),
+          recvBufferSize(recvBufferSize),
+          recvBuffers(HANS_URING_RECV_BUFFERS * recvBufferSize),
+          sends(HANS_URING_SENDS),
+          sendBufferSize(sendBufferSize),
+          sendBuffers(HANS_URING_SENDS * sendBufferSize),
+          firstFlush(0)
+    {
+        echoArmed[0] = echoArmed[1] = false;
+        memset(&recvMsg, 0, sizeof(recvMsg));
+        recvMsg.msg_namelen = sizeof(struct sockaddr_in6);
+
+        for (int i = 0; i < HANS_URING_TUN_WRITES; i++)
+            tunWriteFree.push_back(HANS_URING_TUN_READS + i);
+        for (int i = 0; i < HANS_URING_SENDS; i++)
+            sendFree.push_back(i);
+    }
+
+    char *tunBuffer(int index)
+    {
+        if (index < HANS_URING_TUN_READS)
+            return &tunBuffers[index * tunReadSize];
+        return &tunBuffers[HANS_URING_TUN_READS * tunReadSize + (index - HANS_URING_TUN_READS) * tunWriteSize];
+    }
+    int tunBufferSize(int index) const { return index < HANS_URING_TUN_READS ? tunReadSize : tunWriteSize; }
+    char *recvBuffer(int id) { return &recvBuffers[id * recvBufferSize]; }
+    char *sendBuffer(int index) { return &sendBuffers[index * sendBufferSize]; }
+
+    Uring ring;
+    bool fixedBuffers;
+    int inFlight;           // requests that will still complete
+
+    /* tunnel reads (first HANS_URING_TUN_READS buffers, one device frame each) and writes */
+    int tunReadSize;
+    int tunWriteSize;
+    std::vector<char> tunBuffers;
+    std::queue<std::pair<int, int> > tunCompleted; // buffer, length
+    int tunFrame;                                  // read buffer being split into packets, -1 if none
+    std::vector<int> tunWriteFree;
+    std::vector<int> tunDone;                      // read buffers split up since the last flush
+
+    /* multishot echo receives */
+    int recvBufferSize;
+    std::vector<char> recvBuffers;
+    struct msghdr recvMsg;
+    std::vector<uint16_t> recvUsed; // handed back once their batch is dispatched
+    bool echoArmed[2];
+
+    /* echo sends keep a copy of the datagram's headers until they complete */
+    std::vector<Send> sends;
+    int sendBufferSize;
+    std::vector<char> sendBuffers;
+    std::vector<int> sendFree;
+    std::deque<Flush> flushes; // oldest first, while sends of theirs are in flight
+    uint32_t firstFlush;       // the number of flushes.front()
+
+    /* completions taken off the ring while waiting for sends, for reapUring */
+    std::deque<struct io_uring_cqe> deferred;
+};
+
+static uint64_t uringTag(int kind, int index)
+{
+    return ((uint64_t)kind << 32) | (uint32_t)index;
+}
+#endif
 
 Worker::TunnelHeader::Magic::Magic(const char *magic)
 {
@@ -55,22 +200,116 @@ bool Worker::TunnelHeader::Magic::operator!=(const Magic &other) const
 Worker::Worker(int tunnelMtu, const std::string *deviceName, bool answerEcho,
                uid_t uid, gid_t gid,
                int recvBufSize, int sndBufSize, int rateKbps,
-               bool useIPv4, bool useIPv6)
-    : echo(useIPv4 ? new Echo(tunnelMtu + sizeof(TunnelHeader), recvBufSize, sndBufSize) : NULL),
-      echo6(useIPv6 ? new Echo6(tunnelMtu + sizeof(TunnelHeader), recvBufSize, sndBufSize) : NULL),
-      currentRecvFrom6(false),
-      tun(deviceName, tunnelMtu),
-      pacer(rateKbps > 0 ? rateKbps : 0, 4500)
+               bool useIPv4, bool useIPv6, bool useUring, const std::string *ringDevice,
+               Tun::Queue tunQueue)
+    : echo(useIPv4 ? new Echo(payloadBufferSize(tunnelMtu) + sizeof(TunnelHeader), recvBufSize, sndBufSize,
+                                    RECV_BATCH_MAX, SEND_BATCH_MAX) : NULL),
+      echo6(useIPv6 ? new Echo6(payloadBufferSize(tunnelMtu) + sizeof(TunnelHeader), recvBufSize, sndBufSize,
+                                      RECV_BATCH_MAX, SEND_BATCH_MAX) : NULL),
+      currentRecvPayload(NULL),
+      tunReadable(false),
+      echoReadable(false),
+      echo6Readable(false),
+      wakeReadable(false),
+      tunQuota(0),
+      tunPackets(0),
+      tun(deviceName, tunnelMtu, tunQueue),
+      pacer(rateKbps > 0 ? rateKbps : 0, std::max(4500, payloadBufferSize(tunnelMtu) + (int)sizeof(TunnelHeader))),
+      congestion(HANS_CC_INITIAL_RATE, rateKbps > 0 ? rateKbps : 0, HANS_CC_LOSS_THRESHOLD),
+      pool(2 * SEND_BATCH_MAX + (useUring ? HANS_URING_SENDS : 0), payloadBufferSize(tunnelMtu)),
+      paceSlots(0, payloadBufferSize(tunnelMtu) + sizeof(TunnelHeader))
 {
     this->tunnelMtu = tunnelMtu;
     this->answerEcho = answerEcho;
+    alive = 1; // here rather than in run(): a shard may be stopped before it starts
     this->uid = uid;
     this->gid = gid;
     this->privilegesDropped = false;
+    this->useUring = useUring;
+    this->timeoutTimer = TimerWheel::NONE;
+    this->kernelPacing = false;
+    this->congestionControl = false;
+#ifdef HAVE_IO_URING
+    this->uringState = NULL;
+#endif
+
+    /* the io_uring engine receives from the raw socket */
+    if (echo && ringDevice && echo->openPacketRing(*ringDevice) && useUring)
+    {
+        syslog(LOG_WARNING, "io_uring is not used together with packet rings");
+        this->useUring = false;
+    }
+
+    gro = NULL;
+    if (tun.frameHeaderSize() && HANS_GRO_FLOWS > 0)
+        gro = new Gro(HANS_GRO_FLOWS, tun.frameHeaderSize());
+
+    /* one tunnel packet per queued datagram of both sockets */
+    poolSent.reserve(pool.size());
+    pooled = 0;
+    poolReserved = 0;
+    tunSlot = -1;
+    tunPayload = pool.data(0);
+
+    received.resize(RECV_BATCH_MAX);
+    receivedKeys.resize(RECV_BATCH_MAX);
+    receivedRanks.resize(RECV_BATCH_MAX);
+    receivedOrder.resize(RECV_BATCH_MAX);
+
+#ifdef LINUX
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd == -1)
+        throw Exception("eventfd", true);
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1)
+        syslog(LOG_WARNING, "epoll_create1: %s, using select", strerror(errno));
+
+    timerFd = -1;
+    signalFd = -1;
+    if (epollFd != -1)
+    {
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timerFd == -1)
+            throw Exception("timerfd_create", true);
+
+        sigemptyset(&handledSignals);
+        sigaddset(&handledSignals, SIGTERM);
+        sigaddset(&handledSignals, SIGINT);
+        sigaddset(&handledSignals, SIGUSR1);
+        signalFd = signalfd(-1, &handledSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (signalFd == -1)
+            syslog(LOG_WARNING, "signalfd: %s, using signal handlers", strerror(errno));
+
+        watch(tun.getFd());
+        if (echo)
+            watch(echo->getFd());
+        if (echo6)
+            watch(echo6->getFd());
+        watch(timerFd);
+        if (signalFd != -1)
+            watch(signalFd);
+        watch(wakeFd);
+    }
+#endif
 }
 
 Worker::~Worker()
 {
+#ifdef HAVE_IO_URING
+    delete uringState;
+#endif
+#ifdef LINUX
+    if (signalFd != -1)
+        close(signalFd);
+    if (timerFd != -1)
+        close(timerFd);
+    if (epollFd != -1)
+        close(epollFd);
+    close(wakeFd);
+#endif
+
+    delete gro;
     delete echo;
     echo = NULL;
     delete echo6;
@@ -78,7 +317,8 @@ Worker::~Worker()
 }
 
 bool Worker::sendEcho(const TunnelHeader::Magic &magic, TunnelHeader::Type type,
-                      int length, uint32_t realIp, bool reply, uint16_t id, uint16_t seq)
+                      int length, uint32_t realIp, bool reply, uint16_t id, uint16_t seq,
+                      const char *payload)
 {
     if (!echo)
         return false;
@@ -86,11 +326,15 @@ bool Worker::sendEcho(const TunnelHeader::Magic &magic, TunnelHeader::Type type,
         throw Exception("packet too big");
 
     int totalLen = length + sizeof(TunnelHeader);
-    if (!pacer.allowSend(totalLen))
+    Time departure = Time::ZERO;
+    if (kernelPacing)
     {
-        stats.incDroppedSendFail();
-        return false;
+        if (!scheduleDeparture(totalLen, departure))
+            return false;
     }
+    else if (!paced.empty() || !pacer.allowSend(totalLen))
+        return pace(magic, type, length, realIp, NULL, reply, id, seq,
+                    payload ? payload : echoSendPayloadBuffer());
 
     TunnelHeader *header = (TunnelHeader *)echo->sendPayloadBuffer();
     header->magic = magic;
@@ -100,17 +344,23 @@ bool Worker::sendEcho(const TunnelHeader::Magic &magic, TunnelHeader::Type type,
         cout << "sending: type " << type << ", length " << length
              << ", id " << id << ", seq " << seq << endl);
 
-    if (!echo->send(totalLen, realIp, reply, id, seq))
+    bool queued = payload ? echo->send(sizeof(TunnelHeader), realIp, reply, id, seq, payload, length)
+                          : echo->send(totalLen, realIp, reply, id, seq);
+    if (!queued)
     {
         stats.incDroppedSendFail();
         return false;
     }
-    stats.incPacketsSent(totalLen);
+    if (now < departure)
+        echo->setDeparture(departure);
+    if (echo->sendQueueFull())
+        flushEcho();
     return true;
 }
 
 bool Worker::sendEcho6(const TunnelHeader::Magic &magic, TunnelHeader::Type type,
-                       int length, const struct in6_addr &realIp, bool reply, uint16_t id, uint16_t seq)
+                       int length, const struct in6_addr &realIp, bool reply, uint16_t id, uint16_t seq,
+                       const char *payload)
 {
     if (!echo6)
         return false;
@@ -118,28 +368,313 @@ bool Worker::sendEcho6(const TunnelHeader::Magic &magic, TunnelHeader::Type type
         throw Exception("packet too big");
 
     int totalLen = length + sizeof(TunnelHeader);
-    if (!pacer.allowSend(totalLen))
+    Time departure = Time::ZERO;
+    if (kernelPacing)
     {
-        stats.incDroppedSendFail();
-        return false;
+        if (!scheduleDeparture(totalLen, departure))
+            return false;
     }
+    else if (!paced.empty() || !pacer.allowSend(totalLen))
+        return pace(magic, type, length, 0, &realIp, reply, id, seq,
+                    payload ? payload : echoSendPayloadBuffer6());
 
     TunnelHeader *header = (TunnelHeader *)echo6->sendPayloadBuffer();
     header->magic = magic;
     header->type = type;
 
-    if (!echo6->send(totalLen, realIp, reply, id, seq))
+    bool queued = payload ? echo6->send(sizeof(TunnelHeader), realIp, reply, id, seq, payload, length)
+                          : echo6->send(totalLen, realIp, reply, id, seq);
+    if (!queued)
     {
         stats.incDroppedSendFail();
         return false;
     }
-    stats.incPacketsSent(totalLen);
+    if (now < departure)
+        echo6->setDeparture(departure);
+    if (echo6->sendQueueFull())
+        flushEcho();
+    return true;
+}
+
+/*
+ * With kernel pacing a packet over the rate is sent right away all the same,
+ * stamped with the time it may leave, and the fq qdisc holds it until then.
+ */
+bool Worker::scheduleDeparture(int length, Time &departure)
+{
+    if (!pacer.schedule(length, now + Time::fromMicroseconds(HANS_TXTIME_HORIZON * 1000), departure))
+    {
+        stats.incDroppedPaceBacklog();
+        return false;
+    }
+    if (now < departure)
+        stats.incPaced(0);
+    return true;
+}
+
+/*
+ * Packets over the pacing rate are copied to a slot of their own and wait in
+ * order for sendPaced() to let them go once the pacer allows. Everything sent
+ * while any wait queues up behind them.
+ */
+bool Worker::pace(const TunnelHeader::Magic &magic, TunnelHeader::Type type, int length,
+                  uint32_t realIp, const struct in6_addr *realIp6, bool reply, uint16_t id, uint16_t seq,
+                  const char *payload)
+{
+    if (paceSlots.size() == 0)
+        paceSlots.resize(HANS_PACE_BACKLOG + 2 * SEND_BATCH_MAX);
+
+    int slot = paced.size() < HANS_PACE_BACKLOG ? paceSlots.take() : -1;
+    if (slot == -1)
+    {
+        stats.incDroppedPaceBacklog();
+        return false;
+    }
+
+    char *data = paceSlots.data(slot);
+    TunnelHeader *header = (TunnelHeader *)data;
+    header->magic = magic;
+    header->type = type;
+    memcpy(data + sizeof(TunnelHeader), payload, length);
+
+    PacedEcho packet;
+    packet.slot = slot;
+    packet.length = length;
+    packet.isV6 = realIp6 != NULL;
+    packet.reply = reply;
+    packet.id = id;
+    packet.seq = seq;
+    packet.ip = realIp;
+    if (realIp6)
+        packet.ip6 = *realIp6;
+    paced.push_back(packet);
+    stats.incPaced(paced.size());
+
+    if (paced.size() == 1)
+    {
+        paceAt = pacer.departure(length + sizeof(TunnelHeader));
+        updateNextTimeout();
+    }
     return true;
 }
 
-void Worker::sendToTun(int length)
+void Worker::sendPaced()
+{
+    while (!paced.empty())
+    {
+        const PacedEcho &packet = paced.front();
+        if (!pacer.allowSend(packet.length + sizeof(TunnelHeader)))
+            break;
+
+        const char *data = paceSlots.data(packet.slot);
+        bool queued, full;
+        if (packet.isV6)
+        {
+            memcpy(echo6->sendPayloadBuffer(), data, sizeof(TunnelHeader));
+            queued = echo6->send(sizeof(TunnelHeader), packet.ip6, packet.reply, packet.id, packet.seq,
+                                 data + sizeof(TunnelHeader), packet.length);
+            full = echo6->sendQueueFull();
+        }
+        else
+        {
+            memcpy(echo->sendPayloadBuffer(), data, sizeof(TunnelHeader));
+            queued = echo->send(sizeof(TunnelHeader), packet.ip, packet.reply, packet.id, packet.seq,
+                                data + sizeof(TunnelHeader), packet.length);
+            full = echo->sendQueueFull();
+        }
+
+        if (queued)
+            paceSent.push_back(packet.slot);
+        else
+        {
+            stats.incDroppedSendFail();
+            paceSlots.release(packet.slot);
+        }
+        paced.pop_front();
+
+        if (full)
+            flushEcho();
+    }
+
+    paceAt = paced.empty() ? Time::ZERO : pacer.departure(paced.front().length + sizeof(TunnelHeader));
+    updateNextTimeout();
+}
+
+/*
+ * Packets queued by sendEcho/sendEcho6 are sent here, one sendmmsg per socket
+ * (or one submission each with io_uring). run() flushes before it waits for the
+ * next event, so a reply never waits longer than the event-loop iteration that
+ * produced it.
+ */
+void Worker::flushEcho()
+{
+    MsgBatch::SendResult result;
+    int echoTaken = 0, echo6Taken = 0;
+
+#ifdef HAVE_IO_URING
+    if (uringState)
+    {
+        if (echo)
+            echoTaken = queueUringSends(echo->getFd(), echo->sendQueue(), echo->sendQueueLength());
+        if (echo6)
+            echo6Taken = queueUringSends(echo6->getFd(), echo6->sendQueue(), echo6->sendQueueLength());
+    }
+#endif
+
+    /* whatever io_uring has no room for goes out with sendmmsg right away */
+    if (echo)
+        echo->flush(result, echoTaken);
+    if (echo6)
+        echo6->flush(result, echo6Taken);
+
+    stats.addPacketsSent(result.packets, result.bytes);
+    if (result.packets > 0 && wokenAt != Time::ZERO)
+    {
+        stats.addSendLatency((clockNow() - wokenAt).microseconds());
+        wokenAt = Time::ZERO;
+    }
+    stats.addDroppedSendFail(result.failed);
+    stats.addPartialSends(result.partial);
+
+#ifdef HAVE_IO_URING
+    if (uringState && holdForUringSends(echoTaken + echo6Taken))
+        return;
+#endif
+
+    /* nothing refers to them any more */
+    for (size_t i = 0; i < poolSent.size(); i++)
+        pool.release(poolSent[i]);
+    poolSent.clear();
+    for (size_t i = 0; i < paceSent.size(); i++)
+        paceSlots.release(paceSent[i]);
+    paceSent.clear();
+}
+
+/* Slots beyond those reserved for waiting packets are enough for the tunnel
+ * packets of both send queues, so after a flush one is always free, once the
+ * sends io_uring has in flight completed. */
+char *Worker::nextTunPayloadBuffer()
+{
+    tunSlot = pool.take();
+    if (tunSlot == -1)
+    {
+        flushEcho();
+        tunSlot = pool.take();
+    }
+#ifdef HAVE_IO_URING
+    while (tunSlot == -1 && uringState)
+    {
+        waitForUringSends();
+        tunSlot = pool.take();
+    }
+#endif
+    poolSent.push_back(tunSlot);
+    tunPayload = pool.data(tunSlot);
+    return tunPayload;
+}
+
+void Worker::releaseTunPayloadBuffer()
+{
+    poolSent.pop_back();
+    pool.release(tunSlot);
+}
+
+int Worker::poolTunPayload(int length)
+{
+    if (tunSlot == -1)
+        return poolCopy(tunPayload, length);
+    if (pooled == poolReserved)
+        return -1;
+    for (int i = poolSent.size() - 1; i >= 0; i--)
+        if (poolSent[i] == tunSlot)
+        {
+            poolSent.erase(poolSent.begin() + i);
+            break;
+        }
+    pooled++;
+    return tunSlot;
+}
+
+int Worker::poolCopy(const char *data, int length)
+{
+    if (pooled == poolReserved)
+        return -1;
+    int slot = pool.take();
+    if (slot == -1)
+        return -1;
+    memcpy(pool.data(slot), data, length);
+    pooled++;
+    return slot;
+}
+
+const char *Worker::sendPooled(int slot)
+{
+    pooled--;
+    poolSent.push_back(slot);
+    return pool.data(slot);
+}
+
+void Worker::dropPooled(int slot)
+{
+    pooled--;
+    pool.release(slot);
+}
+
+void Worker::reservePoolSlots(int packets)
+{
+    poolReserved = packets;
+    pool.resize(2 * SEND_BATCH_MAX + (useUring ? HANS_URING_SENDS : 0) + packets);
+    poolSent.reserve(pool.size());
+    tunPayload = pool.data(0);
+}
+
+void Worker::sendToTun(const char *packet, int length)
+{
+    if (gro)
+    {
+        bool held = gro->add(packet, length);
+        writeTunFrames();
+        if (held)
+            return;
+    }
+
+#ifdef HAVE_IO_URING
+    if (uringState && writeTunUring(packet, length))
+        return;
+#endif
+    tun.write(packet, length);
+}
+
+/*
+ * Segments are coalesced over one receive batch at most: the batch is flushed
+ * when it has been dispatched, before the loop goes on to anything else.
+ */
+void Worker::flushTun()
+{
+    if (!gro)
+        return;
+    gro->flush();
+    writeTunFrames();
+}
+
+void Worker::writeTunFrames()
 {
-    tun.write(echoReceivePayloadBuffer(), length);
+    const char *frame;
+    int length;
+    while ((frame = gro->nextReady(length)) != NULL)
+    {
+#ifdef HAVE_IO_URING
+        if (uringState)
+        {
+            if (writeTunUring(frame, length, true))
+                continue;
+            /* too large for a write buffer: written right away, after the
+               writes still queued in the ring */
+            uringState->ring.submit(0);
+        }
+#endif
+        tun.writeFrame(frame, length);
+    }
 }
 
 char *Worker::echoSendPayloadBuffer()
@@ -158,33 +693,116 @@ char *Worker::echoSendPayloadBuffer6()
 
 void Worker::setTimeout(Time delta)
 {
-    nextTimeout = now + delta;
+    if (timeoutTimer != TimerWheel::NONE)
+        timers.cancel(timeoutTimer);
+    timeoutTimer = timers.add(now, now + delta, TIMEOUT);
+    updateNextTimeout();
+}
+
+uint32_t Worker::addTimer(Time delta, uint32_t data)
+{
+    uint32_t timer = timers.add(now, now + delta, data);
+    updateNextTimeout();
+    return timer;
+}
+
+void Worker::cancelTimer(uint32_t timer)
+{
+    timers.cancel(timer);
+    updateNextTimeout();
+}
+
+/* The loop wakes up for the next timer or the departure of the next paced
+ * packet, whichever comes first. */
+void Worker::updateNextTimeout()
+{
+    nextTimeout = timers.next();
+    if (paceAt != Time::ZERO && (nextTimeout == Time::ZERO || paceAt < nextTimeout))
+        nextTimeout = paceAt;
+}
+
+Time Worker::clockNow()
+{
+    return HANS_COARSE_CLOCK ? Time::coarseNow() : Time::now();
+}
+
+void Worker::updateClock()
+{
+    now = clockNow();
+    pacer.refill(now);
 }
 
 void Worker::run()
 {
-    now = Time::now();
-    alive = true;
+    now = clockNow();
+
+    tunReadable = true;
+    echoReadable = echo != NULL;
+    echo6Readable = echo6 != NULL;
+#ifdef LINUX
+    wakeReadable = true;
+#endif
+
+#ifdef HAVE_IO_URING
+    if (useUring && timerFd != -1 && startUring())
+    {
+        bool finished = runUring();
+        flushEcho(); // what is queued may refer to the ring's buffers
+        stopUring();
+        if (finished)
+            return;
+    }
+#else
+    if (useUring)
+        syslog(LOG_WARNING, "io_uring is not supported by this build");
+#endif
+
+#ifdef LINUX
+    if (epollFd != -1)
+        runEpoll();
+    else
+        runSelect();
+#else
+    runSelect();
+#endif
+
+    flushEcho();
+}
 
+void Worker::runSelect()
+{
     int maxFd = tun.getFd();
     if (echo && echo->getFd() > maxFd)
         maxFd = echo->getFd();
     if (echo6 && echo6->getFd() > maxFd)
         maxFd = echo6->getFd();
+#ifdef LINUX
+    if (wakeFd > maxFd)
+        maxFd = wakeFd;
+#endif
 
     while (alive)
     {
         fd_set fs;
         Time timeout;
 
+        if (!paced.empty())
+            sendPaced();
+        flushEcho();
+
+        bool spinning = now < spinUntil;
+
         FD_ZERO(&fs);
         FD_SET(tun.getFd(), &fs);
         if (echo)
             FD_SET(echo->getFd(), &fs);
         if (echo6)
             FD_SET(echo6->getFd(), &fs);
+#ifdef LINUX
+        FD_SET(wakeFd, &fs);
+#endif
 
-        if (nextTimeout != Time::ZERO)
+        if (nextTimeout != Time::ZERO && !spinning)
         {
             timeout = nextTimeout - now;
             if (timeout < Time::ZERO)
@@ -192,143 +810,1215 @@ void Worker::run()
         }
 
         // wait for data or timeout
-        timeval *timeval = nextTimeout != Time::ZERO ? &timeout.getTimeval() : NULL;
-        int result = select(maxFd + 1 , &fs, NULL, NULL, timeval);
+        struct timeval tv = timeout.toTimeval();
+        int result = select(maxFd + 1 , &fs, NULL, NULL, nextTimeout != Time::ZERO || spinning ? &tv : NULL);
         if (result == -1)
         {
-            if (alive)
-                throw Exception("select", true);
-            else
-                return;
+            if (errno == EINTR)
+                continue;
+            throw Exception("select", true);
         }
-        now = Time::now();
-        pacer.refill(now);
+        updateClock();
+        wokenAt = now;
 
-        // timeout
-        if (result == 0)
+        if (result > 0 || spinning)
         {
-            nextTimeout = Time::ZERO;
-            handleTimeout();
-            continue;
+            tunReadable = spinning || FD_ISSET(tun.getFd(), &fs);
+            echoReadable = echo && (spinning || FD_ISSET(echo->getFd(), &fs));
+            echo6Readable = echo6 && (spinning || FD_ISSET(echo6->getFd(), &fs));
+#ifdef LINUX
+            uint64_t wakeups;
+            if (FD_ISSET(wakeFd, &fs) && read(wakeFd, &wakeups, sizeof(wakeups)) == sizeof(wakeups))
+                wakeReadable = true;
+#endif
+            if (serviceSources())
+                spinUntil = now + busyPollBudget;
         }
 
-        // icmp data (batch read up to RECV_BATCH_MAX)
-        if (echo && FD_ISSET(echo->getFd(), &fs))
-        {
-            int batchCount = 0;
-            while (batchCount < RECV_BATCH_MAX)
-            {
-                bool reply;
-                uint16_t id, seq;
-                uint32_t ip;
+        checkTimeout();
+    }
+}
 
-                currentRecvFrom6 = false;
-                int dataLength = echo->receive(ip, reply, id, seq);
-                if (dataLength == -1)
-                {
-#ifndef WIN32
-                    if (errno == EAGAIN || errno == EWOULDBLOCK)
-                        break;
-#endif
-                    break;
-                }
-                batchCount++;
-                stats.incPacketsReceived(dataLength);
-#ifdef WIN32
-                break;
-#endif
-                bool valid = dataLength >= sizeof(TunnelHeader);
+#ifdef LINUX
+/*
+ * Edge-triggered: a source is only reported again once new data arrives, so its
+ * ready flag stays set until a read finds it empty. While any flag is set the
+ * loop polls without blocking and carries on where the last budget ran out.
+ */
+void Worker::runEpoll()
+{
+    sigset_t oldSignals;
+    if (signalFd != -1)
+        pthread_sigmask(SIG_BLOCK, &handledSignals, &oldSignals);
 
-                if (valid)
-                {
-                    TunnelHeader *header = (TunnelHeader *)echo->receivePayloadBuffer();
+    while (alive)
+    {
+        if (!paced.empty())
+            sendPaced();
+        flushEcho();
 
-                    DEBUG_ONLY(
-                        cout << "received: type " << header->type
-                             << ", length " << dataLength - sizeof(TunnelHeader)
-                             << ", id " << id << ", seq " << seq << endl);
+        if (nextTimeout != armedTimeout)
+            armTimer();
 
-                    valid = handleEchoData(*header, dataLength - sizeof(TunnelHeader), ip, reply, id, seq);
-                }
+        bool busy = tunReadable || echoReadable || echo6Readable || wakeReadable;
+        bool spinning = !busy && now < spinUntil;
+        struct epoll_event events[8];
+        int count = epoll_wait(epollFd, events, 8, busy || spinning ? 0 : -1);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            throw Exception("epoll_wait", true);
+        }
+        updateClock();
+        wokenAt = now;
 
-                if (!valid && !reply && answerEcho)
-                {
-                    memcpy(echo->sendPayloadBuffer(), echo->receivePayloadBuffer(), dataLength);
-                    echo->send(dataLength, ip, true, id, seq);
-                }
-            }
+        /* busy polling: try every source instead of waiting to be told */
+        if (spinning)
+        {
+            tunReadable = true;
+            echoReadable = echo != NULL;
+            echo6Readable = echo6 != NULL;
         }
 
-        if (echo6 && FD_ISSET(echo6->getFd(), &fs))
+        for (int i = 0; i < count; i++)
         {
-            int batchCount = 0;
-            while (batchCount < RECV_BATCH_MAX)
+            int fd = events[i].data.fd;
+            if (fd == tun.getFd())
+                tunReadable = true;
+            else if (echo && fd == echo->getFd())
+                echoReadable = true;
+            else if (echo6 && fd == echo6->getFd())
+                echo6Readable = true;
+            else if (fd == timerFd)
             {
-                bool reply;
-                uint16_t id, seq;
-                struct in6_addr ip6;
-
-                currentRecvFrom6 = true;
-                int dataLength = echo6->receive(ip6, reply, id, seq);
-                if (dataLength == -1)
-                {
-#ifndef WIN32
-                    if (errno == EAGAIN || errno == EWOULDBLOCK)
-                        break;
-#endif
-                    break;
-                }
-                batchCount++;
-                stats.incPacketsReceived(dataLength);
-#ifdef WIN32
-                break;
-#endif
-                bool valid = dataLength >= sizeof(TunnelHeader);
-
-                if (valid)
-                {
-                    TunnelHeader *header = (TunnelHeader *)echo6->receivePayloadBuffer();
-
-                    valid = handleEchoData6(*header, dataLength - sizeof(TunnelHeader), ip6, reply, id, seq);
-                }
-
-                if (!valid && !reply && answerEcho)
-                {
-                    memcpy(echo6->sendPayloadBuffer(), echo6->receivePayloadBuffer(), dataLength);
-                    echo6->send(dataLength, ip6, true, id, seq);
-                }
+                uint64_t expirations;
+                if (read(timerFd, &expirations, sizeof(expirations)) == sizeof(expirations))
+                    armedTimeout = Time::ZERO; // re-armed above if the timeout is not due yet
+            }
+            else if (fd == signalFd)
+                handleSignals();
+            else if (fd == wakeFd)
+            {
+                uint64_t wakeups;
+                if (read(wakeFd, &wakeups, sizeof(wakeups)) == sizeof(wakeups))
+                    wakeReadable = true;
             }
         }
 
-        // data from tun
-        if (FD_ISSET(tun.getFd(), &fs))
-        {
-            uint32_t sourceIp, destIp;
-            char *sendBuf = echoSendPayloadBuffer();
-            if (!sendBuf)
-                sendBuf = echoSendPayloadBuffer6();
-            int dataLength = sendBuf ? tun.read(sendBuf, sourceIp, destIp) : -1;
-
-            if (dataLength == 0)
-                throw Exception("tunnel closed");
-
-            if (dataLength != -1)
-                handleTunData(dataLength, sourceIp, destIp);
-        }
+        if (serviceSources())
+            spinUntil = now + busyPollBudget;
+        checkTimeout();
     }
+
+    if (signalFd != -1)
+        pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
 }
 
-void Worker::stop()
+void Worker::watch(int fd)
 {
-    alive = false;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = fd;
+
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1)
+        throw Exception("epoll_ctl", true);
 }
 
-void Worker::dropPrivileges()
+void Worker::armTimer()
 {
-    if (uid <= 0 || privilegesDropped)
-        return;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
 
-#ifdef WIN32
+    if (nextTimeout != Time::ZERO)
+    {
+        Time delta = nextTimeout - now;
+        if (delta > Time::ZERO)
+            spec.it_value = delta.toTimespec();
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+            spec.it_value.tv_nsec = 1; // an all-zero value would disarm the timer
+    }
+
+    if (timerfd_settime(timerFd, 0, &spec, NULL) == -1)
+        throw Exception("timerfd_settime", true);
+    armedTimeout = nextTimeout;
+}
+
+void Worker::handleSignals()
+{
+    struct signalfd_siginfo info;
+    while (read(signalFd, &info, sizeof(info)) == sizeof(info))
+    {
+        switch (info.ssi_signo)
+        {
+            case SIGTERM:
+                syslog(LOG_INFO, "SIGTERM received");
+                stop();
+                break;
+            case SIGINT:
+                syslog(LOG_INFO, "SIGINT received");
+                stop();
+                break;
+            case SIGUSR1:
+                dumpStats();
+                break;
+        }
+    }
+}
+#endif
+
+#ifdef HAVE_IO_URING
+bool Worker::startUring()
+{
+    int echoHeader = echo ? Echo::headerSize() : Echo6::headerSize();
+    int recvBufferSize = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in6) +
+                         echoHeader + payloadBufferSize() + sizeof(TunnelHeader);
+    int sendBufferSize = echoHeader + payloadBufferSize() + sizeof(TunnelHeader);
+
+    try
+    {
+        uringState = new UringState(tun.frameSize(), tun.frameHeaderSize() + tunnelMtu,
+                                    sendBufferSize, recvBufferSize);
+    }
+    catch (Exception e)
+    {
+        syslog(LOG_WARNING, "%s, using epoll", e.errorMessage().data());
+        return false;
+    }
+
+    UringState &u = *uringState;
+    if (!u.ring.supports(IORING_OP_RECVMSG) || !u.ring.supports(IORING_OP_SENDMSG) ||
+        !u.ring.supports(IORING_OP_READ_FIXED) || !u.ring.supports(IORING_OP_WRITE_FIXED) ||
+        !u.ring.supports(IORING_OP_POLL_ADD) || !u.ring.supports(IORING_OP_ASYNC_CANCEL))
+    {
+        syslog(LOG_WARNING, "io_uring: operations missing in this kernel, using epoll");
+        stopUring();
+        return false;
+    }
+
+    if (!u.ring.setupBufferRing(URING_RECV_GROUP, &u.recvBuffers[0], u.recvBufferSize,
+                                HANS_URING_RECV_BUFFERS))
+    {
+        syslog(LOG_WARNING, "io_uring: provided buffer ring: %s, using epoll", strerror(errno));
+        stopUring();
+        return false;
+    }
+
+    struct iovec tunBuffers[HANS_URING_TUN_READS + HANS_URING_TUN_WRITES];
+    for (int i = 0; i < HANS_URING_TUN_READS + HANS_URING_TUN_WRITES; i++)
+    {
+        tunBuffers[i].iov_base = u.tunBuffer(i);
+        tunBuffers[i].iov_len = u.tunBufferSize(i);
+    }
+    u.fixedBuffers = u.ring.registerBuffers(tunBuffers, HANS_URING_TUN_READS + HANS_URING_TUN_WRITES);
+    if (!u.fixedBuffers)
+        syslog(LOG_WARNING, "io_uring: registering buffers: %s, using plain reads and writes", strerror(errno));
+
+    if (echo)
+        postEchoReceive(URING_ECHO);
+    if (echo6)
+        postEchoReceive(URING_ECHO6);
+    for (int i = 0; i < HANS_URING_TUN_READS; i++)
+        postTunRead(i);
+    postPoll(timerFd, URING_TIMER);
+    if (signalFd != -1)
+        postPoll(signalFd, URING_SIGNAL);
+    postPoll(wakeFd, URING_WAKEUP);
+
+    syslog(LOG_INFO, "using io_uring");
+    tunReadable = false;
+    return true;
+}
+
+/* Cancel everything still posted and wait until the kernel is done with the buffers. */
+void Worker::stopUring()
+{
+    UringState &u = *uringState;
+
+    if (u.inFlight > 0)
+    {
+        struct io_uring_sqe *sqe = u.ring.getSqe();
+        if (sqe)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+            sqe->user_data = uringTag(URING_CANCEL, 0);
+        }
+    }
+
+    while (u.inFlight > 0)
+    {
+        u.ring.submit(1);
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = u.ring.peekCqe()) != NULL)
+        {
+            if ((cqe->user_data >> 32) != URING_CANCEL && !(cqe->flags & IORING_CQE_F_MORE))
+                u.inFlight--;
+            u.ring.seenCqe();
+        }
+    }
+
+    /* the sends are done with the slots they referred to */
+    for (size_t i = 0; i < u.flushes.size(); i++)
+    {
+        for (size_t j = 0; j < u.flushes[i].poolSlots.size(); j++)
+            pool.release(u.flushes[i].poolSlots[j]);
+        for (size_t j = 0; j < u.flushes[i].paceSlots.size(); j++)
+            paceSlots.release(u.flushes[i].paceSlots[j]);
+    }
+    tunSlot = -1;
+    tunPayload = pool.data(0);
+
+    delete uringState;
+    uringState = NULL;
+}
+
+struct io_uring_sqe *Worker::uringSqe(int kind, int index)
+{
+    struct io_uring_sqe *sqe = uringState->ring.getSqe();
+    if (!sqe)
+        throw Exception("io_uring submission queue full");
+
+    sqe->user_data = uringTag(kind, index);
+    uringState->inFlight++;
+    return sqe;
+}
+
+void Worker::postEchoReceive(int kind)
+{
+    struct io_uring_sqe *sqe = uringSqe(kind, 0);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = kind == URING_ECHO ? echo->getFd() : echo6->getFd();
+    sqe->addr = (uintptr_t)&uringState->recvMsg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_RECV_GROUP;
+
+    uringState->echoArmed[kind == URING_ECHO ? 0 : 1] = true;
+}
+
+void Worker::postTunRead(int index)
+{
+    UringState &u = *uringState;
+    struct io_uring_sqe *sqe = uringSqe(URING_TUN_READ, index);
+    sqe->opcode = u.fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = tun.getFd();
+    sqe->addr = (uintptr_t)u.tunBuffer(index);
+    sqe->len = u.tunReadSize;
+    sqe->buf_index = index;
+}
+
+void Worker::postPoll(int fd, int kind)
+{
+    struct io_uring_sqe *sqe = uringSqe(kind, 0);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+}
+
+/* Queue echo sends from the front of `queue`; returns how many were taken.
+ * The ring sends after flushEcho, when the queue is reused: the headers are
+ * copied, the payloads sent from where they are, which holdForUringSends()
+ * keeps in place until then. */
+int Worker::queueUringSends(int fd, const MsgBatch &queue, int count)
+{
+    UringState &u = *uringState;
+
+    int i;
+    for (i = 0; i < count && !u.sendFree.empty(); i++)
+    {
+        int index = u.sendFree.back();
+        u.sendFree.pop_back();
+
+        UringState::Send &send = u.sends[index];
+        memcpy(u.sendBuffer(index), queue.buffer(i) + queue.offset(i), queue.length(i));
+        memcpy(&send.address, queue.address(i), queue.addressLength(i));
+        send.iov[0].iov_base = u.sendBuffer(index);
+        send.iov[0].iov_len = queue.length(i);
+        send.iov[1].iov_base = const_cast<char *>(queue.tail(i));
+        send.iov[1].iov_len = queue.tailLength(i);
+        memset(&send.msg, 0, sizeof(send.msg));
+        send.msg.msg_name = &send.address;
+        send.msg.msg_namelen = queue.addressLength(i);
+        send.msg.msg_iov = send.iov;
+        send.msg.msg_iovlen = queue.tailLength(i) ? 2 : 1;
+        if (queue.txTime(i))
+            MsgBatch::addTxTime(send.msg, send.control, queue.txTime(i));
+        send.flush = u.firstFlush + u.flushes.size();
+
+        struct io_uring_sqe *sqe = uringSqe(URING_SEND, index);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t)&send.msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT;
+    }
+    return i;
+}
+
+/* Keep what was sent from since the last flush until the `sends` this flush
+ * queued have completed. Returns false, reposting the tunnel reads handled
+ * since, if it queued none: the rest goes back right away. */
+bool Worker::holdForUringSends(int sends)
+{
+    UringState &u = *uringState;
+    if (sends == 0)
+    {
+        for (size_t i = 0; i < u.tunDone.size(); i++)
+            postTunRead(u.tunDone[i]);
+        u.tunDone.clear();
+        return false;
+    }
+
+    u.flushes.push_back(UringState::Flush());
+    UringState::Flush &flush = u.flushes.back();
+    flush.sends = sends;
+    flush.poolSlots.assign(poolSent.begin(), poolSent.end());
+    flush.paceSlots.assign(paceSent.begin(), paceSent.end());
+    flush.tunReads.swap(u.tunDone);
+    poolSent.clear();
+    paceSent.clear();
+    return true;
+}
+
+void Worker::completeUringSend(int index, int result)
+{
+    UringState &u = *uringState;
+    if (result < 0)
+        stats.addDroppedSendFail(1);
+    else
+        stats.addPacketsSent(1, result);
+    u.sendFree.push_back(index);
+
+    UringState::Flush &flush = u.flushes[u.sends[index].flush - u.firstFlush];
+    if (--flush.sends > 0)
+        return;
+
+    for (size_t i = 0; i < flush.poolSlots.size(); i++)
+        pool.release(flush.poolSlots[i]);
+    for (size_t i = 0; i < flush.paceSlots.size(); i++)
+        paceSlots.release(flush.paceSlots[i]);
+    for (size_t i = 0; i < flush.tunReads.size(); i++)
+        postTunRead(flush.tunReads[i]);
+    flush.poolSlots.clear();
+    flush.paceSlots.clear();
+    flush.tunReads.clear();
+
+    while (!u.flushes.empty() && u.flushes.front().sends == 0)
+    {
+        u.flushes.pop_front();
+        u.firstFlush++;
+    }
+}
+
+/* Wait until the sends of the oldest flush have completed, for its packet pool
+ * slots. Other completions are kept for reapUring(). */
+void Worker::waitForUringSends()
+{
+    UringState &u = *uringState;
+    uint32_t oldest = u.firstFlush;
+    while (!u.flushes.empty() && u.firstFlush == oldest)
+    {
+        u.ring.submit(1);
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = u.ring.peekCqe()) != NULL)
+        {
+            struct io_uring_cqe completion = *cqe;
+            u.ring.seenCqe();
+            if (!(completion.flags & IORING_CQE_F_MORE))
+                u.inFlight--;
+
+            if ((completion.user_data >> 32) == URING_SEND)
+                completeUringSend((uint32_t)completion.user_data, completion.res);
+            else
+                u.deferred.push_back(completion);
+        }
+    }
+}
+
+/* The next completion to handle, those kept by waitForUringSends() first. */
+bool Worker::nextUringCompletion(struct io_uring_cqe &cqe)
+{
+    UringState &u = *uringState;
+    if (!u.deferred.empty())
+    {
+        cqe = u.deferred.front();
+        u.deferred.pop_front();
+        return true;
+    }
+
+    struct io_uring_cqe *next = u.ring.peekCqe();
+    if (!next)
+        return false;
+    cqe = *next;
+    u.ring.seenCqe();
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+        u.inFlight--;
+    return true;
+}
+
+bool Worker::writeTunUring(const char *data, int length, bool isFrame)
+{
+    UringState &u = *uringState;
+    int header = isFrame ? 0 : tun.frameHeaderSize();
+    if (u.tunWriteFree.empty() || header + length > u.tunWriteSize)
+        return false;
+
+    int index = u.tunWriteFree.back();
+    u.tunWriteFree.pop_back();
+    memset(u.tunBuffer(index), 0, header);
+    memcpy(u.tunBuffer(index) + header, data, length);
+
+    struct io_uring_sqe *sqe = uringSqe(URING_TUN_WRITE, index);
+    sqe->opcode = u.fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = tun.getFd();
+    sqe->addr = (uintptr_t)u.tunBuffer(index);
+    sqe->len = header + length;
+    sqe->buf_index = index;
+    return true;
+}
+
+/* A completed read is one frame: a packet, handled where it was read, or a
+ * super-packet whose segments are cut into pool slots. The read is posted
+ * again once what was sent from it has gone. */
+bool Worker::readTunUring()
+{
+    UringState &u = *uringState;
+
+    for (;;)
+    {
+        if (u.tunFrame != -1)
+        {
+            int length;
+            if (tun.segmenting())
+                length = tun.nextPacket(nextTunPayloadBuffer());
+            else if ((length = tun.packetInPlace()) != -1)
+            {
+                tunSlot = -1;
+                tunPayload = u.tunBuffer(u.tunFrame) + tun.frameHeaderSize();
+            }
+
+            if (length != -1)
+            {
+                uint32_t sourceIp, destIp;
+                Tun::addresses(tunPayload, sourceIp, destIp);
+                tunPackets++;
+                handleTunData(length, sourceIp, destIp);
+                return true;
+            }
+
+            u.tunDone.push_back(u.tunFrame);
+            u.tunFrame = -1;
+        }
+
+        if (u.tunCompleted.empty())
+            return false;
+
+        u.tunFrame = u.tunCompleted.front().first;
+        tun.setFrame(u.tunBuffer(u.tunFrame), u.tunCompleted.front().second);
+        u.tunCompleted.pop();
+    }
+}
+
+void Worker::recycleReceiveBuffers()
+{
+    UringState &u = *uringState;
+    if (!u.recvUsed.empty())
+    {
+        for (size_t i = 0; i < u.recvUsed.size(); i++)
+            u.ring.provideBuffer(u.recvUsed[i]);
+        u.ring.commitBuffers();
+        u.recvUsed.clear();
+    }
+
+    if (echo && !u.echoArmed[0])
+        postEchoReceive(URING_ECHO);
+    if (echo6 && !u.echoArmed[1])
+        postEchoReceive(URING_ECHO6);
+}
+
+bool Worker::runUring()
+{
+    UringState &u = *uringState;
+    bool usable = true;
+
+    sigset_t oldSignals;
+    if (signalFd != -1)
+        pthread_sigmask(SIG_BLOCK, &handledSignals, &oldSignals);
+
+    while (alive && usable)
+    {
+        if (!paced.empty())
+            sendPaced();
+        flushEcho();
+
+        if (nextTimeout != armedTimeout)
+            armTimer();
+
+        bool busy = tunReadable || wakeReadable || !u.deferred.empty() || u.ring.peekCqe() != NULL;
+        if (busy)
+            spinUntil = now + busyPollBudget;
+        u.ring.submit(busy || now < spinUntil ? 0 : 1);
+
+        updateClock();
+        wokenAt = now;
+
+        usable = reapUring();
+        checkTimeout();
+    }
+
+    if (signalFd != -1)
+        pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+    if (!usable)
+        syslog(LOG_WARNING, "io_uring: multishot receive not supported, using epoll");
+    return usable;
+}
+
+/*
+ * Handle up to ECHO_BUDGET received datagrams and TUN_BUDGET tunnel packets.
+ * Received datagrams are dispatched in batches of one socket, in the same fair
+ * order as with recvmmsg; their buffers go back to the kernel afterwards.
+ * Returns false if the kernel rejects multishot receives.
+ */
+bool Worker::reapUring()
+{
+    UringState &u = *uringState;
+    int echoQuota = ECHO_BUDGET;
+    int batch = 0;
+    int batchKind = 0;
+    tunQuota = TUN_BUDGET;
+
+    struct io_uring_cqe cqe;
+    while (echoQuota > 0 && nextUringCompletion(cqe))
+    {
+        int kind = cqe.user_data >> 32;
+        int index = (uint32_t)cqe.user_data;
+        int result = cqe.res;
+        unsigned int flags = cqe.flags;
+
+        switch (kind)
+        {
+            case URING_ECHO:
+            case URING_ECHO6:
+            {
+                if (!(flags & IORING_CQE_F_MORE))
+                    u.echoArmed[kind == URING_ECHO ? 0 : 1] = false;
+
+                if (result < 0)
+                {
+                    if (result == -EINVAL)
+                        return false;
+                    if (result != -ENOBUFS)
+                        syslog(LOG_ERR, "error receiving icmp packet: %s", strerror(-result));
+                    break;
+                }
+
+                uint16_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+                u.recvUsed.push_back(id);
+
+                char *buffer = u.recvBuffer(id);
+                const struct io_uring_recvmsg_out *out = (const struct io_uring_recvmsg_out *)buffer;
+                if (out->flags & MSG_TRUNC)
+                    break;
+                const struct sockaddr *source = (const struct sockaddr *)(buffer + sizeof(*out));
+                char *data = buffer + sizeof(*out) + u.recvMsg.msg_namelen;
+
+                if (batch > 0 && (kind != batchKind || batch == RECV_BATCH_MAX))
+                {
+                    if (batchKind == URING_ECHO)
+                        dispatchEcho(batch);
+                    else
+                        dispatchEcho6(batch);
+                    batch = 0;
+                }
+                batchKind = kind;
+
+                ReceivedEcho &packet = received[batch];
+                if (kind == URING_ECHO)
+                {
+                    packet.length = Echo::decode(data, out->payloadlen, source,
+                                                 packet.ip, packet.reply, packet.id, packet.seq);
+                    if (packet.length == -1)
+                        break;
+                    packet.data = data + Echo::headerSize();
+                    receivedKeys[batch++] = packet.ip;
+                }
+                else
+                {
+                    packet.length = Echo6::decode(data, out->payloadlen, source,
+                                                  packet.ip6, packet.reply, packet.id, packet.seq);
+                    if (packet.length == -1)
+                        break;
+                    packet.data = data + Echo6::headerSize();
+                    receivedKeys[batch++] = ip6Key(packet.ip6);
+                }
+                stats.incPacketsReceived(packet.length);
+                echoQuota--;
+                break;
+            }
+            case URING_TUN_READ:
+                if (result > 0)
+                {
+                    u.tunCompleted.push(std::make_pair(index, result));
+                    tunReadable = true;
+                }
+                else if (result == 0)
+                    throw Exception("tunnel closed");
+                else
+                {
+                    if (result != -EAGAIN && result != -EINTR)
+                        syslog(LOG_ERR, "error reading from tun: %s", strerror(-result));
+                    postTunRead(index);
+                }
+                break;
+            case URING_TUN_WRITE:
+                if (result < 0)
+                    syslog(LOG_ERR, "error writing to tun: %s", strerror(-result));
+                u.tunWriteFree.push_back(index);
+                break;
+            case URING_SEND:
+                completeUringSend(index, result);
+                break;
+            case URING_TIMER:
+            {
+                uint64_t expirations;
+                if (read(timerFd, &expirations, sizeof(expirations)) == sizeof(expirations))
+                    armedTimeout = Time::ZERO;
+                postPoll(timerFd, URING_TIMER);
+                break;
+            }
+            case URING_SIGNAL:
+                handleSignals();
+                postPoll(signalFd, URING_SIGNAL);
+                break;
+            case URING_WAKEUP:
+            {
+                uint64_t wakeups;
+                if (read(wakeFd, &wakeups, sizeof(wakeups)) == sizeof(wakeups))
+                    wakeReadable = true;
+                postPoll(wakeFd, URING_WAKEUP);
+                break;
+            }
+        }
+    }
+
+    if (batch > 0)
+    {
+        if (batchKind == URING_ECHO)
+            dispatchEcho(batch);
+        else
+            dispatchEcho6(batch);
+    }
+    recycleReceiveBuffers();
+
+    while (tunReadable && tunQuota > 0)
+        drainTun(tunQuota < TUN_BATCH_MAX ? tunQuota : TUN_BATCH_MAX);
+
+    if (wakeReadable)
+        wakeReadable = handleWakeup();
+
+    return true;
+}
+#endif
+
+void Worker::checkTimeout()
+{
+    if (nextTimeout == Time::ZERO || now < nextTimeout)
+        return;
+
+    uint32_t data;
+    while (timers.expire(now, data))
+    {
+        if (data == TIMEOUT)
+        {
+            timeoutTimer = TimerWheel::NONE;
+            handleTimeout();
+        }
+        else
+            handleTimer(data);
+    }
+    updateNextTimeout();
+}
+
+/*
+ * Service the ready sources round-robin until each one is drained or has used
+ * its budget for this iteration: a receive batch per ICMP socket and a tunnel
+ * packet per round. Tunnel reads interleaved with a receive batch count against
+ * the tunnel budget. Whatever is left over keeps its ready flag and is picked up
+ * by the next iteration, after sends are flushed and timers have run.
+ */
+bool Worker::serviceSources()
+{
+    int echoQuota = ECHO_BUDGET;
+    int echo6Quota = ECHO_BUDGET;
+    int packets = tunPackets;
+    bool received = wakeReadable;
+    tunQuota = TUN_BUDGET;
+
+    if (wakeReadable)
+        wakeReadable = handleWakeup();
+
+    while ((echoReadable && echoQuota > 0) || (echo6Readable && echo6Quota > 0) ||
+           (tunReadable && tunQuota > 0))
+    {
+        if (echoReadable && echoQuota > 0)
+        {
+            int batch = echoQuota < RECV_BATCH_MAX ? echoQuota : RECV_BATCH_MAX;
+            int count = receiveEcho(batch);
+            echoReadable = count == batch;
+            received |= count > 0;
+            echoQuota -= batch;
+        }
+
+        if (echo6Readable && echo6Quota > 0)
+        {
+            int batch = echo6Quota < RECV_BATCH_MAX ? echo6Quota : RECV_BATCH_MAX;
+            int count = receiveEcho6(batch);
+            echo6Readable = count == batch;
+            received |= count > 0;
+            echo6Quota -= batch;
+        }
+
+        if (tunReadable && tunQuota > 0)
+            drainTun(tunQuota < TUN_BATCH_MAX ? tunQuota : TUN_BATCH_MAX);
+    }
+
+    return received || tunPackets != packets;
+}
+
+/*
+ * Put a receive batch in round-robin order over its sources: the n-th packet of
+ * every source is dispatched before the (n+1)-th packet of any source, so one
+ * busy client cannot push the others to the end of a large batch. Packets of the
+ * same source keep their arrival order.
+ */
+int Worker::fairOrder(int count)
+{
+    int maxRank = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int rank = 0;
+        for (int j = 0; j < i; j++)
+            if (receivedKeys[j] == receivedKeys[i])
+                rank++;
+        receivedRanks[i] = rank;
+        if (rank > maxRank)
+            maxRank = rank;
+    }
+
+    int n = 0;
+    for (int rank = 0; rank <= maxRank; rank++)
+        for (int i = 0; i < count; i++)
+            if (receivedRanks[i] == rank)
+                receivedOrder[n++] = i;
+    return n;
+}
+
+bool Worker::readTun()
+{
+#ifdef HAVE_IO_URING
+    if (uringState)
+        return readTunUring();
+#endif
+
+    uint32_t sourceIp, destIp;
+    int dataLength = tun.read(nextTunPayloadBuffer(), sourceIp, destIp);
+
+    if (dataLength == 0)
+        throw Exception("tunnel closed");
+
+    if (dataLength == -1)
+    {
+        releaseTunPayloadBuffer();
+        return false;
+    }
+
+    tunPackets++;
+    handleTunData(dataLength, sourceIp, destIp);
+#ifdef WIN32
+    return false; // blocking device: one read per readiness report
+#else
+    return true;
+#endif
+}
+
+/*
+ * Read up to maxPackets tunnel packets in a row, each straight into the next
+ * echo send slot and handed to handleTunData, without going back to the poller
+ * in between. Stops early once the device is empty.
+ */
+void Worker::drainTun(int maxPackets)
+{
+    int reads = 0;
+    int packets = tunPackets;
+    while (tunReadable && reads < maxPackets)
+    {
+        tunReadable = readTun();
+        reads++;
+    }
+    tunQuota -= reads;
+    stats.addTunBatch(tunPackets - packets);
+}
+
+/*
+ * While a batch is dispatched the tunnel is read once after every packet, the
+ * same one-to-one service ratio the loop had with single packet receives. Polls
+ * arriving in a batch are then spent on waiting tunnel data right away instead
+ * of piling up behind it.
+ */
+void Worker::serviceTunInBatch()
+{
+    if (tunReadable && tunQuota > 0)
+    {
+        tunQuota--;
+        tunReadable = readTun();
+    }
+}
+
+int Worker::receiveEcho(int maxPackets)
+{
+    int count = echo->receiveBatch(maxPackets);
+    int valid = 0;
+    if (count > 0)
+        updateClock();
+
+    for (int slot = 0; slot < count; slot++)
+    {
+        ReceivedEcho &packet = received[valid];
+        packet.length = echo->receivedPacket(slot, packet.ip, packet.reply, packet.id, packet.seq);
+        if (packet.length == -1)
+            continue;
+
+        packet.data = echo->receivePayloadBuffer(slot);
+        receivedKeys[valid++] = packet.ip;
+        stats.incPacketsReceived(packet.length);
+    }
+
+    dispatchEcho(valid);
+    echo->releaseReceived();
+    return count;
+}
+
+int Worker::receiveEcho6(int maxPackets)
+{
+    int count = echo6->receiveBatch(maxPackets);
+    int valid = 0;
+    if (count > 0)
+        updateClock();
+
+    for (int slot = 0; slot < count; slot++)
+    {
+        ReceivedEcho &packet = received[valid];
+        packet.length = echo6->receivedPacket(slot, packet.ip6, packet.reply, packet.id, packet.seq);
+        if (packet.length == -1)
+            continue;
+
+        packet.data = echo6->receivePayloadBuffer(slot);
+        receivedKeys[valid++] = ip6Key(packet.ip6);
+        stats.incPacketsReceived(packet.length);
+    }
+
+    dispatchEcho6(valid);
+    return count;
+}
+
+uint32_t Worker::ip6Key(const struct in6_addr &ip6)
+{
+    const uint32_t *words = (const uint32_t *)&ip6;
+    return words[0] ^ words[1] ^ words[2] ^ words[3];
+}
+
+void Worker::dispatchEcho(int count)
+{
+    int ordered = fairOrder(count);
+    for (int i = 0; i < ordered; i++)
+    {
+        const ReceivedEcho &packet = received[receivedOrder[i]];
+        currentRecvPayload = packet.data;
+
+        bool isValid = packet.length >= (int)sizeof(TunnelHeader);
+        if (isValid)
+        {
+            TunnelHeader *header = (TunnelHeader *)currentRecvPayload;
+
+            DEBUG_ONLY(
+                cout << "received: type " << header->type
+                     << ", length " << packet.length - sizeof(TunnelHeader)
+                     << ", id " << packet.id << ", seq " << packet.seq << endl);
+
+            isValid = handleEchoData(*header, packet.length - sizeof(TunnelHeader),
+                                     packet.ip, packet.reply, packet.id, packet.seq);
+        }
+
+        if (!isValid && !packet.reply && answerEcho)
+        {
+            echo->sendReply(currentRecvPayload, packet.length, packet.ip);
+            if (echo->sendQueueFull())
+                flushEcho();
+        }
+
+        if (i + 1 < ordered)
+            serviceTunInBatch();
+    }
+
+    flushTun();
+}
+
+void Worker::dispatchEcho6(int count)
+{
+    int ordered = fairOrder(count);
+    for (int i = 0; i < ordered; i++)
+    {
+        const ReceivedEcho &packet = received[receivedOrder[i]];
+        currentRecvPayload = packet.data;
+
+        bool isValid = packet.length >= (int)sizeof(TunnelHeader);
+        if (isValid)
+        {
+            TunnelHeader *header = (TunnelHeader *)currentRecvPayload;
+            isValid = handleEchoData6(*header, packet.length - sizeof(TunnelHeader),
+                                      packet.ip6, packet.reply, packet.id, packet.seq);
+        }
+
+        if (!isValid && !packet.reply && answerEcho)
+        {
+            echo6->sendReply(currentRecvPayload, packet.length, packet.ip6);
+            if (echo6->sendQueueFull())
+                flushEcho();
+        }
+
+        if (i + 1 < ordered)
+            serviceTunInBatch();
+    }
+
+    flushTun();
+}
+
+/*
+ * The sockets are asked to poll the device queue themselves while a read finds
+ * them empty (SO_BUSY_POLL), and to keep its interrupts off while they are
+ * being polled that often (SO_PREFER_BUSY_POLL). Neither is needed for the
+ * loop to spin, so failing to set them is not an error.
+ */
+void Worker::setBusyPoll(int us)
+{
+    busyPollBudget = Time::fromMicroseconds(us > 0 ? us : 0);
+    spinUntil = Time::ZERO;
+    if (us <= 0)
+        return;
+
+#ifdef LINUX
+    int fds[2] = { echo ? echo->getFd() : -1, echo6 ? echo6->getFd() : -1 };
+    for (int i = 0; i < 2; i++)
+    {
+        int prefer = 1;
+        if (fds[i] == -1)
+            continue;
+        if (setsockopt(fds[i], SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) == -1)
+            syslog(LOG_WARNING, "SO_BUSY_POLL: %s", strerror(errno));
+        else if (setsockopt(fds[i], SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) == -1)
+            syslog(LOG_DEBUG, "SO_PREFER_BUSY_POLL: %s", strerror(errno));
+    }
+#endif
+}
+
+void Worker::setKernelPacing()
+{
+    if (!pacer.isEnabled())
+    {
+        syslog(LOG_WARNING, "kernel pacing needs a rate (-R)");
+        return;
+    }
+    if ((echo && !echo->enableTxTime()) || (echo6 && !echo6->enableTxTime()))
+    {
+        syslog(LOG_WARNING, "SO_TXTIME: %s, pacing in userspace", strerror(errno));
+        return;
+    }
+    kernelPacing = true;
+}
+
+void Worker::setCongestionControl()
+{
+    congestionControl = true;
+}
+
+/* Offering less than 80% of what the pacing rate allowed makes a round
+ * application-limited. */
+void Worker::congestionRound(Time interval, uint64_t bytes, int packets, int lost, uint64_t offered)
+{
+    uint64_t allowed = (uint64_t)congestion.rateKbps() * interval.microseconds() / 8000;
+    congestion.onRound(interval, bytes, packets, lost, offered * 100 < allowed * 80);
+    pacer.setRate(congestion.rateKbps());
+}
+
+void Worker::setSequencing()
+{
+    syslog(LOG_WARNING, "sequencing (-N) is a client option");
+}
+
+Sequencing *Worker::newSequencing(int packets) const
+{
+    return new Sequencing(packets, useUring ? SEND_BATCH_MAX + HANS_URING_SENDS : SEND_BATCH_MAX, tunnelMtu);
+}
+
+void Worker::setFec()
+{
+    syslog(LOG_WARNING, "forward error correction (-F) is a client option");
+}
+
+Fec *Worker::newFec() const
+{
+    return new Fec(tunnelMtu + SendWindow::HEADER_SIZE);
+}
+
+/* Every packet of data, parity too, took a poll. */
+void Worker::receiveFromPeer(Peer &peer, TunnelHeader::Type type, int dataLength)
+{
+    int packetType = type;
+    const char *packet = echoReceivePayloadBuffer();
+    if (type == TunnelHeader::TYPE_FEC_PARITY)
+        peer.fec->decodeParity(packet, dataLength, stats);
+    else if (type == TunnelHeader::TYPE_DATA_FEC)
+        packet = peer.fec->decode(packet, dataLength, packetType, stats);
+    if (packet && type != TunnelHeader::TYPE_FEC_PARITY)
+        deliver(peer, packetType, packet, dataLength);
+
+    int length;
+    if (peer.fec && (packet = peer.fec->recovered(length, packetType)) != NULL)
+        deliver(peer, packetType, packet, length);
+    if (peer.sequencing)
+        sendNack(peer);
+    if (peer.fec && (length = peer.fec->report(echoSendPayloadBuffer())) > 0)
+        sendToPeer(peer, TunnelHeader::TYPE_FEC_PARITY, length);
+}
+
+void Worker::deliver(Peer &peer, int type, const char *data, int length)
+{
+    if (type == TunnelHeader::TYPE_DATA && length > 0)
+        sendToTun(data, length);
+    else if (type == TunnelHeader::TYPE_DATA_SEQ && peer.sequencing && length > SendWindow::HEADER_SIZE)
+    {
+        uint32_t seq;
+        memcpy(&seq, data, sizeof(seq));
+        if (peer.sequencing->receive.receive(ntohl(seq), stats))
+            sendToTun(data + SendWindow::HEADER_SIZE, length - SendWindow::HEADER_SIZE);
+    }
+    else
+        syslog(LOG_WARNING, "received empty data packet");
+}
+
+/* Resend what the peer missed. */
+void Worker::handleNack(Peer &peer, int dataLength)
+{
+    int ranges = dataLength / ReceiveWindow::NACK_RANGE_SIZE;
+    for (int i = 0; i < ranges; i++)
+    {
+        uint32_t first;
+        int count;
+        SendWindow::nackRange(echoReceivePayloadBuffer(), i, first, count);
+        for (int n = 0; n < count; n++)
+        {
+            int length;
+            const char *data = peer.sequencing->send.find(first + n, length);
+            if (!data)
+                continue;
+            sendToPeer(peer, TunnelHeader::TYPE_DATA_SEQ, length, data);
+            stats.incRetransmitted();
+        }
+    }
+}
+
+/* Called as data arrives, and every HANS_NACK_INTERVAL ms while packets are
+ * missing, so that the last packets of a burst are NACKed again too. */
+void Worker::sendNack(Peer &peer)
+{
+    int length = peer.sequencing->receive.nack(echoSendPayloadBuffer(), payloadBufferSize(), now, stats);
+    if (length > 0)
+    {
+        sendToPeer(peer, TunnelHeader::TYPE_NACK, length);
+        stats.incNacksSent();
+    }
+
+    if (peer.sequencing->receive.waiting() && peer.nackTimer == NO_TIMER)
+        peer.nackTimer = addTimer(HANS_NACK_INTERVAL, peer.timerData | NACK_TIMER);
+}
+
+/* Close a full block, or when flushing the block so far. A block left open is
+ * flushed HANS_FEC_FLUSH ms after its first packet, so that the tail of a burst
+ * is covered too. */
+void Worker::sendParity(Peer &peer, bool flush)
+{
+    Fec *fec = peer.fec;
+    int length = flush ? fec->flush(echoSendPayloadBuffer(), stats) : fec->parity(echoSendPayloadBuffer(), stats);
+    if (length > 0)
+        sendToPeer(peer, TunnelHeader::TYPE_FEC_PARITY, length);
+
+    if (fec->open() && peer.fecTimer == NO_TIMER)
+        peer.fecTimer = addTimer(HANS_FEC_FLUSH, peer.timerData | FEC_TIMER);
+    else if (!fec->open() && peer.fecTimer != NO_TIMER)
+    {
+        cancelTimer(peer.fecTimer);
+        peer.fecTimer = NO_TIMER;
+    }
+}
+
+void Worker::handlePeerTimer(Peer &peer, uint32_t data)
+{
+    if (data & FEC_TIMER)
+    {
+        peer.fecTimer = NO_TIMER;
+        if (peer.fec)
+            sendParity(peer, true);
+    }
+    else if (data & NACK_TIMER)
+    {
+        peer.nackTimer = NO_TIMER;
+        if (peer.sequencing)
+            sendNack(peer);
+    }
+}
+
+void Worker::endPeer(Peer &peer)
+{
+    if (peer.fecTimer != NO_TIMER)
+        cancelTimer(peer.fecTimer);
+    if (peer.nackTimer != NO_TIMER)
+        cancelTimer(peer.nackTimer);
+    peer.fecTimer = NO_TIMER;
+    peer.nackTimer = NO_TIMER;
+    delete peer.sequencing;
+    delete peer.fec;
+    peer.sequencing = NULL;
+    peer.fec = NULL;
+}
+
+void Worker::stop()
+{
+    __sync_fetch_and_and(&alive, 0); // from signal handlers and other threads
+    wake();
+}
+
+void Worker::wake()
+{
+#ifdef LINUX
+    uint64_t wakeups = 1;
+    if (write(wakeFd, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN)
+        syslog(LOG_ERR, "waking worker: %s", strerror(errno));
+#endif
+}
+
+void Worker::dropPrivileges()
+{
+    if (uid <= 0 || privilegesDropped)
+        return;
+
+#ifdef WIN32
     throw Exception("dropping privileges not supported");
 #else
     syslog(LOG_INFO, "dropping privileges");
@@ -360,11 +2050,9 @@ void Worker::handleTunData(int, uint32_t, uint32_t) { }
 
 void Worker::handleTimeout() { }
 
+void Worker::handleTimer(uint32_t) { }
+
 char *Worker::echoReceivePayloadBuffer()
 {
-    if (currentRecvFrom6 && echo6)
-        return echo6->receivePayloadBuffer() + sizeof(TunnelHeader);
-    if (echo)
-        return echo->receivePayloadBuffer() + sizeof(TunnelHeader);
-    return NULL;
+    return currentRecvPayload ? currentRecvPayload + sizeof(TunnelHeader) : NULL;
 }
@@ -24,12 +24,22 @@
 #include "echo.h"
 #include "echo6.h"
 #include "tun.h"
+#include "gro.h"
 #include "stats.h"
 #include "pacer.h"
+#include "congestion.h"
+#include "sequence.h"
+#include "fec.h"
+#include "uring.h"
+#include "packetpool.h"
+#include "timerwheel.h"
 
 #include <string>
+#include <vector>
+#include <deque>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <signal.h>
 
 class Worker
 {
@@ -38,12 +48,26 @@ public:
            uid_t uid, gid_t gid,
            int recvBufSize = 256 * 1024, int sndBufSize = 256 * 1024,
            int rateKbps = 0,
-           bool useIPv4 = true, bool useIPv6 = false);
+           bool useIPv4 = true, bool useIPv6 = false, bool useUring = false,
+           const std::string *ringDevice = NULL, Tun::Queue tunQueue = Tun::SINGLE_QUEUE);
     virtual ~Worker();
 
     virtual void run();
     virtual void stop();
-    void dumpStats() const { stats.dumpToSyslog(); }
+    virtual void dumpStats() const { stats.dumpToSyslog(); }
+    /* After receiving anything, keep reading without blocking for `us`
+     * microseconds before going back to sleep. 0 = always block. */
+    virtual void setBusyPoll(int us);
+    /* Leave pacing (-R) to the kernel: packets over the rate are sent right away
+     * with their departure time (SO_TXTIME), for the fq qdisc to hold (Linux). */
+    virtual void setKernelPacing();
+    /* Congestion control (client): rounds of feedback on what we send set the
+     * pacing rate, -R becoming its limit. */
+    virtual void setCongestionControl();
+    /* Ask the peer for sequenced data with NACK retransmission (client). */
+    virtual void setSequencing();
+    /* Ask the peer for forward error correction (client). */
+    virtual void setFec();
 
     static int headerSize() { return sizeof(TunnelHeader); }
 
@@ -73,7 +97,10 @@ protected:
             TYPE_POLL = 8,
             TYPE_SERVER_FULL = 9,
             TYPE_DATA_SEQ = 10,
-            TYPE_NACK = 11
+            TYPE_NACK = 11,
+            TYPE_PROBE = 12, // congestion feedback, answered right away
+            TYPE_DATA_FEC = 13,
+            TYPE_FEC_PARITY = 14
         };
 
         Magic magic;
@@ -85,32 +112,121 @@ protected:
     virtual bool handleEchoData6(const TunnelHeader &header, int dataLength,
                                  const struct in6_addr &realIp, bool reply, uint16_t id, uint16_t seq);
     virtual void handleTunData(int dataLength, uint32_t sourceIp,
-                               uint32_t destIp); // to echoSendPayloadBuffer
+                               uint32_t destIp); // in tunPayloadBuffer
     virtual void handleTimeout();
+    virtual void handleTimer(uint32_t data);
+    /* Called from the event loop after wake(); returns true if work is left for the next iteration. */
+    virtual bool handleWakeup() { return false; }
 
+    /* The payload is taken from echoSendPayloadBuffer(), or, if given, from `payload`,
+     * which is sent by reference and has to stay in place until flushEcho. */
     bool sendEcho(const TunnelHeader::Magic &magic, TunnelHeader::Type type,
-                  int length, uint32_t realIp, bool reply, uint16_t id, uint16_t seq);
+                  int length, uint32_t realIp, bool reply, uint16_t id, uint16_t seq,
+                  const char *payload = NULL);
     bool sendEcho6(const TunnelHeader::Magic &magic, TunnelHeader::Type type,
-                  int length, const struct in6_addr &realIp, bool reply, uint16_t id, uint16_t seq);
-    void sendToTun(int length); // from echoReceivePayloadBuffer
+                  int length, const struct in6_addr &realIp, bool reply, uint16_t id, uint16_t seq,
+                  const char *payload = NULL);
+    void sendToTun(const char *packet, int length); // may be held until flushTun
+    void flushTun();            // write the TCP segments coalesced so far
 
-    void setTimeout(Time delta);
+    void setTimeout(Time delta); // replaces the last one, calls handleTimeout()
+
+    /* Any number of timers calling handleTimer(data) once `delta` has passed.
+     * The returned timer can be cancelled until then. */
+    uint32_t addTimer(Time delta, uint32_t data);
+    void cancelTimer(uint32_t timer);
+    enum { NO_TIMER = TimerWheel::NONE };
+
+    /* A round of feedback from the peer on what we sent (see Congestion::onRound()),
+     * `offered` bytes having been sent or queued for the pacer meanwhile. */
+    void congestionRound(Time interval, uint64_t bytes, int packets, int lost, uint64_t offered);
+
+    /* Packets are sent from the send window by reference, so its payloads
+     * outlive a send batch, and the sends io_uring has in flight. The window
+     * resends the last `packets` packets. */
+    Sequencing *newSequencing(int packets) const;
+    Fec *newFec() const;
+
+    /* What a peer agreed on of sequenced data and forward error correction,
+     * and the timers that keep them going. */
+    struct Peer
+    {
+        Peer() : sequencing(NULL), fec(NULL), fecTimer(TimerWheel::NONE), nackTimer(TimerWheel::NONE),
+                 timerData(0) { }
+
+        Sequencing *sequencing; // NULL unless agreed on
+        Fec *fec;               // NULL unless agreed on
+        uint32_t fecTimer;      // flushes a block left open
+        uint32_t nackTimer;     // NACKs again while packets are missing
+        uint32_t timerData;     // of both timers, or'ed with their kind
+    };
+
+    /* Kinds of the timers of a peer, leaving the low bits for its timerData. */
+    enum { FEC_TIMER = 0x80000000, NACK_TIMER = 0x40000000, TIMER_KINDS = FEC_TIMER | NACK_TIMER };
+
+    /* How the client and the server send to a peer: the payload is taken from
+     * echoSendPayloadBuffer(), or, if given, from `payload` until flushEcho. */
+    virtual void sendToPeer(Peer &peer, TunnelHeader::Type type, int dataLength, const char *payload = NULL) = 0;
+    /* Data of any type from the peer, in echoReceivePayloadBuffer(): decode it,
+     * write what it holds to the tunnel and answer with NACKs and loss reports. */
+    void receiveFromPeer(Peer &peer, TunnelHeader::Type type, int dataLength);
+    void handleNack(Peer &peer, int dataLength);
+    void sendNack(Peer &peer);
+    void sendParity(Peer &peer, bool flush);
+    void handlePeerTimer(Peer &peer, uint32_t data); // of the TIMER_KINDS
+    void endPeer(Peer &peer); // drop what was agreed on, and its timers
+    void wake(); // interrupt the event loop, from any thread
 
     char *echoSendPayloadBuffer();
     char *echoSendPayloadBuffer6();
-    char *echoReceivePayloadBuffer();
+    char *echoReceivePayloadBuffer(); // payload of the packet being dispatched
+    /* The tunnel packet being handled. Tunnel packets are read into slots of a
+     * packet pool that only go back to it after flushEcho, so they can be sent
+     * by reference. */
+    char *tunPayloadBuffer() { return tunPayload; }
+    char *nextTunPayloadBuffer();
+    void releaseTunPayloadBuffer(); // nothing was put in the last one
+
+    /* Packets waiting in the pool: the tunnel packet being handled is kept in
+     * its slot, anything else is copied to one, as is a tunnel packet io_uring
+     * read in place. Returns the slot, or -1 if the slots set aside with
+     * reservePoolSlots() are all taken. */
+    int poolTunPayload(int length);
+    int poolCopy(const char *data, int length);
+    const char *sendPooled(int slot); // to send by reference, released by flushEcho
+    void dropPooled(int slot);
+    void reservePoolSlots(int packets); // before anything is read
 
-    int payloadBufferSize() { return tunnelMtu; }
+    int receiveEcho(int maxPackets);
+    int receiveEcho6(int maxPackets);
+    bool readTun();
+    void flushEcho(); // send everything queued by sendEcho/sendEcho6
+
+    /* Payloads hold a packet of the tunnel MTU, behind its sequence number
+     * in TYPE_DATA_SEQ, and that behind a header of forward error correction. */
+    static int payloadBufferSize(int tunnelMtu)
+    {
+        return tunnelMtu + SendWindow::HEADER_SIZE + Fec::PARITY_HEADER_SIZE;
+    }
+    int payloadBufferSize() { return payloadBufferSize(tunnelMtu); }
 
     void dropPrivileges();
 
     Echo *echo;
     Echo6 *echo6;
-    bool currentRecvFrom6;
+    char *currentRecvPayload;
+    bool tunReadable;
+    bool echoReadable;
+    bool echo6Readable;
+    bool wakeReadable;
+    int tunQuota; // tunnel reads left in this loop iteration
+    int tunPackets; // packets read from the tunnel so far
     Tun tun;
     Stats stats;
     Pacer pacer;
-    bool alive;
+    Congestion congestion;  // of what we send
+    bool congestionControl; // setCongestionControl() was called
+    volatile sig_atomic_t alive; // cleared by stop()
     bool answerEcho;
     int tunnelMtu;
     int maxTunnelHeaderSize;
@@ -121,9 +237,122 @@ protected:
 
     Time now;
     static const int RECV_BATCH_MAX;
+    static const int SEND_BATCH_MAX;
+    static const int TUN_BUDGET;
+    static const int TUN_BATCH_MAX;
+    static const int ECHO_BUDGET;
 
 private:
-    Time nextTimeout;
+    struct ReceivedEcho
+    {
+        char *data; // tunnel header and payload
+        int length;
+        bool reply;
+        uint16_t id;
+        uint16_t seq;
+        uint32_t ip;
+        struct in6_addr ip6;
+    };
+
+    void runSelect();
+    bool serviceSources(); // true if anything was read
+    void checkTimeout();
+    void updateNextTimeout();
+    static Time clockNow(); // HANS_COARSE_CLOCK decides which
+    void updateClock();     // of `now`, and the pacer
+    int fairOrder(int count);
+    void drainTun(int maxPackets);
+    void serviceTunInBatch();
+    void dispatchEcho(int count);
+    void dispatchEcho6(int count);
+    void writeTunFrames();
+    void deliver(Peer &peer, int type, const char *data, int length); // received data to the tunnel
+    static uint32_t ip6Key(const struct in6_addr &ip6);
+
+    enum { TIMEOUT = 0xffffffff }; // data of the setTimeout() timer
+
+    TimerWheel timers;
+    uint32_t timeoutTimer;
+    Time nextTimeout; // when the wheel needs checking, ZERO without timers
+    Time busyPollBudget;
+    Time spinUntil;  // keep polling without blocking until then
+    Time wokenAt;    // when the loop last returned from waiting, ZERO once sent
+    Gro *gro; // NULL without tunnel offloads
+
+    PacketPool pool;
+    std::vector<int> poolSent; // slots to release once flushEcho has sent them
+    int pooled;                // slots held by poolTunPayload() and poolCopy()
+    int poolReserved;
+    int tunSlot; // -1 if the tunnel packet is in an io_uring read buffer
+    char *tunPayload;
+
+    struct PacedEcho
+    {
+        int slot; // tunnel header and payload
+        int length;
+        bool isV6;
+        bool reply;
+        uint16_t id;
+        uint16_t seq;
+        uint32_t ip;
+        struct in6_addr ip6;
+    };
+
+    bool pace(const TunnelHeader::Magic &magic, TunnelHeader::Type type, int length,
+              uint32_t realIp, const struct in6_addr *realIp6, bool reply, uint16_t id, uint16_t seq,
+              const char *payload);
+    void sendPaced();
+    bool scheduleDeparture(int length, Time &departure);
+
+    PacketPool paceSlots;      // allocated once the first packet has to wait
+    std::deque<PacedEcho> paced;
+    std::vector<int> paceSent; // released by flushEcho like poolSent
+    Time paceAt;               // when the first of them may go, ZERO if none waits
+    bool kernelPacing;         // setKernelPacing() succeeded: nothing waits in `paced`
+
+#ifdef LINUX
+    void runEpoll();
+    void watch(int fd);
+    void armTimer();
+    void handleSignals();
+
+    int epollFd;
+    int timerFd;
+    int signalFd;
+    int wakeFd;
+    sigset_t handledSignals;
+    Time armedTimeout;
+#endif
+
+    bool useUring;
+#ifdef HAVE_IO_URING
+    struct UringState;
+
+    bool startUring();
+    bool runUring();
+    void stopUring();
+    bool reapUring();
+    struct io_uring_sqe *uringSqe(int kind, int index);
+    void postEchoReceive(int kind);
+    void postTunRead(int index);
+    void postPoll(int fd, int kind);
+    int queueUringSends(int fd, const MsgBatch &queue, int count);
+    bool holdForUringSends(int sends);
+    void completeUringSend(int index, int result);
+    void waitForUringSends();
+    bool nextUringCompletion(struct io_uring_cqe &cqe);
+    bool writeTunUring(const char *data, int length, bool isFrame = false);
+    bool readTunUring();
+    void recycleReceiveBuffers();
+
+    UringState *uringState;
+#endif
+
+    /* scratch space for ordering one receive batch */
+    std::vector<ReceivedEcho> received;
+    std::vector<uint32_t> receivedKeys;
+    std::vector<int> receivedRanks;
+    std::vector<int> receivedOrder;
 };
 
 #endif
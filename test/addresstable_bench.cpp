@@ -0,0 +1,193 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "addresstable.h"
+#include "addresspool.h"
+
+#include <map>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+/* Client lookups per packet, as the server does them: by tunnel address, through
+ * the AddressPool index, for packets from the tunnel, and by echo source, in an
+ * AddressTable, for packets from the network. Both should cost the same per
+ * lookup from 10 to 100k clients; std::map, which they replaced, is there for
+ * comparison. */
+
+enum { LOOKUPS = 4000000 };
+
+static int failures = 0;
+
+static double seconds()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec / 1e6;
+}
+
+static uint32_t nextRandom(uint32_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+/* Lookups go to clients in random order, so that the bigger tables do not fit in cache. */
+static std::vector<uint32_t> lookupOrder(int clients)
+{
+    std::vector<uint32_t> order(LOOKUPS);
+    uint32_t state = 2463534242u;
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = nextRandom(state) % clients;
+    return order;
+}
+
+/* Echo sources are spread across the Internet. */
+static uint32_t echoAddress(uint32_t client) { return addressHash(client + 1); }
+
+static struct in6_addr echoAddress6(uint32_t client)
+{
+    struct in6_addr address;
+    uint32_t words[4] = { htonl(0x20010db8), addressHash(client), 0, htonl(client) };
+    memcpy(&address, words, sizeof(address));
+    return address;
+}
+
+/* Every lookup must find its client; this also keeps the lookups from being optimised away. */
+static void check(uint32_t sum, const std::vector<uint32_t> &order, const char *table)
+{
+    uint32_t expected = 0;
+    for (size_t i = 0; i < order.size(); i++)
+        expected += order[i];
+    if (sum != expected)
+    {
+        fprintf(stderr, "addresstable_bench: %s returned wrong clients\n", table);
+        failures++;
+    }
+}
+
+/* As Server::clientForTunnelIp() in a /8 tunnel network served by one shard. */
+static double benchTunnel(int clients, const std::vector<uint32_t> &order)
+{
+    AddressPool addresses;
+    addresses.setup(2, 0xfffffe, 1, 2);
+    std::vector<uint32_t> table(addresses.size(), (uint32_t)AddressTable<uint32_t>::NONE);
+    std::vector<uint32_t> keys(clients);
+    for (int i = 0; i < clients; i++)
+    {
+        keys[i] = addresses.reserve();
+        table[addresses.index(keys[i])] = i;
+    }
+
+    uint32_t sum = 0;
+    double start = seconds();
+    for (size_t i = 0; i < order.size(); i++)
+        if (addresses.owns(keys[order[i]]))
+            sum += table[addresses.index(keys[order[i]])];
+    double elapsed = seconds() - start;
+
+    check(sum, order, "AddressPool");
+
+    return elapsed * 1e9 / order.size();
+}
+
+static double benchTable(int clients, const std::vector<uint32_t> &order)
+{
+    AddressTable<uint32_t> table;
+    std::vector<uint32_t> keys(clients);
+    for (int i = 0; i < clients; i++)
+    {
+        keys[i] = echoAddress(i);
+        table.insert(keys[i], i);
+    }
+
+    uint32_t sum = 0;
+    double start = seconds();
+    for (size_t i = 0; i < order.size(); i++)
+        sum += table.find(keys[order[i]]);
+    double elapsed = seconds() - start;
+
+    check(sum, order, "AddressTable<uint32_t>");
+
+    return elapsed * 1e9 / order.size();
+}
+
+static double benchTable6(int clients, const std::vector<uint32_t> &order)
+{
+    AddressTable<struct in6_addr> table;
+    std::vector<struct in6_addr> keys(clients);
+    for (int i = 0; i < clients; i++)
+    {
+        keys[i] = echoAddress6(i);
+        table.insert(keys[i], i);
+    }
+
+    uint32_t sum = 0;
+    double start = seconds();
+    for (size_t i = 0; i < order.size(); i++)
+        sum += table.find(keys[order[i]]);
+    double elapsed = seconds() - start;
+
+    check(sum, order, "AddressTable<in6_addr>");
+
+    return elapsed * 1e9 / order.size();
+}
+
+static double benchMap(int clients, const std::vector<uint32_t> &order)
+{
+    std::map<uint32_t, uint32_t> map;
+    std::vector<uint32_t> keys(clients);
+    for (int i = 0; i < clients; i++)
+    {
+        keys[i] = echoAddress(i);
+        map[keys[i]] = i;
+    }
+
+    uint32_t sum = 0;
+    double start = seconds();
+    for (size_t i = 0; i < order.size(); i++)
+        sum += map.find(keys[order[i]])->second;
+    double elapsed = seconds() - start;
+
+    check(sum, order, "std::map");
+
+    return elapsed * 1e9 / order.size();
+}
+
+int main()
+{
+    static const int clients[] = { 10, 100, 1000, 10000, 100000 };
+
+    printf("ns per lookup   tunnel IPv4   echo IPv4   echo IPv6   std::map IPv4\n");
+    for (size_t i = 0; i < sizeof(clients) / sizeof(clients[0]); i++)
+    {
+        std::vector<uint32_t> order = lookupOrder(clients[i]);
+        printf("%6d clients   %11.1f   %9.1f   %9.1f   %13.1f\n", clients[i],
+               benchTunnel(clients[i], order),
+               benchTable(clients[i], order),
+               benchTable6(clients[i], order),
+               benchMap(clients[i], order));
+    }
+
+    return failures ? 1 : 0;
+}
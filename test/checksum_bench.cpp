@@ -0,0 +1,218 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "checksum.h"
+
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+/* Checks every checksum kernel the CPU has against the scalar loop Checksum
+ * used before it was vectorised, and Checksum::update() against summing the
+ * whole packet again. Then times the kernels, and the fused copy against a
+ * memcpy followed by the scalar loop. */
+
+static int failures = 0;
+static volatile uint32_t sink; // keeps the timed sums from being optimised away
+
+#define CHECK(condition) \
+    do { if (!(condition)) { fprintf(stderr, "%s:%d: %s (%s)\n", __FILE__, __LINE__, #condition, Checksum::kernelName()); failures++; } } while (0)
+
+static const char *const kernels[] = { "avx2", "sse2", "words" };
+
+static double seconds()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec / 1e6;
+}
+
+static uint32_t nextRandom(uint32_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+/* The old Checksum::add(). Its sum overflows beyond about 128 KiB. */
+static uint32_t referenceAdd(uint32_t sum, const char *data, int length)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for (; length > 1; p += 2, length -= 2)
+        sum += (p[0] << 8) | p[1];
+    if (length)
+        sum += p[0] << 8;
+    return sum;
+}
+
+static uint16_t referenceChecksum(const char *data, int length)
+{
+    uint32_t sum = 0;
+    for (; length > 65536; data += 65536, length -= 65536)
+    {
+        sum = referenceAdd(sum, data, 65536);
+        while (sum >> 16)
+            sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return Checksum::fold(referenceAdd(sum, data, length));
+}
+
+/* Lengths around every vector and tail size, packet sizes, and a run long
+ * enough to make the vector kernels empty their 32-bit lanes. */
+static std::vector<int> testLengths()
+{
+    std::vector<int> lengths;
+    for (int length = 0; length <= 160; length++)
+        lengths.push_back(length);
+    lengths.push_back(1400);
+    lengths.push_back(1499);
+    lengths.push_back(9000);
+    lengths.push_back(65535);
+    lengths.push_back(300001);
+    return lengths;
+}
+
+static void checkKernel(const std::vector<char> &random, const std::vector<char> &ones)
+{
+    std::vector<int> lengths = testLengths();
+    std::vector<char> copy(random.size());
+
+    for (size_t i = 0; i < lengths.size(); i++)
+    {
+        int length = lengths[i];
+        for (int start = 0; start < 32; start += 7)
+        {
+            const char *data = &random[start];
+            CHECK(Checksum::fold(Checksum::add(0, data, length)) == referenceChecksum(data, length));
+            CHECK(Checksum::fold(Checksum::add(0, &ones[start], length)) == referenceChecksum(&ones[start], length));
+
+            memset(&copy[0], 0, length + 32);
+            uint32_t sum = Checksum::copy(&copy[start], data, length);
+            CHECK(Checksum::fold(sum) == referenceChecksum(data, length));
+            CHECK(memcmp(&copy[start], data, length) == 0);
+            CHECK(length + 32 > (int)copy.size() || copy[start + length] == 0);
+
+            /* summed in two parts, the second starting at an even or odd offset */
+            int split = length / 3;
+            sum = Checksum::add(Checksum::add(0, data, split), data + split, length - split, split);
+            CHECK(Checksum::fold(sum) == referenceChecksum(data, length));
+        }
+    }
+}
+
+/* RFC 1624, section 4: 0xdd2f with 0x5555 changed to 0x3285 becomes 0x0000. */
+static void checkUpdate(const std::vector<char> &random)
+{
+    CHECK(Checksum::update(0xdd2f, 0x5555, 0x3285) == 0x0000);
+
+    std::vector<char> packet(64);
+    uint32_t state = 88172645;
+    for (int i = 0; i < 100000; i++)
+    {
+        int length = 2 + 2 * (nextRandom(state) % 32);
+        memcpy(&packet[0], &random[i % 1024], length);
+        if (i % 8 == 0)
+            memset(&packet[0], i % 16 ? 0xff : 0, length); // sums that fold to either zero
+
+        int word = 2 * (nextRandom(state) % (length / 2));
+        uint16_t checksum = referenceChecksum(&packet[0], length);
+        uint16_t oldWord = ((unsigned char)packet[word] << 8) | (unsigned char)packet[word + 1];
+        uint16_t newWord = i % 3 ? nextRandom(state) : i % 2 ? 0xffff : 0;
+        packet[word] = newWord >> 8;
+        packet[word + 1] = newWord;
+
+        /* a packet of zeros sums to 0xffff but updates to 0x0000, the other zero (RFC 1624, section 3) */
+        uint16_t updated = Checksum::update(checksum, oldWord, newWord);
+        if (referenceAdd(0, &packet[0], length) == 0)
+            CHECK(updated == 0x0000);
+        else
+            CHECK(updated == referenceChecksum(&packet[0], length));
+    }
+}
+
+/* Rate at which `length` bytes are summed (or copied and summed), in GB/s. */
+static double rate(const char *data, char *to, int length, bool reference)
+{
+    int rounds = 400000000 / (length + 64);
+    uint32_t sum = 0;
+    double start = seconds();
+    for (int i = 0; i < rounds; i++)
+    {
+        if (reference)
+        {
+            if (to)
+                memcpy(to, data, length);
+            sum += referenceAdd(0, to ? to : data, length);
+        }
+        else if (to)
+            sum += Checksum::copy(to, data, length);
+        else
+            sum += Checksum::add(0, data, length);
+    }
+    double elapsed = seconds() - start;
+
+    sink = sum;
+    return (double)rounds * length / elapsed / 1e9;
+}
+
+int main()
+{
+    std::vector<char> random(300001 + 64);
+    std::vector<char> ones(random.size(), (char)0xff);
+    uint32_t state = 2463534242u;
+    for (size_t i = 0; i < random.size(); i++)
+        random[i] = nextRandom(state);
+
+    const char *selected = Checksum::kernelName();
+    std::vector<const char *> available;
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+        if (Checksum::useKernel(kernels[i]))
+        {
+            available.push_back(kernels[i]);
+            checkKernel(random, ones);
+            checkUpdate(random);
+        }
+    printf("checksum: kernels checked against the scalar loop, %s selected: %s\n",
+           selected, failures ? "FAILED" : "ok");
+
+    static const int sizes[] = { 64, 1400, 9000, 65535 };
+    std::vector<char> to(random.size());
+
+    printf("GB/s      scalar");
+    for (size_t k = 0; k < available.size(); k++)
+        printf("   %6s", available[k]);
+    printf("   memcpy+scalar   copy(%s)\n", selected);
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        printf("%5d   %8.1f", sizes[i], rate(&random[0], NULL, sizes[i], true));
+        for (size_t k = 0; k < available.size(); k++)
+        {
+            Checksum::useKernel(available[k]);
+            printf("   %6.1f", rate(&random[0], NULL, sizes[i], false));
+        }
+        Checksum::useKernel(selected);
+        printf("   %13.1f   %8.1f\n", rate(&random[0], &to[0], sizes[i], true),
+               rate(&random[0], &to[0], sizes[i], false));
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,134 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "server.h"
+#include "client.h"
+#include "hmac.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { if (!(condition)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+/* A version 2 request, as a client started with -w 20 -N -F sends it. */
+static void testVersion2()
+{
+    char data[sizeof(Server::ClientConnectData)];
+    int length = Server::writeConnectionRequest(data, 20, 0x0a010002,
+                                                Server::FEATURE_SEQUENCE | Server::FEATURE_FEC);
+
+    Server::ConnectionRequest request;
+    CHECK(Server::parseConnectionRequest(data, length, request));
+    CHECK(request.maxPolls == 20);
+    CHECK(request.desiredIp == 0x0a010002);
+    CHECK(request.features == (Server::FEATURE_SEQUENCE | Server::FEATURE_FEC));
+}
+
+/* Older clients leave the bytes after maxPolls as padding. */
+static void testLegacy()
+{
+    char data[sizeof(Server::ClientConnectDataLegacy)];
+    memset(data, 0, sizeof(data));
+    Server::ClientConnectDataLegacy *legacy = (Server::ClientConnectDataLegacy *)data;
+    legacy->maxPolls = 2;
+    legacy->desiredIp = htonl(0x0a010003);
+
+    Server::ConnectionRequest request;
+    CHECK(Server::parseConnectionRequest(data, sizeof(data), request));
+    CHECK(request.maxPolls == 2);
+    CHECK(request.desiredIp == 0x0a010003);
+    CHECK(request.features == 0);
+
+    data[1] = 1; // padding that fails the check byte
+    CHECK(Server::parseConnectionRequest(data, sizeof(data), request));
+    CHECK(request.maxPolls == 2);
+
+    CHECK(!Server::parseConnectionRequest(data, sizeof(data) - 1, request));
+}
+
+/* The challenge a server sends for `request`, answered by a client that
+ * asked for an HMAC or not; whether the server takes the response. */
+static bool authenticate(const Auth &serverAuth, const Auth &clientAuth, const char *request, int requestLength,
+                         bool askedHmac, int &challengeLength, int &responseLength)
+{
+    Server::ConnectionRequest parsed;
+    if (!Server::parseConnectionRequest(request, requestLength, parsed))
+        return false;
+    bool hmac = (parsed.features & Server::FEATURE_HMAC) != 0;
+    Auth::Challenge challenge = serverAuth.generateChallenge(Server::challengeSize(parsed.features));
+    challengeLength = challenge.size();
+
+    char response[64];
+    responseLength = Client::challengeResponse(clientAuth, askedHmac, &challenge[0], challenge.size(), response);
+    return responseLength > 0 && serverAuth.checkResponse(challenge, hmac, response, responseLength);
+}
+
+static void testHmacNegotiation()
+{
+    Auth auth("secret");
+    char request[sizeof(Server::ClientConnectData)];
+    int challengeLength, responseLength;
+
+    /* a client asking for HMAC gets the longer challenge and answers with an HMAC */
+    int length = Server::writeConnectionRequest(request, 10, 0, Server::FEATURE_SEQUENCE | Server::FEATURE_HMAC);
+    CHECK(authenticate(auth, auth, request, length, true, challengeLength, responseLength));
+    CHECK(challengeLength == HMAC_CHALLENGE_SIZE);
+    CHECK(responseLength == (int)Hmac::SHA256_SIZE);
+
+    /* a version 2 client not asking, like those of before the feature, stays on SHA1 */
+    length = Server::writeConnectionRequest(request, 10, 0, Server::FEATURE_SEQUENCE);
+    CHECK(authenticate(auth, auth, request, length, false, challengeLength, responseLength));
+    CHECK(challengeLength == CHALLENGE_SIZE);
+    CHECK(responseLength == (int)sizeof(Auth::Response));
+
+    /* a server not knowing the feature sends the short challenge: SHA1 */
+    Auth::Challenge challenge = auth.generateChallenge(CHALLENGE_SIZE);
+    char response[64];
+    responseLength = Client::challengeResponse(auth, true, &challenge[0], challenge.size(), response);
+    CHECK(responseLength == (int)sizeof(Auth::Response));
+    CHECK(auth.checkResponse(challenge, false, response, responseLength));
+
+    /* a client that did not ask rejects the longer challenge */
+    challenge = auth.generateChallenge(HMAC_CHALLENGE_SIZE);
+    CHECK(Client::challengeResponse(auth, false, &challenge[0], challenge.size(), response) == 0);
+
+    /* and a wrong passphrase fails either way */
+    Auth other("other");
+    length = Server::writeConnectionRequest(request, 10, 0, Server::FEATURE_HMAC);
+    CHECK(!authenticate(auth, other, request, length, true, challengeLength, responseLength));
+    length = Server::writeConnectionRequest(request, 10, 0, 0);
+    CHECK(!authenticate(auth, other, request, length, false, challengeLength, responseLength));
+}
+
+int main()
+{
+    testVersion2();
+    testLegacy();
+    testHmacNegotiation();
+
+    if (failures)
+        return 1;
+    printf("connect_request: ok\n");
+    return 0;
+}